@@ -0,0 +1,99 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <utility.hpp>
+#include <interpreter.hpp>
+#include <scene.hpp>
+#include <transformedobject.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Keyframes of the camera and of objects, read from a file next to the RTI file.
+     * Every line sets a key at a frame with the syntax of RTI files, values between keys are interpolated linearly:
+     *   frames := 120              Amount of frames
+     *   @0 eyepos := -6.0 0.0 0.0  Position of the eye, or lookat for the point it looks at
+     *   @119 !v #y= 6.2832         Transformation of an object: += moves, *= scales, #x=, #y= and #z= rotate
+     * Object transformations are applied on top of the transformation the object has in the RTI file, in the order
+     * scale, rotate around x, y and z, then move. Only objects placed at the top of the tree as instances can be animated.
+     */
+    class Animation
+    {
+    public:
+        // Amount of frames
+        unsigned frames;
+
+        /**
+         * @brief Construct an animation of one frame without keys
+         * 
+         */
+        Animation() : frames(1) {}
+
+        /**
+         * @brief Reads the keyframes from a file
+         * 
+         * @param path The path of the file
+         * @throws Utility::MISSING_FILE_EXCEPTION if the file can't be opened
+         * @throws Utility::WRONG_FORMAT_EXCEPTION if a line can't be read
+         */
+        void load(const std::string& path);
+        /**
+         * @brief Finds the instances of all animated objects
+         * 
+         * @param inp The interpreter after reading the RTI file
+         * @param scene The scene built from it
+         * @throws Utility::WRONG_OBJECT_HIERARCHY_EXCEPTION if an object doesn't exist or isn't an instance
+         */
+        void bind(const Interpreter& inp, const Scene& scene);
+        /**
+         * @brief Sets the camera variables that have keys to their values at a frame
+         * 
+         * @param frame The frame
+         * @param variables The variables, eyepos_* and lookat_* are changed
+         */
+        void camera(unsigned frame, std::map<std::string, double>& variables) const;
+        /**
+         * @brief Transforms the instances of every object that moved since the last frame applied. Call Scene::update() afterwards.
+         * 
+         * @param frame The frame
+         * @param scene The scene bind() was called with
+         * @return True if any instance was transformed
+         */
+        bool apply(unsigned frame, Scene& scene);
+
+    private:
+        // A value set at a frame
+        struct Key {
+            unsigned frame;
+            Utility::Vec3 value;
+        };
+        // Keys of one value, sorted by their frame
+        typedef std::vector<Key> Channel;
+
+        // An object with its keys and instances
+        struct AnimatedObject {
+            // Keys by the transformation they set
+            std::map<TransformOps, Channel> channels;
+            // The instances of the object with their transformation from the RTI file
+            std::vector<unsigned> instances;
+            std::vector<Utility::Matrix4x4> matrices, invmatrices;
+            // The transformation applied last, to skip frames in which the object doesn't move
+            Utility::Matrix4x4 last;
+            bool applied;
+        };
+
+        // Keys of eyepos and lookat
+        std::map<std::string, Channel> cameraKeys;
+        // Animated objects by their name
+        std::map<std::string, AnimatedObject> objects;
+
+        // Adds a key to a channel, a later key at the same frame replaces the earlier one
+        static void addKey(Channel& channel, unsigned frame, const Utility::Vec3& value);
+        // The interpolated value of a channel at a frame
+        static Utility::Vec3 sample(const Channel& channel, unsigned frame);
+    };
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+#include <opencl.hpp>
+#include <renderer.hpp>
+#include <devicecache.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Finds the fastest work group sizes of the ray kernels on a device.
+     * Sizes are tuned once per device by rendering a built in calibration scene with every candidate,
+     * and kept in a cache file so later runs on the same device and driver can use them right away.
+     */
+    class Autotuner
+    {
+    public:
+        // File the tuned sizes of all devices are kept in
+        static constexpr const char* CACHE_FILE = "workgroups.cache";
+
+        /**
+         * @brief Returns the work group sizes for a device, tuning them if they aren't cached yet
+         * 
+         * @param device The device, its program has to contain the ray kernels
+         * @param retune True to tune the sizes even if they are cached
+         * @return The work group sizes
+         */
+        static Workgroups workgroups(Device& device, bool retune);
+
+    private:
+        // Renders the calibration scene with every candidate and returns the fastest sizes
+        static Workgroups tune(Device& device);
+        // Renders a few times and returns the fastest time of every step, summed over all levels or only of the primary rays
+        static Renderer::LevelTiming measure(Renderer& renderer, bool primaryOnly);
+    };
+
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <vector>
+
+#include <utility.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Axis aligned bounding box
+     * 
+     */
+    struct AABB {
+        // Lower corner
+        Utility::Vec3 lo;
+        // Upper corner
+        Utility::Vec3 hi;
+
+        /**
+         * @brief Construct an empty box that contains nothing
+         * 
+         */
+        AABB() : lo(1e300, 1e300, 1e300), hi(-1e300, -1e300, -1e300) {}
+        /**
+         * @brief Construct a box from its corners
+         * 
+         * @param lo The lower corner
+         * @param hi The upper corner
+         */
+        AABB(const Utility::Vec3& lo, const Utility::Vec3& hi) : lo(lo), hi(hi) {}
+
+        /**
+         * @brief Check if this box contains nothing
+         * 
+         * @return True if nothing was added to the box yet
+         */
+        inline bool empty() const noexcept { return lo.x() > hi.x(); }
+        /**
+         * @brief Grows the box so that it contains another one
+         * 
+         * @param other The box that should be contained
+         */
+        void grow(const AABB& other) noexcept;
+        /**
+         * @brief Computes the part of this box that is also inside another one
+         * 
+         * @param other The other box
+         * @return The overlap, empty if the boxes don't overlap
+         */
+        AABB overlap(const AABB& other) const noexcept;
+        /**
+         * @brief Center of the box
+         * 
+         * @return The center
+         */
+        inline Utility::Vec3 centroid() const noexcept { return (lo + hi) * 0.5; }
+        /**
+         * @brief Surface area of the box, used to judge the quality of a hierarchy
+         * 
+         * @return The surface area, 0 for an empty box
+         */
+        double surface() const noexcept;
+        /**
+         * @brief Computes the box containing this box after an affine transformation
+         * 
+         * @param mat The transformation matrix, the last row is ignored
+         * @return The transformed box
+         */
+        AABB transformed(const Utility::Matrix4x4& mat) const noexcept;
+    };
+
+    /**
+     * @brief A bounding volume hierarchy over a list of boxes.
+     * Both children of a node are stored next to each other, so a node only needs the index of its left child.
+     */
+    class BVH
+    {
+    public:
+        /**
+         * @brief A node in the hierarchy
+         * 
+         */
+        struct Node {
+            // Bounds of everything below this node
+            AABB box;
+            // Index of the left child for inner nodes, index of the first item for leaves
+            unsigned first;
+            // Amount of items in a leaf, 0 for inner nodes
+            unsigned count;
+        };
+
+        // Maximum amount of items in a leaf
+        static constexpr unsigned LEAF_SIZE = 4;
+        // Maximum depth of the hierarchy, corresponds to the traversal stack size on the device
+        static constexpr unsigned MAX_DEPTH = 32;
+        // The hierarchy should be rebuilt once refitting made it this much worse than right after building it
+        static constexpr double REBUILD_RATIO = 1.5;
+        // Levels with less dirty nodes than this are refit on the calling thread
+        static constexpr unsigned PARALLEL_THRESHOLD = 4096;
+
+        // All nodes, the root is the first one
+        std::vector<Node> nodes;
+        // Item indices in leaf order, the leaves reference ranges in here
+        std::vector<unsigned> order;
+        // Parent of every node, the root is its own parent
+        std::vector<unsigned> parents;
+        // Level of every node, the root is on level 0
+        std::vector<unsigned> levels;
+        // Leaf containing every item
+        std::vector<unsigned> leaves;
+        // Depth of the deepest leaf
+        unsigned depth;
+
+        /**
+         * @brief Construct an empty hierarchy
+         * 
+         */
+        BVH() : depth(0), sah(0.), builtCost(0.), stamp(0) {}
+
+        /**
+         * @brief Builds the hierarchy by splitting the items at the median of their centers along the longest axis
+         * 
+         * @param bounds The bounds of all items
+         */
+        void build(const std::vector<AABB>& bounds);
+        /**
+         * @brief Updates the bounds of all nodes above moved items, bottom-up and level by level.
+         * The work only depends on the amount of moved items, not on the size of the hierarchy.
+         * 
+         * @param bounds The bounds of all items, including the moved ones
+         * @param moved The items whose bounds changed since the last build or refit
+         * @return All nodes whose bounds were updated
+         */
+        std::vector<unsigned> refit(const std::vector<AABB>& bounds, const std::vector<unsigned>& moved);
+        /**
+         * @brief Surface area heuristic cost of the hierarchy, relative to the surface of the root
+         * 
+         * @return The cost, 0 for an empty hierarchy
+         */
+        double cost() const noexcept;
+        /**
+         * @brief Check if refitting degraded the hierarchy so much that it should be rebuilt
+         * 
+         * @return True if the cost grew by more than REBUILD_RATIO since the last build
+         */
+        inline bool degraded() const noexcept { return cost() > REBUILD_RATIO * builtCost; }
+
+    private:
+        // Unnormalized surface area heuristic, kept up to date during refits
+        double sah;
+        // Cost right after the last build
+        double builtCost;
+        // Marks nodes already collected by the current refit, a node is marked if it equals stamp
+        std::vector<unsigned> marks;
+        unsigned stamp;
+
+        // Weight of a node in the surface area heuristic
+        inline double weight(unsigned node) const noexcept { return nodes[node].count > 0 ? nodes[node].count : 1.; }
+        // Recomputes the bounds of a node from its children or items
+        void update(const std::vector<AABB>& bounds, unsigned node);
+        // Builds the subtree of a node containing order[first, first + count)
+        void split(const std::vector<AABB>& bounds, unsigned node, unsigned first, unsigned count, unsigned level);
+    };
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+#include <opencl.hpp>
+#include <interpreter.hpp>
+#include <scene.hpp>
+#include <shading.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief A small built in scene used to measure devices and kernels.
+     * It is rendered quickly, but has enough bounces and shadow rays to show how the kernels behave. Only unions
+     * are used, so it runs with the kernel compiled for any other scene.
+     */
+    class CalibrationScene
+    {
+    public:
+        // The interpreted scene
+        Interpreter inp;
+        // The scene as it is uploaded
+        Scene scene;
+        // Materials, lights and settings of the scene
+        Shading shading;
+        // Origins of the primary rays
+        std::vector<cl_float4> rayStarts;
+        // Directions of the primary rays
+        std::vector<cl_float4> rayDirs;
+        // Width of the image
+        uint width;
+        // Amount of levels of reflection
+        unsigned depth;
+
+        /**
+         * @brief Builds the calibration scene
+         * 
+         */
+        CalibrationScene();
+    };
+
+}
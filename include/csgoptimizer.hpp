@@ -0,0 +1,97 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <object.hpp>
+#include <complexobject.hpp>
+#include <bvh.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Rewrites a shortened object tree so it is cheaper to trace without changing what it looks like.
+     * Chains of unions and intersections are collected into lists, intersections and subtractions whose
+     * operands can't overlap are removed, and the lists are rebuilt as balanced trees. Left-leaning chains of
+     * subtractions become a single subtraction of a balanced union. Subtrees shared by instances stay shared.
+     */
+    class CsgOptimizer
+    {
+    public:
+        // Amount of complex objects before optimizing
+        unsigned nodesBefore;
+        // Amount of complex objects after optimizing
+        unsigned nodesAfter;
+        // Height of the csg tree before optimizing
+        unsigned heightBefore;
+        // Height of the csg tree after optimizing
+        unsigned heightAfter;
+        // Intersections and subtractions removed because their operands can't overlap
+        unsigned pruned;
+
+        /**
+         * @brief Construct a new CsgOptimizer object
+         * 
+         */
+        CsgOptimizer() : nodesBefore(0), nodesAfter(0), heightBefore(0), heightAfter(0), pruned(0) {}
+
+        /**
+         * @brief Optimizes an object tree, has to be called after Interpreter::shorten
+         * 
+         * @param top The top object of the tree
+         * @return The top object of the optimized tree. If the whole tree turns out to be empty, the original one is kept
+         */
+        std::shared_ptr<Object> optimize(const std::shared_ptr<Object>& top);
+
+        /**
+         * @brief Counts the different complex objects in a tree
+         * 
+         * @param top The top object of the tree
+         * @return The amount of complex objects
+         */
+        static unsigned countNodes(const std::shared_ptr<Object>& top);
+        /**
+         * @brief Computes the height of a csg tree
+         * 
+         * @param top The top object of the tree
+         * @return The most complex objects on a path from the top object to a base object
+         */
+        static unsigned height(const std::shared_ptr<Object>& top);
+
+    private:
+        // Bounds of an object, empty if the object contains nothing
+        struct Bounds {
+            AABB box;
+            bool unbounded;
+        };
+
+        // Optimized version of every object already visited, nullptr if it contains nothing
+        std::map<const Object*, std::shared_ptr<Object>> done;
+        // Bounds of every optimized object
+        std::map<const Object*, Bounds> bounds;
+        // Complex subtrees that have instances
+        std::set<const Object*> instanced;
+
+        // Finds all complex subtrees that have instances
+        void findInstanced(const std::shared_ptr<Object>& obj);
+        // Optimizes a subtree
+        std::shared_ptr<Object> visit(const std::shared_ptr<Object>& obj);
+        // Collects the operands of a chain of the same operation, subtrees with instances aren't split up unless they are the root
+        void collect(const std::shared_ptr<Object>& obj, ComplexOps op, std::vector<std::shared_ptr<Object>>& operands, bool root);
+        // Returns the operands of a chain of the same operation
+        std::vector<std::shared_ptr<Object>> collected(const std::shared_ptr<Object>& obj, ComplexOps op);
+        // Builds a balanced tree combining all operands with the same operation
+        static std::shared_ptr<Object> balance(const std::vector<std::shared_ptr<Object>>& operands, size_t first, size_t count, ComplexOps op);
+        // Computes the bounds of an optimized subtree
+        Bounds getBounds(const std::shared_ptr<Object>& obj);
+        // Checks if two objects can overlap
+        bool overlaps(const std::shared_ptr<Object>& a, const std::shared_ptr<Object>& b);
+        // Counts the complex objects below an object
+        static void countNodes(const std::shared_ptr<Object>& obj, std::set<const Object*>& seen);
+        // Computes the height below an object
+        static unsigned height(const std::shared_ptr<Object>& obj, std::map<const Object*, unsigned>& heights);
+    };
+
+}
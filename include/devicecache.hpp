@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+
+#include <opencl.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief A text file keeping measured values per device, one line per device and driver version.
+     * Every line is the key of a device, a tab and the values, so the file can be read and edited by hand.
+     */
+    class DeviceCache
+    {
+    public:
+        /**
+         * @brief Construct a cache kept in a file
+         * 
+         * @param path The path of the file, it is created when the first values are written
+         */
+        DeviceCache(const std::string& path) : path(path) {}
+
+        /**
+         * @brief Reads the values of a device
+         * 
+         * @param info The device
+         * @param values Set to the values if they are found
+         * @return True if the cache contains values for the device
+         */
+        bool get(const Device_Info& info, std::string& values) const;
+        /**
+         * @brief Writes the values of a device, replacing older ones
+         * 
+         * @param info The device
+         * @param values The values, must not contain line breaks
+         */
+        void set(const Device_Info& info, const std::string& values) const;
+
+    private:
+        // Path of the file
+        std::string path;
+
+        // Identifies a device and its driver
+        static std::string key(const Device_Info& info);
+    };
+
+}
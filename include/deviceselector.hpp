@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <opencl.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Chooses the device to render on.
+     * Instead of estimating the performance of every device from its name and specifications, each one renders the
+     * calibration scene once and the measured speed is kept in a cache file, so the fastest device is known for sure.
+     */
+    class DeviceSelector
+    {
+    public:
+        // File the measured speed of all devices is kept in
+        static constexpr const char* CACHE_FILE = "devices.cache";
+
+        /**
+         * @brief Selects a device
+         * 
+         * @param device A device id or a part of a device name to use that device, empty to choose the fastest one
+         * @param mode "benchmark" to measure the speed of the devices, "flops" to use the estimated floating point performance
+         * @param remeasure True to measure the devices even if their speed is cached
+         * @return The device
+         */
+        static Device_Info select(const std::string& device, const std::string& mode, bool remeasure);
+        /**
+         * @brief Selects several devices to render on at once
+         * 
+         * @param devices Device ids or parts of device names separated by commas, empty to use all devices
+         * @return The devices
+         */
+        static std::vector<Device_Info> selectAll(const std::string& devices);
+
+    private:
+        // Finds a device by its id or a part of its name, case insensitive
+        static unsigned find(const std::vector<Device_Info>& devices, const std::string& device);
+        // Renders the calibration scene on a device and returns the million primary rays per second
+        static double benchmark(const Device_Info& info);
+    };
+
+}
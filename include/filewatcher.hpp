@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace Raytracing {
+
+    /**
+     * @brief Tells when a file was saved again, by polling its modification time and size.
+     * A file that can't be read right now, i.e. while an editor replaces it, counts as unchanged.
+     */
+    class FileWatcher
+    {
+    public:
+        // Time between two looks at the file
+        static constexpr std::chrono::milliseconds POLL_INTERVAL { 250 };
+
+        /**
+         * @brief Starts watching a file as it is now
+         * 
+         * @param path The path of the file
+         */
+        explicit FileWatcher(const std::string& path);
+
+        /**
+         * @brief Returns if the file changed since the last call that returned true, looks at the file at most once per POLL_INTERVAL
+         * 
+         */
+        bool changed();
+
+    private:
+        const std::string path;
+        std::filesystem::file_time_type time;
+        std::uintmax_t size;
+        std::chrono::steady_clock::time_point lastPoll;
+
+        // Reads the modification time and size, returns false if the file can't be read
+        bool stat(std::filesystem::file_time_type& time, std::uintmax_t& size) const;
+    };
+
+}
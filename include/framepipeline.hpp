@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include <opencl.hpp>
+#include <renderer.hpp>
+#include <framewriter.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Keeps several frames in flight, so the kernels of the next frame are enqueued while the last frame is read back and
+     * encoded. Every slot holds the host buffer one frame is read into and the event telling when it arrived.
+     * The device buffers are shared by all slots, the queue of the device runs the frames one after another.
+     */
+    class FramePipeline
+    {
+    public:
+        // Frames in flight at most
+        static constexpr unsigned SLOTS = 2;
+
+        /**
+         * @brief Construct a pipeline without frames in flight
+         * 
+         * @param renderer The renderer tracing the frames
+         * @param writer The writer the finished frames are handed to
+         */
+        FramePipeline(Renderer& renderer, FrameWriter& writer);
+
+        /**
+         * @brief Enqueues tracing a frame and reading it back. If all slots are in flight, the oldest frame is waited for and handed
+         * to the writer first.
+         * 
+         * @param frame Number of the frame
+         */
+        void render(unsigned frame);
+        /**
+         * @brief Waits for all frames in flight and hands them to the writer
+         * 
+         */
+        void flush();
+        /**
+         * @brief Returns the time spent waiting for frames to arrive on the host
+         * 
+         * @return The time in seconds
+         */
+        inline double waited() const noexcept { return waitTime; }
+
+    private:
+        // A frame in flight
+        struct Slot {
+            unsigned frame;
+            std::vector<float> raw;
+            cl::Event done;
+            bool busy;
+        };
+
+        Renderer& renderer;
+        FrameWriter& writer;
+        std::vector<Slot> slots;
+        // The slot the next frame goes to, which also holds the oldest frame in flight
+        unsigned next;
+        double waitTime;
+
+        // Waits for the frame of a slot and hands it to the writer
+        void retire(Slot& slot);
+    };
+
+}
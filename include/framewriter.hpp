@@ -0,0 +1,120 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencl.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Writes the frames of an animation on a pool of threads, so the next frames are traced while the last ones are encoded.
+     * Frames go to numbered image files, which are encoded in parallel, or are streamed one after another as raw RGB, RGBA or Y4M
+     * into a file, a named pipe, stdout or a Unix domain socket, which is written by one thread to keep the frames in order.
+     * Frames are converted straight from the colors read back from the device. At most MAX_PENDING frames per thread wait to be
+     * written, so a slow consumer of a stream holds up the render loop instead of frames piling up in memory.
+     */
+    class FrameWriter
+    {
+    public:
+        // Frames waiting to be written per thread at most, adding another one waits until the oldest is taken
+        static constexpr size_t MAX_PENDING = 2;
+        // Threads encoding image files at most
+        static constexpr unsigned MAX_THREADS = 8;
+
+        /**
+         * @brief Opens the output and starts the writing threads
+         * 
+         * @param output A path with a run of # replaced by the zero padded frame number, e.g. frames/frame_####.png. A path ending in
+         * .rgb, .rgba or .y4m gets all frames one after another instead, - streams them to stdout and unix:<path> to the Unix domain
+         * socket at path
+         * @param format rgb, rgba or y4m to stream the frames in this format, empty to choose it by the extension of output. Streams
+         * to stdout or a socket are rgb by default
+         * @param width Width of the frames
+         * @param height Height of the frames
+         * @param fps Frames per second written into the header of a y4m stream
+         * @param half True if the colors are read back in half precision
+         * @throws Utility::WRITE_FILE_EXCEPTION if a stream can't be opened or connected to
+         */
+        FrameWriter(const std::string& output, const std::string& format, uint width, uint height, uint fps, bool half);
+        /**
+         * @brief Writes the remaining frames and stops the threads
+         * 
+         */
+        ~FrameWriter();
+
+        /**
+         * @brief Queues a frame to be written, waits while too many frames are queued
+         * 
+         * @param frame Number of the frame
+         * @param raw The color of every pixel row by row as read back by Renderer::readColors()
+         */
+        void push(unsigned frame, std::vector<float>&& raw);
+        /**
+         * @brief Waits until all queued frames are written
+         * 
+         */
+        void finish();
+        /**
+         * @brief Returns if writing a frame failed, i.e. because the consumer of a stream went away
+         * 
+         */
+        bool failed();
+        /**
+         * @brief The file a frame is written to
+         * 
+         * @param output The output given to the constructor
+         * @param frame Number of the frame
+         * @return The path, with _#### added before the extension if output has no #
+         */
+        static std::string framePath(const std::string& output, unsigned frame);
+
+    private:
+        // How the frames are written
+        enum class Format { Image, RGB, RGBA, Y4M };
+
+        const std::string output;
+        const uint width, height, fps;
+        const bool half;
+        Format format;
+
+        // The file or pipe a stream goes to
+        std::ofstream file;
+        // True if the stream goes to stdout, messages have to go to std::cerr then, see main()
+        bool toStdout;
+        // The socket a stream goes to, -1 if none
+        int socket;
+        // Bytes of the frame being streamed, only the single streaming thread uses them
+        std::vector<uint8_t> bytes;
+
+        // Frames waiting to be written
+        std::deque<std::pair<unsigned, std::vector<float>>> pending;
+        std::mutex mutex;
+        std::condition_variable changed;
+        // Frames taken from pending that are being written
+        unsigned writing;
+        bool stopping;
+        // True after writing a frame failed, the remaining frames are dropped
+        bool broken;
+        std::vector<std::thread> workers;
+
+        // Writes frames until the writer stops
+        void work();
+        // Writes a single frame, returns false if it couldn't be written
+        bool write(unsigned frame, const std::vector<float>& raw);
+        // Converts a frame to 8 bit pixels with the given channels in this order, 0 = red, 1 = green, 2 = blue, 3 = opaque alpha
+        void toBytes(const std::vector<float>& raw, const std::vector<unsigned>& channels, std::vector<uint8_t>& res) const;
+        // Converts a frame to the Y, Cb and Cr planes of a 4:4:4 Y4M frame
+        void toPlanes(const std::vector<float>& raw, std::vector<uint8_t>& res) const;
+        // Writes bytes to the stream or socket
+        bool send(const uint8_t* data, size_t size);
+    };
+
+}
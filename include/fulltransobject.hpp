@@ -8,6 +8,8 @@ namespace Raytracing {
     /**
      * @brief This class represents a full transformation formed by the chain of several 'smaller' transformations.
      * This will be automatically generated by the interpreter.
+     * If obj is a complex object, this is an instance of that subtree: the subtree is defined only once
+     * and every instance merely adds its own transformation.
      */
     class Fulltransform : public Object
     {
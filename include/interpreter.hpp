@@ -4,9 +4,11 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <map>
 #include <vector>
 #include <array>
+#include <set>
 #include <memory>
 
 #include <utility.hpp>
@@ -14,6 +16,7 @@
 #include <lightsource.hpp>
 #include <material.hpp>
 #include <ray.hpp>
+#include <transformedobject.hpp>
 
 namespace Raytracing {
 
@@ -23,7 +26,7 @@ namespace Raytracing {
         "lookat_x", "lookat_y", "lookat_z",
         "eyepos_x", "eyepos_y", "eyepos_z",
         "ambient_r", "ambient_g", "ambient_b",
-        "ambient_int_r", "ambient_int_g", "ambient_int_r",
+        "ambient_int_r", "ambient_int_g", "ambient_int_b",
         "raydepth"
     };
 
@@ -65,6 +68,8 @@ namespace Raytracing {
         std::map<std::string, std::shared_ptr<Material>> materials;
         // All required variable values
         std::map<std::string, double> variables;
+        // All named objects as they are after shortening the tree, e.g. to find the instances an object became
+        std::map<std::string, std::shared_ptr<Object>> objects;
         // All rays on screen
         std::vector<std::shared_ptr<Ray>> rays;
 
@@ -73,7 +78,7 @@ namespace Raytracing {
         // Position the eye is looking at
         Utility::Vec3 Lookat;
 
-        // The height of the csg tree
+        // The height of the csg tree, i.e. the most complex objects on a path from the top object to a base object
         unsigned tree_height;
         // The amount of complex operations in the tree
         unsigned cmpOps;
@@ -89,12 +94,41 @@ namespace Raytracing {
          * @param path Specifies the path to the input file for the program
          */
         void interpretFile(const std::string& path);
+        /**
+         * @brief Interprets a scene given in the same format as an input file and makes it ready for rendering
+         * 
+         * @param content The content of the scene
+         */
+        void interpretString(const std::string& content);
+        /**
+         * @brief Changes required variables after interpreting, e.g. to move the camera, and creates the rays again
+         * 
+         * @param values The new values by variable name
+         * @throws Utility::MISSING_VARIABLE_EXCEPTION if a name isn't a required variable
+         */
+        void setVariables(const std::map<std::string, double>& values);
+        /**
+         * @brief Computes the camera the primary rays are created with, the ray through pixel (x, y) has the direction corner + x * stepX + y * stepY
+         * 
+         * @param eye Position of the eye
+         * @param lookat The point the eye looks at
+         * @param corner Receives the direction through the top left pixel, before normalising it
+         * @param stepX Receives the change of the direction from one pixel to the next one in a row
+         * @param stepY Receives the change of the direction from one row to the next one
+         */
+        void camera(const Utility::Vec3& eye, const Utility::Vec3& lookat, Utility::Vec3& corner, Utility::Vec3& stepX, Utility::Vec3& stepY) const;
     private:
         // Actual interpretation method
-        void interpret(std::ifstream& f);
+        void interpret(std::istream& f);
         // Creates rays after reading required values from input file
         void createRays();
+        // Applies a transformation to an object, turning complex objects into instances
+        void transform(std::shared_ptr<Raytracing::Object>& obj, TransformOps op, double x, double y, double z);
         // Shortens the object tree to Complex -> ... -> Complex -> Transform -> Base
         std::shared_ptr<Raytracing::Object> shorten(std::shared_ptr<Raytracing::Object>& obj, unsigned depth);
+        // Subtrees already shortened, as instances can share them
+        std::set<const Raytracing::Object*> shortened;
+        // Transformed objects and the instances shortening turned them into
+        std::map<const Raytracing::Object*, std::shared_ptr<Raytracing::Object>> replaced;
     };
 }
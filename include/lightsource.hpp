@@ -14,14 +14,17 @@ namespace Raytracing {
         Utility::Vec3 pos;
         // The color the source emits
         Utility::Vec3 color;
+        // Distance at which the light has faded out completely, 0 if it reaches everything
+        double radius;
 
         /**
          * @brief Construct a new Light Source object using Vec3s
          * 
          * @param pos The position in 3D space
          * @param color The color (r, g, b)
+         * @param radius Distance at which the light has faded out, 0 if it reaches everything
          */
-        LightSource(const Utility::Vec3& pos, const Utility::Vec3& color) : pos(pos), color(color) {}
+        LightSource(const Utility::Vec3& pos, const Utility::Vec3& color, double radius = 0.) : pos(pos), color(color), radius(radius) {}
         /**
          * @brief Construct a new Light Source object using doubles
          * 
@@ -31,7 +34,8 @@ namespace Raytracing {
          * @param r \
          * @param g  |--> Color
          * @param b /
+         * @param radius Distance at which the light has faded out, 0 if it reaches everything
          */
-        LightSource(double x, double y, double z, double r, double g, double b) : pos(x, y, z), color(r, g, b) {}
+        LightSource(double x, double y, double z, double r, double g, double b, double radius = 0.) : pos(x, y, z), color(r, g, b), radius(radius) {}
     };
 }
\ No newline at end of file
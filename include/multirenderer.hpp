@@ -0,0 +1,64 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <opencl.hpp>
+#include <interpreter.hpp>
+#include <scene.hpp>
+#include <shading.hpp>
+#include <renderer.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Renders an image on several devices at once.
+     * Every device gets its own copy of the scene and renders chunks of scanlines. The chunks are handed out one after
+     * another to whichever device is done first, so faster devices render more of the image.
+     */
+    class MultiRenderer
+    {
+    public:
+        // Scanlines per chunk
+        static constexpr uint CHUNK_ROWS = 16;
+
+        // Chunks every device rendered in the last render
+        std::vector<unsigned> chunksDone;
+
+        /**
+         * @brief Compiles the kernels for every device and uploads the scene to each of them
+         * 
+         * @param infos The devices, the same device may be given more than once
+         * @param inp The interpreter after reading the file
+         * @param scene The scene
+         * @param shading Materials, lights and settings of the scene
+         * @param options The command line options, every renderer is configured with them
+         */
+        MultiRenderer(const std::vector<Device_Info>& infos, const Interpreter& inp, const Scene& scene, const Shading& shading,
+            const Options& options);
+
+        /**
+         * @brief Renders an image
+         * 
+         * @param starts Origins of the primary rays, row by row
+         * @param dirs Directions of the primary rays
+         * @return The color of every primary ray
+         */
+        std::vector<cl_float4> render(const std::vector<cl_float4>& starts, const std::vector<cl_float4>& dirs);
+        /**
+         * @brief Prints how much of the last image every device rendered
+         * 
+         */
+        void report() const;
+
+    private:
+        // Devices with their renderers, held by pointer as buffers refer to their device
+        std::vector<std::unique_ptr<Device>> devices;
+        std::vector<std::unique_ptr<Renderer>> renderers;
+        // Width of the image
+        uint width;
+        // Primary rays per chunk
+        ulong chunkRays;
+    };
+
+}
@@ -9,6 +9,8 @@
 #define CL_USE_DEPRECATED_OPENCL_1_1_APIS
 #endif // USE_OPENCL_1_1
 #include <CL/cl.hpp> // OpenCL 1.0, 1.1, 1.2
+#include <map>
+#include <mutex>
 #include "utilities.hpp"
 
 struct Device_Info {
@@ -129,6 +131,72 @@ inline Device_Info select_device_with_id(const uint id, const vector<Device_Info
 	}
 }
 
+class Buffer_Pool { // keeps device buffers that were released to hand them out again instead of allocating new ones
+private:
+	struct Entry {
+		cl::Buffer buffer;
+		ulong stamp; // release counter when the buffer was released
+	};
+	std::map<ulong, vector<Entry>> idle; // released buffers by the size of their class in Byte
+	std::mutex mutex;
+	ulong releases = 0ull;
+	ulong limit = 0ull; // idle buffers are trimmed down to this many Byte, the ones idle the longest first
+	inline void trim_locked(const ulong max_bytes) {
+		while(pooled_bytes>max_bytes) {
+			auto oldest = idle.end();
+			for(auto it=idle.begin(); it!=idle.end(); it++) {
+				if(!it->second.empty()&&(oldest==idle.end()||it->second.front().stamp<oldest->second.front().stamp)) oldest = it;
+			}
+			if(oldest==idle.end()) break;
+			oldest->second.erase(oldest->second.begin()); // releasing the last reference frees the buffer on the device
+			pooled_bytes -= oldest->first;
+			trimmed_bytes += oldest->first;
+		}
+	}
+public:
+	ulong acquires=0ull, hits=0ull; // buffers requested and how many of them came from the pool
+	ulong pooled_bytes=0ull, peak_pooled_bytes=0ull, trimmed_bytes=0ull; // Byte of idle buffers now and at most, Byte freed by trimming
+	static inline ulong size_class(const ulong bytes) { // rounds up to 1, 1.25, 1.5 or 1.75 times a power of two and at least 256 Byte, so a pooled buffer is at most 25% larger than needed
+		if(bytes<=256ull) return 256ull;
+		ulong p = 256ull;
+		while(p*2ull<bytes) p *= 2ull;
+		const ulong step = p/4ull;
+		return p+(bytes-p+step-1ull)/step*step;
+	}
+	inline bool acquire(const ulong bytes, cl::Buffer& buffer) { // takes an idle buffer of the size class of bytes if there is one
+		std::lock_guard<std::mutex> lock(mutex);
+		acquires++;
+		auto it = idle.find(size_class(bytes));
+		if(it==idle.end()||it->second.empty()) return false;
+		buffer = it->second.back().buffer; // the most recently released one is the most likely to still be resident
+		it->second.pop_back();
+		pooled_bytes -= it->first;
+		hits++;
+		return true;
+	}
+	inline void release(const cl::Buffer& buffer, const ulong bytes) { // returns a buffer of bytes size, buffers not matching a size class are freed
+		if(size_class(bytes)!=bytes) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		idle[bytes].push_back({ buffer, releases++ });
+		pooled_bytes += bytes;
+		peak_pooled_bytes = max(peak_pooled_bytes, pooled_bytes);
+		trim_locked(limit);
+	}
+	inline void trim(const ulong max_bytes=0ull) { // frees idle buffers until at most max_bytes remain pooled
+		std::lock_guard<std::mutex> lock(mutex);
+		trim_locked(max_bytes);
+	}
+	inline void set_limit(const ulong max_bytes) { // sets how many Byte of idle buffers are kept at most
+		std::lock_guard<std::mutex> lock(mutex);
+		limit = max_bytes;
+		trim_locked(limit);
+	}
+	inline string statistics() const { // hit rate, idle and peak idle memory
+		return to_string(hits)+" of "+to_string(acquires)+" buffers reused ("+to_string((uint)(acquires>0ull ? 100ull*hits/acquires : 0ull))+"%), "
+			+to_string((uint)(pooled_bytes/1048576ull))+" MB pooled, at most "+to_string((uint)(peak_pooled_bytes/1048576ull))+" MB, "+to_string((uint)(trimmed_bytes/1048576ull))+" MB trimmed";
+	}
+};
+
 class Device {
 private:
 	cl::Context cl_context;
@@ -149,8 +217,10 @@ private:
 	;}
 public:
 	Device_Info info;
+	Buffer_Pool pool; // released buffers of all Memory objects on this device
 	inline Device(const Device_Info& info, const string& opencl_c_code=get_opencl_c_code()) {
 		this->info = info;
+		pool.set_limit((ulong)info.memory*1048576ull/4ull); // keep at most a quarter of the device memory idle
 		cl_context = cl::Context(info.cl_device);
 		cl_queue = cl::CommandQueue(cl_context, info.cl_device); // queue to push commands for the device
 		cl::Program::Sources cl_source;
@@ -196,6 +266,7 @@ private:
 	bool device_buffer_exists = false;
 	T* host_buffer = nullptr; // host buffer
 	cl::Buffer device_buffer; // device buffer
+	ulong device_bytes = 0ull; // size of the device buffer, can be larger than capacity() if it is from the pool
 	Device* device = nullptr; // pointer to linked Device
 	cl::CommandQueue cl_queue; // command queue
 	inline void initialize_auxiliary_pointers() {
@@ -222,10 +293,15 @@ private:
 		if(allocate_device) {
 			device.info.memory_used += (uint)(capacity()/1048576ull); // track device memory usage
 			if(device.info.memory_used>device.info.memory) print_error("Device \""+device.info.name+"\" does not have enough memory. Allocating another "+to_string((uint)(capacity()/1048576ull))+" MB would use a total of "+to_string(device.info.memory_used)+" MB / "+to_string(device.info.memory)+" MB.");
-			int error = 0;
-			device_buffer = cl::Buffer(device.get_cl_context(), CL_MEM_READ_WRITE, capacity(), nullptr, &error);
-			if(error==-61) print_error("Memory size is too large at "+to_string((uint)(capacity()/1048576ull))+" MB. Device \""+device.info.name+"\" accepts a maximum buffer size of "+to_string(device.info.max_global_buffer)+" MB.");
-			else if(error) print_error("Device buffer allocation failed with error code "+to_string(error)+".");
+			device_bytes = Buffer_Pool::size_class(capacity());
+			if(!device.pool.acquire(capacity(), device_buffer)) {
+				if(device_bytes/1048576ull>(ulong)device.info.max_global_buffer) device_bytes = capacity(); // too large to round up, it won't be pooled
+				if(device.info.memory_used+(uint)(device.pool.pooled_bytes/1048576ull)>device.info.memory) device.pool.trim(); // idle buffers make room first
+				int error = 0;
+				device_buffer = cl::Buffer(device.get_cl_context(), CL_MEM_READ_WRITE, device_bytes, nullptr, &error);
+				if(error==-61) print_error("Memory size is too large at "+to_string((uint)(capacity()/1048576ull))+" MB. Device \""+device.info.name+"\" accepts a maximum buffer size of "+to_string(device.info.max_global_buffer)+" MB.");
+				else if(error) print_error("Device buffer allocation failed with error code "+to_string(error)+".");
+			}
 			device_buffer_exists = true;
 		}
 	}
@@ -268,9 +344,11 @@ public:
 		device = memory.device;
 		cl_queue = memory.device->get_cl_queue();
 		if(memory.device_buffer_exists) {
-			device_buffer = memory.get_cl_buffer(); // transfer device_buffer pointer
-			device->info.memory_used += (uint)(capacity()/1048576ull); // track device memory usage
+			device_buffer = memory.get_cl_buffer(); // transfer device_buffer pointer, memory gives up the buffer so it isn't returned to the pool twice
+			device_bytes = memory.device_bytes;
 			device_buffer_exists = true;
+			memory.device_buffer_exists = false;
+			memory.device_buffer = nullptr;
 		}
 		if(memory.host_buffer_exists) {
 			host_buffer = memory.exchange_host_buffer(nullptr); // transfer host_buffer pointer
@@ -311,7 +389,10 @@ public:
 		}
 	}
 	inline void delete_device_buffer() {
-		if(device_buffer_exists) device->info.memory_used -= (uint)(capacity()/1048576ull); // track device memory usage
+		if(device_buffer_exists) {
+			device->info.memory_used -= (uint)(capacity()/1048576ull); // track device memory usage
+			device->pool.release(device_buffer, device_bytes);
+		}
 		device_buffer_exists = false;
 		device_buffer = nullptr;
 		if(!host_buffer_exists) {
@@ -522,6 +603,12 @@ public:
 		cl_queue.finish();
 		return *this;
 	}
+	inline Kernel& enqueue(const uint t=1u) { // like run(), but returns right away, commands on the same queue still execute in order
+		for(uint i=0u; i<t; i++) {
+			cl_queue.enqueueNDRangeKernel(cl_kernel, cl::NullRange, cl_range_global, cl_range_local);
+		}
+		return *this;
+	}
 	inline Kernel& operator()(const uint t=1u) {
 		return run(t);
 	}
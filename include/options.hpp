@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+
+#include <utility.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Options given on the command line: raytracing.exe [file] [options]
+     * 
+     */
+    struct Options {
+        // The RTI file that is rendered
+        std::string file;
+        // Store ray directions and colors in half precision (--half)
+        bool half;
+        // Sort rays after the first bounce before tracing them (--sort)
+        bool sort;
+        // Render with and without sorting and compare the time (--sort-benchmark)
+        bool sortBenchmark;
+        // Tune the work group sizes even if they are cached already (--retune)
+        bool retune;
+        // Id or part of the name of the device to render on, empty to choose the fastest one (--device).
+        // With --multi, a list of them separated by commas, empty to use all devices.
+        std::string device;
+        // How the fastest device is found, "benchmark" or "flops" (--select)
+        std::string select;
+        // Measure the speed of the devices even if it is cached already (--remeasure)
+        bool remeasure;
+        // Render on several devices at once (--multi)
+        bool multi;
+        // Show coarse previews while rendering the image (--progressive)
+        bool progressive;
+        // Show the scene in a window the camera can be moved in (--interactive)
+        bool interactive;
+        // Read the file again whenever it is saved, implies the interactive window (--watch)
+        bool watch;
+        // Unix domain socket to accept render jobs on instead of rendering the file, empty to render once (--server)
+        std::string server;
+        // Keyframes to render an animation of the file with, empty to render a single image (--animate)
+        std::string animate;
+        // Where the frames of an animation are written, see FrameWriter (--output)
+        std::string output;
+        // Format frames are streamed in, rgb, rgba or y4m, empty to choose it by the output (--format)
+        std::string format;
+        // Frames per second of y4m streams (--fps)
+        uint fps;
+        // Jittered samples traced and averaged per pixel of a single image (--samples)
+        unsigned samples;
+        // Deviation or contrast of a pixel that makes it get all samples, 0 gives every pixel all of them (--adaptive)
+        float adaptive;
+        // Weight below which reflected and refracted rays aren't traced, see Renderer::setTermination (--min-weight)
+        float minWeight;
+        // Weight below which reflected and refracted rays have to survive russian roulette, 0 to turn it off (--roulette)
+        float roulette;
+        // Lights picked at random per hit, 0 to shade with all lights (--light-samples)
+        unsigned lightSamples;
+        // Most passes averaged with light sampling (--passes)
+        unsigned passes;
+
+        /**
+         * @brief Construct the default options
+         * 
+         */
+        Options() : file("input.rti"), half(false), sort(false), sortBenchmark(false), retune(false), select("benchmark"), remeasure(false), multi(false), progressive(false), interactive(false), watch(false),
+            output("frame_####.png"), fps(30), samples(1), adaptive(0.f),
+            minWeight(0.f), roulette(0.f), lightSamples(0), passes(64) {}
+
+        /**
+         * @brief Reads the options from the command line
+         * 
+         * @param argc Amount of arguments
+         * @param argv The arguments, the first one is the program
+         * @return The options
+         * @throws Utility::INVALID_OPTION_EXCEPTION for unknown options
+         */
+        static Options parse(int argc, char* argv[]);
+        /**
+         * @brief Prints all options and what they do
+         * 
+         */
+        static void printUsage();
+    };
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <opencl.hpp>
+#include <renderer.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Renders an image coarse to fine, so a preview is shown long before the full image is done.
+     * The first pass traces every FIRST_STRIDE-th pixel in both directions with PREVIEW_DEPTH levels, every further pass halves
+     * the stride and only traces the pixels that are new on its grid. A last pass traces all pixels with the full depth.
+     * All passes run on the buffers and kernels of one renderer, limited with Renderer::setExtent().
+     */
+    class ProgressiveRenderer
+    {
+    public:
+        // Distance between the pixels traced by the first pass
+        static constexpr uint FIRST_STRIDE = 8;
+        // Levels of reflection traced until the last pass
+        static constexpr unsigned PREVIEW_DEPTH = 1;
+
+        /**
+         * @brief Construct the passes for an image, nothing is traced yet
+         * 
+         * @param renderer The renderer, created for all pixels of the image
+         * @param starts Origins of the primary rays, row by row
+         * @param dirs Directions of the primary rays
+         * @param width Width of the image
+         * @param depth Levels of reflection of the last pass
+         */
+        ProgressiveRenderer(Renderer& renderer, const std::vector<cl_float4>& starts, const std::vector<cl_float4>& dirs, uint width, unsigned depth);
+
+        /**
+         * @brief Returns if all passes are traced
+         * 
+         */
+        inline bool done() const noexcept { return pass >= passes.size(); }
+        /**
+         * @brief Traces the next pass. After the last one the renderer traces all rays and levels again, as it was created.
+         * 
+         */
+        void next();
+        /**
+         * @brief Returns the image after the last pass, pixels that aren't traced yet take the color of the traced pixel above and left of them
+         * 
+         */
+        inline const std::vector<cl_float4>& image() const noexcept { return shown; }
+        /**
+         * @brief Describes the last pass traced, i.e. to print it
+         * 
+         */
+        std::string describe() const;
+
+    private:
+        // Pixels traced by a pass and how deep
+        struct Pass {
+            uint stride;
+            unsigned depth;
+        };
+
+        Renderer& renderer;
+        const std::vector<cl_float4>& starts;
+        const std::vector<cl_float4>& dirs;
+        const uint width, height;
+        std::vector<Pass> passes;
+        // The next pass to trace
+        size_t pass;
+        // Pixels traced by the last pass
+        size_t traced;
+
+        // Colors of the traced pixels, and the image with the gaps filled
+        std::vector<cl_float4> colors, shown;
+        // Indices and rays of the pixels of a pass
+        std::vector<uint> pixels;
+        std::vector<cl_float4> passStarts, passDirs;
+    };
+
+}
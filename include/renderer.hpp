@@ -0,0 +1,394 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <opencl.hpp>
+#include <interpreter.hpp>
+#include <options.hpp>
+#include <scene.hpp>
+#include <shading.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Work group sizes the ray kernels are launched with
+     * 
+     */
+    struct Workgroups {
+        // Work group size of intersect_kernel after the first bounce
+        uint intersect;
+        // Work group size of shade_kernel
+        uint shade;
+        // Work group size of color_kernel
+        uint color;
+        // Primary rays are intersected in tiles of this many pixels per work group, a height of 1 keeps them in rows
+        uint tileWidth, tileHeight;
+
+        /**
+         * @brief Construct the sizes used without tuning
+         * 
+         */
+        Workgroups() : intersect(WORKGROUP_SIZE), shade(WORKGROUP_SIZE), color(WORKGROUP_SIZE), tileWidth(WORKGROUP_SIZE), tileHeight(1) {}
+    };
+
+    /**
+     * @brief Keeps a scene on a device and traces rays through it.
+     * Every level of reflection has its own ray buffers, level i holds twice as many rays as level i - 1.
+     * Ray origins are always stored as float4. Directions and colors are float4 too, or four halves each
+     * if half precision is used, in which case directions are octahedral encoded.
+     * Every level is traced in three steps: intersecting writes a hit record per ray, the hits are grouped by
+     * their material and then shaded in that order. Rays after the first bounce can also be sorted by
+     * direction and origin before intersecting them.
+     */
+    class Renderer
+    {
+    public:
+        // Samples every pixel gets before adaptive supersampling decides where to add more
+        static constexpr unsigned ADAPTIVE_BASE_SAMPLES = 4;
+        // Weight below which reflected and refracted rays aren't traced by default, 0 so every ray that weighs anything is
+        static constexpr float DEFAULT_MIN_WEIGHT = 0.f;
+
+        /**
+         * @brief Time spent on one level of rays in the last render
+         * 
+         */
+        struct LevelTiming {
+            // Seconds spent sorting the rays
+            double sort;
+            // Seconds spent intersecting the rays with the scene
+            double intersect;
+            // Seconds spent grouping the hits by material
+            double bin;
+            // Seconds spent shading the hits
+            double shade;
+            // Seconds spent adding the colors of this level to the previous one
+            double color;
+
+            /**
+             * @brief All time spent on the level
+             * 
+             * @return The time in seconds
+             */
+            inline double total() const noexcept { return sort + intersect + bin + shade + color; }
+        };
+
+        // Timings of every level in the last render
+        std::vector<LevelTiming> timings;
+        // Primary rays traced by the last renderSamples()
+        ulong sampledRays;
+
+        /**
+         * @brief Uploads a scene and allocates the ray buffers
+         * 
+         * @param device The device, its program has to be compiled with the defines returned by Renderer::defines
+         * @param scene The scene
+         * @param shading Materials, lights and settings of the scene
+         * @param rays Amount of primary rays
+         * @param depth Amount of levels of reflection, at least 1
+         * @param half True if directions and colors are stored in half precision
+         * @param sort True if rays after the first bounce are sorted before tracing them
+         */
+        Renderer(Device& device, const Scene& scene, const Shading& shading, ulong rays, unsigned depth, bool half, bool sort);
+
+        /**
+         * @brief Sets the primary rays
+         * 
+         * @param starts Origins of the rays, w is the weight of the ray
+         * @param dirs Directions of the rays, w is the refraction index of the medium the ray starts in
+         */
+        void setRays(const std::vector<cl_float4>& starts, const std::vector<cl_float4>& dirs);
+        /**
+         * @brief Replaces the scene, the ray buffers are kept
+         * 
+         * @param scene The scene, its csg tree may not be higher than the program of the device was compiled for
+         * @param shading Materials, lights and settings of the scene
+         */
+        void setScene(const Scene& scene, const Shading& shading);
+        /**
+         * @brief Replaces the scene like setScene(), but compares it to the scene on the device and only writes what changed.
+         * Buffers whose length changed are uploaded completely.
+         * 
+         * @param scene The scene, its csg tree may not be higher than the program of the device was compiled for
+         * @param shading Materials, lights and settings of the scene
+         * @return The amount of bytes written to the device
+         */
+        ulong updateScene(const Scene& scene, const Shading& shading);
+        /**
+         * @brief Writes the instances and hierarchy nodes changed by Scene::update() to the device
+         * 
+         * @param scene The scene after update()
+         * @param rebuilt The result of update(), all instances and nodes are written if the hierarchy was rebuilt
+         */
+        void updateInstances(const Scene& scene, bool rebuilt);
+        /**
+         * @brief Sets the primary rays, if there are less rays than the extent the rest is left empty. Rays past the extent aren't written.
+         * 
+         * @param starts Origins of the rays, w is the weight of the ray
+         * @param dirs Directions of the rays, w is the refraction index of the medium the ray starts in
+         * @param count Amount of rays
+         */
+        void setRays(const cl_float4* starts, const cl_float4* dirs, size_t count);
+        /**
+         * @brief Traces only the first rays and levels the renderer was created for, using the same buffers. Set the rays afterwards.
+         * 
+         * @param rays Amount of primary rays, at most the amount the renderer was created for
+         * @param depth Amount of levels of reflection, at least 1 and at most the depth the renderer was created for
+         */
+        void setExtent(ulong rays, unsigned depth);
+        /**
+         * @brief Creates the primary rays of a camera on the device instead of uploading them, see Interpreter::camera()
+         * 
+         * @param eye Position of the eye
+         * @param corner Direction through the top left pixel
+         * @param stepX Change of the direction from one pixel to the next one in a row
+         * @param stepY Change of the direction from one row to the next one
+         * @param width Width of the image
+         */
+        void setCamera(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY, uint width);
+        /**
+         * @brief Traces several jittered samples per pixel in batches of one sample per pixel and averages them on the device.
+         * With a threshold, every pixel gets ADAPTIVE_BASE_SAMPLES samples first and only pixels whose samples deviate from their mean
+         * or whose mean differs from a neighbour by more than the threshold get the remaining ones. The sums take two colors per pixel
+         * no matter how many samples there are. Afterwards the rays go through the pixel centers, as set by setCamera().
+         * 
+         * @param eye Position of the eye, see setCamera()
+         * @param corner Direction through the top left pixel
+         * @param stepX Change of the direction from one pixel to the next one in a row
+         * @param stepY Change of the direction from one row to the next one
+         * @param width Width of the image
+         * @param samples Samples per pixel, at least 1
+         * @param threshold Deviation or contrast of a color channel that makes a pixel get more samples, 0 to give every pixel all samples
+         * @return The averaged color of every pixel
+         */
+        std::vector<cl_float4> renderSamples(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY,
+            uint width, unsigned samples, float threshold);
+        /**
+         * @brief Traces one pass of jittered rays through all pixels and adds their colors to the sums renderSamples() uses.
+         * With light sampling, every pass picks other lights.
+         * 
+         * @param eye Position of the eye, see setCamera()
+         * @param corner Direction through the top left pixel
+         * @param stepX Change of the direction from one pixel to the next one in a row
+         * @param stepY Change of the direction from one row to the next one
+         * @param width Width of the image
+         * @param pass Index of the pass, the first one goes through the pixel centers and replaces the sums
+         */
+        void addPass(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY, uint width, unsigned pass);
+        /**
+         * @brief Reads back the average of the passes added so far
+         * 
+         * @param error Receives the standard error of the average, the mean over all pixels and color channels
+         * @return The average color of every pixel
+         */
+        std::vector<cl_float4> passAverage(double& error);
+        /**
+         * @brief Sets the work group sizes of the kernels, sizes a kernel can't run with are reduced
+         * 
+         * @param sizes The work group sizes
+         * @param width Width of the image, the primary rays are stored row by row
+         */
+        void setWorkgroups(const Workgroups& sizes, uint width);
+        /**
+         * @brief Sets when reflected and refracted rays are traced. Every ray weighs the product of the reflection or refraction
+         * of all surfaces it came from, which is how much its color adds to the pixel.
+         * 
+         * @param minWeight Rays weighing less aren't traced, rays weighing nothing never are
+         * @param roulette Rays weighing less are traced with the probability weight / roulette and then weigh roulette, 0 to trace all of them
+         */
+        void setTermination(float minWeight, float roulette);
+        /**
+         * @brief Sets if every hit is shaded with all lights reaching it or with a few picked at random. Lights are picked with a
+         * probability about proportional to their power over the squared distance and weigh one over that probability, so the cost
+         * of a hit doesn't grow with the amount of lights. The image gets noisy instead, and is meant to be averaged over passes.
+         * 
+         * @param samples Lights picked per hit, 0 to shade with all lights
+         */
+        void setLightSampling(unsigned samples);
+        /**
+         * @brief Applies the work group sizes and everything the command line sets about tracing, see setWorkgroups(),
+         * setTermination() and setLightSampling()
+         * 
+         * @param options The command line options
+         * @param sizes The work group sizes
+         * @param width Width of the image, the primary rays are stored row by row
+         */
+        void configure(const Options& options, const Workgroups& sizes, uint width);
+        /**
+         * @brief Returns the work group sizes of the kernels
+         * 
+         * @return The sizes after reducing them to what the kernels can run with
+         */
+        inline const Workgroups& getWorkgroups() const noexcept { return workgroups; }
+        /**
+         * @brief Traces all levels of rays and combines their colors
+         * 
+         */
+        void render();
+        /**
+         * @brief Like render(), but only enqueues the kernels and returns before they ran. The timings stay those of the last render().
+         * Buffers may be written while the kernels are pending, commands on the queue of the device run in order.
+         * 
+         */
+        void enqueueRender();
+        /**
+         * @brief Reads back the color of every primary ray within the extent
+         * 
+         * @return The colors, converted to float if half precision is used
+         */
+        std::vector<cl_float4> colors();
+        /**
+         * @brief Enqueues reading back the colors of every primary ray after everything enqueued before, and returns right away
+         * 
+         * @param raw Receives the colors as stored on the device, it must not be touched until done completed
+         * @param done Completes when the colors arrived in raw
+         */
+        void readColors(std::vector<float>& raw, cl::Event& done);
+        /**
+         * @brief Converts colors as stored on the device to float
+         * 
+         * @param raw The colors read by readColors()
+         * @param count Amount of primary rays
+         * @param half True if the colors are stored in half precision
+         * @return The colors
+         */
+        static std::vector<cl_float4> decodeColors(const float* raw, size_t count, bool half);
+        /**
+         * @brief Prints the resources every ray kernel needs as the device reports them (CL_KERNEL_* queries)
+         * 
+         */
+        void reportKernels() const;
+
+        /**
+         * @brief Builds the defines the kernel has to be compiled with
+         * 
+         * @param inp The interpreter after reading the file
+         * @param shading Materials, lights and settings of the scene
+         * @param info The device the kernel is compiled for
+         * @param shareable True to round the csg stack up to a power of two, so scenes of a similar height can share one program
+         * @return The defines, to be put in front of the kernel code
+         */
+        static std::string defines(const Interpreter& inp, const Shading& shading, const Device_Info& info, bool shareable = false);
+        /**
+         * @brief Bytes the ray buffers of all levels and the hit records occupy on the device
+         * 
+         * @param rays Amount of primary rays
+         * @param depth Amount of levels of reflection
+         * @param half True if directions and colors are stored in half precision
+         * @return The amount of bytes
+         */
+        static ulong rayBytes(ulong rays, unsigned depth, bool half);
+        /**
+         * @brief Bytes the buffers for sorting rays and grouping hits occupy on the device
+         * 
+         * @param rays Amount of primary rays
+         * @param depth Amount of levels of reflection
+         * @return The amount of bytes
+         */
+        static ulong sortBytes(ulong rays, unsigned depth);
+        /**
+         * @brief Prints how much an image differs from a reference image
+         * 
+         * @param image The colors of the image
+         * @param reference The colors of the reference image, has the same size
+         */
+        static void reportError(const std::vector<cl_float4>& image, const std::vector<cl_float4>& reference);
+        /**
+         * @brief Prints the time every level took with and without sorting the rays
+         * 
+         * @param unsorted A renderer that doesn't sort, after it rendered an image
+         * @param sorted A renderer that sorts, after it rendered the same image
+         */
+        static void reportSortTimings(const Renderer& unsorted, const Renderer& sorted);
+
+    private:
+        // Keys sorted by one work group, has to match SORT_BLOCK in the kernel
+        static constexpr uint SORT_BLOCK = 256;
+        // Bits of the key sorted per pass, has to match SORT_BITS in the kernel
+        static constexpr uint SORT_BITS = 4;
+        // Amount of different digits per pass
+        static constexpr uint SORT_RADIX = 1u << SORT_BITS;
+        // Smallest csg stack of a program that is shared by several scenes
+        static constexpr uint MIN_SHARED_STACK = 8;
+
+        Device& device;
+        const bool half;
+        const bool sort;
+        // Amount of materials, hits are grouped by them
+        uint materialCount;
+        // Floats used for the direction or color of one ray
+        const uint floatsPerRay;
+
+        // Primitives are defined once per prototype, instances place prototypes in the scene.
+        Memory<cl_float4> primitives;
+        Memory<cl_uint> primInfo;
+        Memory<cl_int4> complexInfo;
+        Memory<cl_int4> prototypes;
+        Memory<cl_float4> instances;
+        Memory<cl_uint> instanceProtos;
+        Memory<cl_float4> bvhNodes;
+        // Materials, lights with the hierarchy over them and the settings of the scene
+        Memory<MaterialRecord> materials;
+        Memory<LightRecord> lights;
+        Memory<cl_float4> lightNodes;
+        Memory<cl_float4> lightTree;
+        Memory<cl_uint> lightOrder;
+        Memory<SceneHeader> header;
+
+        // Rays of every level of reflection
+        std::vector<Memory<cl_float4>> starts;
+        std::vector<Memory<float>> dirs;
+        std::vector<Memory<float>> colorLevels;
+        // Sums of the colors of every pixel and of their squares while supersampling, and the pixels getting more samples
+        Memory<cl_float4> sampleSums, sampleSquares;
+        Memory<cl_uint> samplePixels;
+        // Hit records of the level being traced
+        Memory<cl_float4> hits;
+        // Work group sizes of the kernels
+        Workgroups workgroups;
+        // Weights below which bounced rays are dropped or have to survive russian roulette, see setTermination()
+        float minWeight, roulette;
+        // Lights picked per hit, 0 to shade with all of them, and the number the lights picked are derived from
+        uint lightSamples, lightSeed;
+        // Primary rays in the order they are intersected when they are traced in tiles
+        Memory<cl_uint> tileOrder;
+
+        // Lower corner of the space origins are quantized in for sorting
+        cl_float4 sortLo;
+        // Factor mapping origins from that space to [0, 255]
+        cl_float4 sortScale;
+        // Keys and ray indices of the level being sorted, and the buffers a sorting pass writes to
+        Memory<cl_uint> keys, order, sortedKeys, sortedOrder;
+        // Digit counts of every block in a sorting pass
+        Memory<cl_uint> hist;
+        // Primary rays and levels that are traced, see setExtent()
+        ulong extentRays;
+        unsigned extentDepth;
+        // True if render() waits for every kernel to measure the timings, false while enqueueRender() only enqueues them
+        bool timed;
+
+        // Traces all levels, with or without waiting for every kernel
+        void trace();
+        // Runs a kernel, or only enqueues it if the render isn't timed
+        void launch(Kernel& kernel) const;
+
+        // Creates the primary rays of one sample of the first pixels in samplePixels, or of all pixels if the list isn't used
+        void generateRays(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY, uint width,
+            unsigned sample, bool listed);
+        // Adds the colors of the primary rays to the sums of their pixels
+        void accumulate(bool first, bool listed);
+        // Amount of rays of a level within the extent
+        inline uint levelCount(unsigned level) const { return static_cast<uint>(extentRays << level); }
+        // Sorts the rays of a level, afterwards order holds their indices in sorted order
+        void sortLevel(unsigned level);
+        // Groups the hits of a level by material keeping the order of the rays within a material, returns the buffer holding the grouped indices
+        Memory<cl_uint>& binLevel(unsigned level, bool sorted, bool tiled);
+        // Sets the space origins are quantized in for sorting to the bounds of the hierarchy
+        void setSortBounds(const Scene& scene);
+        // Reduces a work group size to the largest power of two a kernel can run with
+        uint fit(const std::string& kernel, uint size) const;
+        // Sorts the first count entries of keys and order by the lowest bits of the keys, returns the buffer holding the sorted indices
+        Memory<cl_uint>& radixSort(uint count, uint bits);
+    };
+
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencl.hpp>
+#include <interpreter.hpp>
+#include <scene.hpp>
+#include <shading.hpp>
+#include <renderer.hpp>
+#include <options.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief Renders jobs sent to a Unix domain socket, keeping the device, compiled programs, scenes and ray buffers
+     * loaded between them, so a job only costs the time it takes to trace it.
+     * Every connection sends one job as lines of text, a blank line or "end" finishes it:
+     *   scene <path>              Render an RTI file, it is only read again after it changed
+     *   inline <bytes>            Render the RTI content following the job, it is this many bytes long
+     *   width <w>, height <h>, raydepth <d>, eyepos <x> <y> <z>, lookat <x> <y> <z>
+     *                             Override variables of the scene
+     *   output <path>             Write the image to this file, any format OpenCV knows
+     *   quit                      Stop the server after the jobs already queued, answered with "ok"
+     * The reply is one line, "ok file <path> <trace seconds> <job seconds>" if an output was given, otherwise
+     * "ok image <width> <height> <trace seconds> <job seconds>" followed by the 8 bit RGB pixels row by row.
+     * Failed jobs are answered with "error <message>".
+     */
+    class RenderServer
+    {
+    public:
+        /**
+         * @brief Selects the device and creates the socket
+         * 
+         * @param path Path of the socket, an existing socket file there is replaced
+         * @param options The options, the device is chosen by them and half and sort apply to every job
+         */
+        RenderServer(const std::string& path, const Options& options);
+        /**
+         * @brief Closes the socket and removes its file
+         * 
+         */
+        ~RenderServer();
+
+        /**
+         * @brief Accepts jobs until one asks to quit and renders them one after another in the order they came in
+         * 
+         */
+        void run();
+
+    private:
+        // A job read from a connection
+        struct Job {
+            // The connection the reply goes to
+            int client;
+            // Path of the RTI file, empty if the scene is given inline
+            std::string scenePath;
+            // The RTI content of an inline scene
+            std::string sceneContent;
+            // Variables overridden for this job
+            std::map<std::string, double> overrides;
+            // File the image is written to, empty to send the pixels
+            std::string output;
+        };
+
+        // A scene with everything built from it
+        struct LoadedScene {
+            Interpreter inp;
+            Scene scene;
+            Shading shading;
+            // The variables as read from the file, overrides are applied to them
+            std::map<std::string, double> variables;
+            // Time the file was last changed when it was read
+            std::filesystem::file_time_type time;
+            // Counts up every time a scene is read, so the renderer knows when to upload it again
+            unsigned version;
+            // Primary rays and the variables they were created with
+            std::vector<cl_float4> rayStarts, rayDirs;
+            std::map<std::string, double> rayVariables;
+        };
+
+        const std::string path;
+        const Options options;
+        const Device_Info info;
+        int listener;
+
+        // Devices by the defines their program was compiled with
+        std::map<std::string, std::unique_ptr<Device>> devices;
+        // Work group sizes, tuned once the first program is compiled
+        std::unique_ptr<Workgroups> workgroups;
+        // Scenes read from files by their path
+        std::map<std::string, std::unique_ptr<LoadedScene>> scenes;
+        // Versions given to scenes so far
+        unsigned versions;
+
+        // The renderer of the last job with the device, amount of rays, depth, image width and scene version it was set up for
+        std::unique_ptr<Renderer> renderer;
+        Device* rendererDevice;
+        ulong rendererRays;
+        unsigned rendererDepth;
+        uint rendererWidth;
+        unsigned rendererVersion;
+
+        // Jobs read but not rendered yet
+        std::deque<Job> queue;
+        std::mutex queueMutex;
+        std::condition_variable queueChanged;
+        bool stopping;
+
+        // Reads a job from a connection, returns false if it asks to quit, throws Utility::WRONG_FORMAT_EXCEPTION if it is broken
+        bool readJob(int client, Job& job) const;
+        // Renders jobs from the queue until the server stops
+        void work();
+        // Renders a job and sends the reply
+        void process(Job& job);
+        // Returns the scene of a job, reading it if it isn't loaded or its file changed
+        LoadedScene& load(const Job& job, std::unique_ptr<LoadedScene>& inlineScene);
+        // Returns a device with a program compiled for the scene, compiling it if no program fits yet
+        Device& deviceFor(const LoadedScene& loaded);
+    };
+
+}
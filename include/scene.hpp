@@ -0,0 +1,201 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <opencl.hpp>
+#include <utility.hpp>
+#include <object.hpp>
+#include <baseobject.hpp>
+#include <interpreter.hpp>
+#include <bvh.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief The scene in the flat form the device works with.
+     * Objects are split into two levels: prototypes are lists of primitives defined once in their own space,
+     * instances place a prototype in the world with a compact 3x4 inverse transformation.
+     * Identical base objects share one prototype, and so do all instances of a complex subtree.
+     */
+    class Scene
+    {
+    public:
+        // Bit of primInfo set for half planes
+        static constexpr cl_uint PRIM_HALF_PLANE = 1;
+        // Bit of primInfo set for primitives with their own transformation
+        static constexpr cl_uint PRIM_TRANSFORMED = 2;
+        // primInfo is shifted by this to get the material
+        static constexpr cl_uint PRIM_MATERIAL_SHIFT = 2;
+        // Amount of float4 in the record of a primitive
+        static constexpr unsigned PRIM_STRIDE = 5;
+        // Bit of instanceProtos set for instances without transformation, the rest is the prototype
+        static constexpr cl_uint INSTANCE_IDENTITY = 0x80000000u;
+
+        // Primitive records of PRIM_STRIDE 16 byte chunks: position and radius, bounding sphere (center, radius,
+        // -1 if unbounded) in the space of the prototype, and the three rows of the inverse transformation relative to the prototype.
+        // Testing a primitive reads its info and position (20 bytes), the bound as well if it is transformed (36 bytes) and the rows
+        // once the bound is hit (84 bytes). Every instance adds its prototype index and prototype (20 bytes) and, if it is transformed, its rows (68 bytes),
+        // so a top level sphere costs 40 bytes.
+        std::vector<cl_float4> primitives;
+        // Type, transformation flag and material of every primitive, see PRIM_*
+        std::vector<cl_uint> primInfo;
+        // Per CSG node: left and right child (negative values -i - 1 reference primitive i), operation
+        std::vector<cl_int4> complexInfo;
+        // Per prototype: first primitive, amount of primitives, root CSG node (-1 for pure unions)
+        std::vector<cl_int4> prototypes;
+        // Per instance: the three rows of the inverse transformation
+        std::vector<cl_float4> instances;
+        // Per instance: the prototype it refers to, with INSTANCE_IDENTITY set if its transformation doesn't change anything
+        std::vector<cl_uint> instanceProtos;
+        // Per node: lower corner and first index, upper corner and amount of instances (0 for inner nodes)
+        std::vector<cl_float4> bvhNodes;
+        // Amount of instances without bounds (half planes), they are stored first and not part of the hierarchy
+        unsigned unbounded;
+        // Instances written by the last update(), by their index in the device arrays
+        std::vector<unsigned> changedInstances;
+        // Hierarchy nodes written by the last update()
+        std::vector<unsigned> changedNodes;
+
+        /**
+         * @brief Construct an empty scene
+         * 
+         */
+        Scene() : unbounded(0) {}
+
+        /**
+         * @brief Flattens the object tree of an interpreted file
+         * 
+         * @param inp The interpreter after reading the file
+         */
+        void build(const Interpreter& inp);
+        /**
+         * @brief Changes the transformation of an instance, e.g. for the next frame of an animation.
+         * Call update() once all instances of the frame are changed.
+         * 
+         * @param instance Index of the instance in the order the object tree was searched in
+         * @param matrix The new transformation matrix
+         * @param invmatrix The inverse of the new transformation matrix
+         */
+        void setTransform(unsigned instance, const Utility::Matrix4x4& matrix, const Utility::Matrix4x4& invmatrix);
+        /**
+         * @brief Reads the transformation of an instance
+         * 
+         * @param instance Index of the instance in the order the object tree was searched in
+         * @param matrix Set to the transformation matrix
+         * @param invmatrix Set to its inverse
+         */
+        void getTransform(unsigned instance, Utility::Matrix4x4& matrix, Utility::Matrix4x4& invmatrix) const;
+        /**
+         * @brief Finds the instances an object of the tree became
+         * 
+         * @param obj The object, e.g. from Interpreter::objects
+         * @return Indices of the instances in the order the object tree was searched in, empty if the object is part of a
+         * prototype instead of being placed at the top of the tree
+         */
+        std::vector<unsigned> instancesOf(const Object* obj) const;
+        /**
+         * @brief Brings the device arrays up to date after setTransform(). The hierarchy is refit bottom-up,
+         * so the work only depends on the amount of moved instances; changedInstances and changedNodes
+         * list what has to be written to the device. If refitting degraded the hierarchy too much, it is rebuilt instead.
+         * 
+         * @return True if the hierarchy was rebuilt, all instances and nodes have to be written to the device then
+         */
+        bool update();
+
+        /**
+         * @brief Amount of instances in the scene
+         * 
+         * @return The amount
+         */
+        inline unsigned instanceCount() const noexcept { return static_cast<unsigned>(instanceProtos.size()); }
+        /**
+         * @brief Amount of primitives in all prototypes
+         * 
+         * @return The amount
+         */
+        inline unsigned primitiveCount() const noexcept { return static_cast<unsigned>(primInfo.size()); }
+        /**
+         * @brief Amount of nodes in the instance hierarchy
+         * 
+         * @return The amount, 0 if all instances are unbounded
+         */
+        inline unsigned nodeCount() const noexcept { return static_cast<unsigned>(bvh.nodes.size()); }
+        /**
+         * @brief Bytes the scene occupies on the device
+         * 
+         * @return The amount of bytes
+         */
+        size_t deviceBytes() const noexcept;
+
+    private:
+        // An instance before it is sorted into the hierarchy
+        struct Instance {
+            unsigned proto;
+            Utility::Matrix4x4 matrix;
+            Utility::Matrix4x4 invmatrix;
+            AABB box;
+        };
+
+        // Instances in the order they were found
+        std::vector<Instance> found;
+        // Bounds of every prototype in its own space, empty if unbounded
+        std::vector<AABB> protoBounds;
+        // Wether a prototype contains unbounded primitives
+        std::vector<bool> protoUnbounded;
+        // Prototypes of base objects, by type, position, radius and material
+        std::map<std::tuple<int, double, double, double, double, unsigned>, unsigned> baseProtos;
+        // Prototypes of complex subtrees
+        std::map<const Object*, unsigned> complexProtos;
+        // Complex subtrees that have instances
+        std::set<const Object*> instanced;
+        // Hierarchy over the bounded instances
+        BVH bvh;
+        // Marks instances that are not part of the hierarchy
+        static constexpr unsigned NO_ITEM = ~0u;
+        // Index in the device arrays of every found instance
+        std::vector<unsigned> slots;
+        // Index in the hierarchy of every found instance, NO_ITEM if unbounded
+        std::vector<unsigned> items;
+        // World bounds of all instances in the hierarchy
+        std::vector<AABB> itemBounds;
+        // Instances changed by setTransform() since the last update()
+        std::vector<unsigned> moved;
+        // Ranges of instances found below every object at the top of the tree, an object can be placed there more than once
+        std::map<const Object*, std::vector<std::pair<unsigned, unsigned>>> sources;
+
+        // Finds all complex subtrees that have instances
+        void findInstanced(const std::shared_ptr<Object>& obj);
+        // Searches the top of the object tree for instances
+        void search(const std::shared_ptr<Object>& obj);
+        // Searches a union-only subtree for the primitives of a prototype
+        void searchPrototype(const std::shared_ptr<Object>& obj, Utility::Matrix4x4 matrix, Utility::Matrix4x4 invmatrix);
+        // Searches a subtree for the primitives and CSG nodes of a prototype, returns the node (or negative primitive) index
+        int searchCsg(const std::shared_ptr<Object>& obj, Utility::Matrix4x4 matrix, Utility::Matrix4x4 invmatrix, AABB& box, bool& unbounded);
+        // Checks if a subtree only consists of unions
+        static bool isUnion(const std::shared_ptr<Object>& obj);
+        // Returns the prototype of a base object, creating it if necessary
+        unsigned baseProto(const std::shared_ptr<BaseObject>& obj);
+        // Returns the prototype of a complex subtree, creating it if necessary
+        unsigned complexProto(const std::shared_ptr<Object>& obj);
+        // Starts a new prototype at the current end of the primitive list
+        unsigned beginProto();
+        // Finishes the last prototype started
+        void endProto();
+        // Adds a primitive to the prototype currently being built, returns its bounds and wether it is unbounded
+        std::pair<AABB, bool> addPrimitive(const std::shared_ptr<BaseObject>& obj, const Utility::Matrix4x4& matrix, const Utility::Matrix4x4& invmatrix);
+        // Adds an instance of a prototype
+        void addInstance(unsigned proto, const Utility::Matrix4x4& matrix, const Utility::Matrix4x4& invmatrix);
+        // Sorts the instances into the hierarchy and writes the device arrays
+        void finish();
+        // Writes an instance into the device arrays
+        void writeInstance(unsigned instance);
+        // Writes a hierarchy node into the device arrays
+        void writeNode(unsigned node);
+    };
+
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+
+#include <opencl.hpp>
+#include <interpreter.hpp>
+#include <scene.hpp>
+
+namespace Raytracing {
+
+    /**
+     * @brief A material as the device reads it, has to match Material in the kernel
+     * 
+     */
+    struct MaterialRecord {
+        cl_float ambient, diffuse, specular;
+        cl_float reflection, refraction, refractionIndex;
+        cl_float shininess;
+        cl_float r, g, b;
+    };
+
+    /**
+     * @brief A light source as the device reads it, has to match Light in the kernel
+     * 
+     */
+    struct LightRecord {
+        cl_float x, y, z;
+        cl_float r, g, b;
+        // Distance at which the light has faded out, 0 if it reaches everything
+        cl_float radius;
+    };
+
+    /**
+     * @brief Settings of the whole scene as the device reads them, has to match SceneHeader in the kernel
+     * 
+     */
+    struct SceneHeader {
+        // Color of the sky and the ambient light
+        cl_float ambient[3];
+        // Intensity of the ambient light
+        cl_float ambientIntensity[3];
+        // Amount of instances
+        cl_uint instances;
+        // Amount of light sources
+        cl_uint lights;
+        // Amount of unbounded instances, see Scene::unbounded
+        cl_uint unbounded;
+        // Amount of nodes in the instance hierarchy
+        cl_uint nodes;
+        // Amount of lights without a radius, they come first and are always visited
+        cl_uint unboundedLights;
+        // Amount of nodes in the hierarchy over the lights with a radius
+        cl_uint lightNodes;
+        // Amount of nodes in the tree lights are sampled with
+        cl_uint lightTree;
+    };
+
+    /**
+     * @brief Materials, lights and scene settings in the compact form the device works with.
+     * Everything in here is small and only read, so it is meant to live in constant memory.
+     */
+    class Shading
+    {
+    public:
+        // All materials by their id
+        std::vector<MaterialRecord> materials;
+        // All light sources, the ones without a radius first and the others in the order of the leaves of the light hierarchy
+        std::vector<LightRecord> lights;
+        // Hierarchy over the spheres lights with a radius reach, laid out like Scene::bvhNodes with the leaves referencing lights
+        std::vector<cl_float4> lightNodes;
+        // Tree over the positions of all lights to pick lights at random by how much they add, three vectors per node:
+        // lower corner and first index, upper corner and amount of lights (0 for inner nodes), summed power of the lights in x
+        std::vector<cl_float4> lightTree;
+        // Lights in the order of the leaves of the light tree
+        std::vector<cl_uint> lightOrder;
+        // Settings of the scene
+        SceneHeader header;
+
+        /**
+         * @brief Construct an empty Shading object
+         * 
+         */
+        Shading() : header() {}
+
+        /**
+         * @brief Collects the materials, lights and settings of an interpreted file
+         * 
+         * @param inp The interpreter after reading the file
+         * @param scene The scene built from the same file
+         */
+        void build(const Interpreter& inp, const Scene& scene);
+        /**
+         * @brief Bytes the material and light tables and the light hierarchies occupy on the device
+         * 
+         * @return The amount of bytes
+         */
+        size_t tableBytes() const noexcept;
+        /**
+         * @brief Check if the tables and the header fit into the constant memory of a device
+         * 
+         * @param info The device
+         * @return True if they fit, they have to be placed in global memory otherwise
+         */
+        bool fitsConstant(const Device_Info& info) const noexcept;
+        /**
+         * @brief Estimates the power of a light to pick it with, has to match light_power in the kernel
+         * 
+         * @param light The light
+         * @return The brightest channel of its color, but never 0 so every light can be picked
+         */
+        static float power(const LightRecord& light) noexcept;
+    };
+
+}
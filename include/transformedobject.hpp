@@ -37,6 +37,23 @@ namespace Raytracing {
          */
         Utility::Matrix4x4 getInverseMatrix();
 
+        /**
+         * @brief Get the matrix of a single transformation, without any linked transformations
+         * 
+         * @param op The transformation
+         * @param scale The scale of the transformation, see the constructor for its meaning
+         * @return The transformation matrix
+         */
+        static Utility::Matrix4x4 opMatrix(TransformOps op, const Utility::Vec3& scale);
+        /**
+         * @brief Get the inverse matrix of a single transformation, without any linked transformations
+         * 
+         * @param op The transformation
+         * @param scale The scale of the transformation, see the constructor for its meaning
+         * @return The inverse transformation matrix
+         */
+        static Utility::Matrix4x4 opInverseMatrix(TransformOps op, const Utility::Vec3& scale);
+
         /**
          * @brief Construct a new Transformed Object using Vec3
          * 
@@ -92,6 +92,12 @@ namespace Utility {
     const Exception MISSING_VARIABLE_EXCEPTION(2, std::string("Missing a required variable."));
     // The object hierarchy has a wrong format
     const Exception WRONG_OBJECT_HIERARCHY_EXCEPTION(3, std::string("Wrong object hierarchy encountered."));
+    // An unknown option was given on the command line
+    const Exception INVALID_OPTION_EXCEPTION(4, std::string("Invalid command line option."));
+    // An input file can't be opened
+    const Exception MISSING_FILE_EXCEPTION(5, std::string("Can't open the input file."));
+    // An output file can't be written
+    const Exception WRITE_FILE_EXCEPTION(6, std::string("Can't write the output file."));
 
     /**
      * @brief Standard 3-dimensional vector
@@ -136,6 +142,20 @@ namespace Utility {
          * 
          */
         constexpr Vec3(Vec3&& other) = default;
+        /**
+         * @brief Assigns a vector
+         * 
+         * @param other The vector to be copied. Remains unchanged
+         * 
+         */
+        constexpr Vec3& operator=(const Vec3& other) = default;
+        /**
+         * @brief Assigns a moved vector
+         * 
+         * @param other The vector to be moved
+         * 
+         */
+        constexpr Vec3& operator=(Vec3&& other) = default;
 
         /**
          * @brief Dot product
@@ -388,6 +408,22 @@ namespace Utility {
      * @return An array that contains the same information, but in a format usable for OpenCV and with switched R and B channels
      */
     Utility::AutoArray<uint8_t> openclMemToArray(const Memory<cl_float3>& other);
+    /**
+     * @brief Converts colors read back from the device to what is required by OpenCV
+     * 
+     * @param other The colors of all pixels
+     * @return An array that contains the same information, but in a format usable for OpenCV and with switched R and B channels
+     */
+    Utility::AutoArray<uint8_t> openclMemToArray(const std::vector<cl_float4>& other);
+    /**
+     * @brief Converts colors read back from the device to 8 bit pixels, clamping them to [0, 1] first
+     * 
+     * @param colors The colors of all pixels
+     * @param count Amount of pixels to convert, at most colors.size()
+     * @param bgr True for the channel order OpenCV expects, false for RGB
+     * @return Three bytes per pixel
+     */
+    std::vector<uint8_t> colorsToBytes(const std::vector<cl_float4>& colors, size_t count, bool bgr);
 
 }
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <memory>
 #include <cmath>
 #include <vector>
@@ -11,232 +12,525 @@
 #include <transformedobject.hpp>
 #include <fulltransobject.hpp>
 #include <interpreter.hpp>
+#include <scene.hpp>
+#include <shading.hpp>
+#include <renderer.hpp>
+#include <options.hpp>
+#include <autotuner.hpp>
+#include <deviceselector.hpp>
+#include <multirenderer.hpp>
+#include <renderserver.hpp>
+#include <animation.hpp>
+#include <framewriter.hpp>
+#include <framepipeline.hpp>
+#include <progressiverenderer.hpp>
+#include <filewatcher.hpp>
 
-/// @brief This function searches the object tree and writes found information in order of those objects into the given memory objects.
-/// @param objects Data about the base objects
-/// @param objectMats Object matrices
-/// @param invMats Object inverse matrices
-/// @param cmpInfo Information about complex combinations
-/// @param obj The top object in the tree
-/// @param objNum Put in a variable set to the index of the first uninitialized object in objects
-void search(Memory<cl_float8>& objects, Memory<cl_float16>& objectMats,
-	Memory<cl_float16>& invMats, /*Memory<cl_int4>& cmpInfo, */std::shared_ptr<Raytracing::Object> obj, unsigned& objNum)
+/// @brief Converts the primary rays of the interpreter to what the device reads
+void convertRays(const Raytracing::Interpreter& inp, std::vector<cl_float4>& rayStarts, std::vector<cl_float4>& rayDirs)
 {
-	if (obj->type() == Raytracing::ObjectType::Fulltransform)
-	{
-		// Because we know we are dealing with a fulltransform object and not a normal object now
-		auto fto = std::dynamic_pointer_cast<Raytracing::Fulltransform>(obj);
-		auto bso = std::dynamic_pointer_cast<Raytracing::BaseObject>(fto->obj);
-		// Type information of the base object
-		const float t = bso->bt == Raytracing::BaseTypes::Sphere ? 0.f : 1.f;
-		objects[objNum] = {
-			// Oh no, we can't downcast in a {}-initializer O.o
-			static_cast<float>(bso->pos.x()),
-			static_cast<float>(bso->pos.y()),
-			static_cast<float>(bso->pos.z()),
-			static_cast<float>(bso->rd),
-			static_cast<float>(bso->mat_id),
-			t, 0.f, 0.f
-		};
-		auto m = fto->matrix;
-		objectMats[objNum] = {
-			static_cast<float>(m.mat[0][0]), static_cast<float>(m.mat[0][1]), static_cast<float>(m.mat[0][2]), static_cast<float>(m.mat[0][3]),
-			static_cast<float>(m.mat[1][0]), static_cast<float>(m.mat[1][1]), static_cast<float>(m.mat[1][2]), static_cast<float>(m.mat[1][3]),
-			static_cast<float>(m.mat[2][0]), static_cast<float>(m.mat[2][1]), static_cast<float>(m.mat[2][2]), static_cast<float>(m.mat[2][3]),
-			static_cast<float>(m.mat[3][0]), static_cast<float>(m.mat[3][1]), static_cast<float>(m.mat[3][2]), static_cast<float>(m.mat[3][3]),
-		};
-		m = fto->invmatrix;
-		invMats[objNum] = {
-			static_cast<float>(m.mat[0][0]), static_cast<float>(m.mat[0][1]), static_cast<float>(m.mat[0][2]), static_cast<float>(m.mat[0][3]),
-			static_cast<float>(m.mat[1][0]), static_cast<float>(m.mat[1][1]), static_cast<float>(m.mat[1][2]), static_cast<float>(m.mat[1][3]),
-			static_cast<float>(m.mat[2][0]), static_cast<float>(m.mat[2][1]), static_cast<float>(m.mat[2][2]), static_cast<float>(m.mat[2][3]),
-			static_cast<float>(m.mat[3][0]), static_cast<float>(m.mat[3][1]), static_cast<float>(m.mat[3][2]), static_cast<float>(m.mat[3][3]),
-		};
-		objNum++;
-		return;
-	}
-	else if (obj->type() == Raytracing::ObjectType::Complex)
-	{
-		/*// Copy the current index
-		int n = cmpNum;
-		// Put operation information into the cmpInfo
-		cmpInfo[n].s[3] = Utility::to_underlying(std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->operation);
-		// Link to the next objects in the tree
-		cmpInfo[n].s[0] = search(objects, objectMats, invMats, cmpInfo, std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->left, objNum, ++cmpNum);
-		cmpInfo[n].s[1] = search(objects, objectMats, invMats, cmpInfo, std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->right, objNum, ++cmpNum);
-		// If those objects are complex themselves, we need to doubly-link them
-		if (cmpInfo[n].s[0] >= 0)
-			cmpInfo[cmpInfo[n].s[0]].s[2] = n;
-		if (cmpInfo[n].s[1] >= 0)
-			cmpInfo[cmpInfo[n].s[1]].s[2] = n;
-		return cmpNum;*/
-		search(objects, objectMats, invMats, std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->left, objNum);
-		search(objects, objectMats, invMats, std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->right, objNum);
-	}
-	else if (obj->type() == Raytracing::ObjectType::Base)
-	{
-		auto bso = std::dynamic_pointer_cast<Raytracing::BaseObject>(obj);
-		// Type information of the base object
-		const float t = bso->bt == Raytracing::BaseTypes::Sphere ? 0.f : 1.f;
-		objects[objNum++] = {
-			static_cast<float>(bso->pos.x()),
-			static_cast<float>(bso->pos.y()),
-			static_cast<float>(bso->pos.z()),
-			static_cast<float>(bso->rd),
-			static_cast<float>(bso->mat_id),
-			t, 0.f, 0.f
-		};
-		return;
+	const ulong N = inp.rays.size();
+	rayStarts.resize(N);
+	rayDirs.resize(N);
+	for (ulong i = 0; i < N; i++) {
+		rayStarts[i] = { (float)inp.rays[i]->start.x(), (float)inp.rays[i]->start.y(), (float)inp.rays[i]->start.z(), 1.f };
+		rayDirs[i] = { (float)inp.rays[i]->dir.x(), (float)inp.rays[i]->dir.y(), (float)inp.rays[i]->dir.z(), 1.f };
 	}
 }
 
-int main(int argc, char* argv[]) {
-	std::string filename;
-	if (argc >= 2) filename = argv[1];
-	else filename = "input.rti";
-	Raytracing::Interpreter inp;
-	try
+/// @brief Renders an image coarse to fine, showing every pass in the output window
+/// @return The color of every pixel
+std::vector<cl_float4> renderProgressive(Raytracing::Renderer& renderer, const std::vector<cl_float4>& rayStarts, const std::vector<cl_float4>& rayDirs,
+	uint width, unsigned depth)
+{
+	// Every pass is shown in the window the final image goes to
+	const std::string win = "Raytracing Output";
+	cv::namedWindow(win, cv::WINDOW_AUTOSIZE);
+	Raytracing::ProgressiveRenderer progressive(renderer, rayStarts, rayDirs, width, depth);
+	Clock clock;
+	while (!progressive.done())
 	{
-		inp.interpretFile(filename);
+		progressive.next();
+		print_info("Showing " + progressive.describe() + " after " + to_string(clock.stop() * 1000., 1u) + " ms.");
+		auto ar = Utility::openclMemToArray(progressive.image());
+		cv::Mat matrix((int)(rayStarts.size() / width), (int)width, CV_8UC3, ar.array);
+		cv::imshow(win, matrix);
+		cv::waitKey(1);
 	}
-	catch (Utility::Exception e)
+	return progressive.image();
+}
+
+cl_float4 toFloat4(const Utility::Vec3& v)
+{
+	return { (float)v.x(), (float)v.y(), (float)v.z(), 0.f };
+}
+
+/// @brief Traces options.samples jittered rays per pixel with the camera of the file and averages them
+/// @return The color of every pixel
+std::vector<cl_float4> renderSamples(Raytracing::Renderer& renderer, const Raytracing::Options& options, const Raytracing::Interpreter& inp, uint width)
+{
+	Utility::Vec3 corner, stepX, stepY;
+	inp.camera(inp.EyePos, inp.Lookat, corner, stepX, stepY);
+	const std::vector<cl_float4> colors = renderer.renderSamples(toFloat4(inp.EyePos), toFloat4(corner), toFloat4(stepX), toFloat4(stepY), width,
+		options.samples, options.adaptive);
+	print_info("Traced " + std::to_string(renderer.sampledRays) + " primary rays, " + to_string((double)renderer.sampledRays / colors.size(), 2u)
+		+ " per pixel.");
+	return colors;
+}
+
+/// @brief Averages up to options.passes passes of light sampling with the camera of the file, and stops early once the average
+/// is certain to half a step of an 8 bit color. Prints how far every pass converged, and shows it in the output window if asked to.
+/// @return The color of every pixel
+std::vector<cl_float4> renderLightPasses(Raytracing::Renderer& renderer, const Raytracing::Options& options, const Raytracing::Interpreter& inp,
+	uint width, bool show)
+{
+	const double converged = 0.5 / 255.;
+	const std::string win = "Raytracing Output";
+	if (show) cv::namedWindow(win, cv::WINDOW_AUTOSIZE);
+	Utility::Vec3 corner, stepX, stepY;
+	inp.camera(inp.EyePos, inp.Lookat, corner, stepX, stepY);
+	std::vector<cl_float4> colors;
+	Clock clock;
+	for (unsigned pass = 0; pass < options.passes; pass++)
 	{
-		Utility::printException(e);
-		std::cin.get();
-		return -1;
+		renderer.addPass(toFloat4(inp.EyePos), toFloat4(corner), toFloat4(stepX), toFloat4(stepY), width, pass);
+		double error;
+		colors = renderer.passAverage(error);
+		// A single pass has no spread to estimate the error from
+		if (pass == 0) print_info("Pass 1 of " + std::to_string(options.passes) + " after " + to_string(clock.stop() * 1000., 1u) + " ms.");
+		else print_info("Pass " + std::to_string(pass + 1) + " of " + std::to_string(options.passes) + " after " + to_string(clock.stop() * 1000., 1u)
+			+ " ms, standard error " + to_string(error * 255., 2u) + " steps of an 8 bit color.");
+		if (show)
+		{
+			auto ar = Utility::openclMemToArray(colors);
+			cv::Mat matrix((int)(colors.size() / width), (int)width, CV_8UC3, ar.array);
+			cv::imshow(win, matrix);
+			cv::waitKey(1);
+		}
+		if (pass > 0 && error < converged) break;
 	}
-	Device device(select_device_with_most_flops()); // compile OpenCL C code for the fastest available device
+	return colors;
+}
 
-	const ulong N = inp.variables["width"] * inp.variables["height"]; // size of vectors
+/// @brief Renders an image on a single device
+/// @return The color of every pixel
+std::vector<cl_float4> renderSingle(const Raytracing::Options& options, const Raytracing::Interpreter& inp, const Raytracing::Scene& scene,
+	const Raytracing::Shading& shading, const std::vector<cl_float4>& rayStarts, const std::vector<cl_float4>& rayDirs)
+{
+	const Device_Info info = Raytracing::DeviceSelector::select(options.device, options.select, options.remeasure);
+	const string defines = Raytracing::Renderer::defines(inp, shading, info);
+	Device device(info, defines + get_opencl_c_code()); // compile OpenCL C code for the selected device
+	// vload_half and vstore_half are part of every OpenCL version, the device only needs fp16 support to compute in half precision
+	if (options.half && !info.is_fp16_capable) print_info("Device has no fp16 support, ray buffers are still stored in half precision.");
+
+	const ulong N = rayStarts.size(); // size of vectors
+	const unsigned depth = static_cast<unsigned>(inp.variables.at("raydepth"));
+	const uint width = static_cast<uint>(inp.variables.at("width"));
+	const Raytracing::Workgroups workgroups = Raytracing::Autotuner::workgroups(device, options.retune);
 
 	{
-		unsigned mu = sizeof(cl_float8) + inp.materials.size() * sizeof(cl_float16) +
-			7 * sizeof(float) + inp.base_objs * (sizeof(cl_float8) + 2 * sizeof(cl_float16)) + inp.cmpOps * sizeof(cl_int4);
-		for (unsigned i = 0; i < inp.variables["raydepth"]; i++)
-			mu += 3 * N * pow(2, i) * sizeof(cl_float4);
+		ulong mu = sizeof(Raytracing::SceneHeader) + shading.tableBytes() + scene.deviceBytes() + Raytracing::Renderer::rayBytes(N, depth, options.half)
+			+ Raytracing::Renderer::sortBytes(N, depth);
+		// The full precision reference for the error report
+		if (options.half) mu += Raytracing::Renderer::rayBytes(N, depth, false);
+		// The sums of the samples and the pixels that get more of them
+		if (options.samples > 1 || options.lightSamples > 0) mu += N * (2 * sizeof(cl_float4) + sizeof(cl_uint));
 
 		print_info("Total expected memory usage of program upon initialization: " + std::to_string(mu) + " bytes ("
 			+ std::to_string(mu / 1024) + "kB, " + std::to_string(mu / 1024 / 1024) + "mB)");
 		print_info("Due to executed code, the actual memory usage might be higher! This is dependent on your machine and OpenCL C compiler.");
 	}
 
-	// A base object (which is for now the only one handled) only needs three values for its position
-	// and one value for its radius/direction; additionally one for the material. Additional
-	// values are reserved for transformations/complex stuff in the future.
-	Memory<cl_float8> objects(device, inp.base_objs, 1U, true, true, cl_float8 {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f});
-	Memory<cl_float16> objectMats(device, inp.base_objs, 1U, true, true, cl_float16 {1.f, 0.f, 0.f, 0.f,
-																					0.f, 1.f, 0.f, 0.f,
-																					0.f, 0.f, 1.f, 0.f,
-																					0.f, 0.f, 0.f, 1.f});
-	Memory<cl_float16> objectInvMats(device, inp.base_objs, 1U, true, true, cl_float16 {1.f, 0.f, 0.f, 0.f,
-																						0.f, 1.f, 0.f, 0.f,
-																						0.f, 0.f, 1.f, 0.f,
-																						0.f, 0.f, 0.f, 1.f});
-	//Memory<cl_int4> complexInfo(device, inp.cmpOps + 1, 1U, true, true, cl_int4 {-1, 0, 0, 0});
-	Memory<cl_float16> materials(device, inp.materials.size(), 1U, true, true, cl_float16 {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f});
-	Memory<float> ambient_data(device, 8);
-	Memory<cl_float8> lights(device, inp.lightSources.size(), 1U, true, true, cl_float8 {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f});
-
-	std::vector<Memory<cl_float4>> starts(inp.variables["raydepth"]);
-	std::vector<Memory<cl_float4>> dirs(inp.variables["raydepth"]);
-	std::vector<Memory<cl_float4>> colors(inp.variables["raydepth"]);
-	for (unsigned i = 0; i < starts.size(); i++)
-	{
-		starts[i] = Memory<cl_float4>(device, N * pow(2, i), 1U, true, true, cl_float4 {0.f, 0.f, 0.f, 0.f});
-		dirs[i] = Memory<cl_float4>(device, N * pow(2, i), 1U, true, true, cl_float4 {0.f, 0.f, 0.f, 0.f});
-		colors[i] = Memory<cl_float4>(device, N * pow(2, i), 1U, true, true, cl_float4 {-1.f, 0.f, 0.f, 0.f});
-		starts[i].write_to_device();
-		dirs[i].write_to_device();
-		colors[i].write_to_device();
-	}
-	for(unsigned i = 0; i < starts[0].length(); i++) {
-		starts[0][i] = { (float)inp.rays[i]->start.x(), (float)inp.rays[i]->start.y(), (float)inp.rays[i]->start.z(), 1.f };
-		dirs[0][i] = { (float)inp.rays[i]->dir.x(), (float)inp.rays[i]->dir.y(), (float)inp.rays[i]->dir.z(), 1.f };
-	}
-	starts[0].write_to_device();
-	dirs[0].write_to_device();
-	print_info("Set up device memory.");
-
-	ambient_data[0] = inp.variables["ambient_r"];
-	ambient_data[1] = inp.variables["ambient_g"];
-	ambient_data[2] = inp.variables["ambient_b"];
-	ambient_data[3] = inp.variables["ambient_int_r"];
-	ambient_data[4] = inp.variables["ambient_int_g"];
-	ambient_data[5] = inp.variables["ambient_int_b"];
-	ambient_data[6] = static_cast<float>(inp.base_objs);
-	ambient_data[7] = static_cast<float>(inp.lightSources.size());
-
-	unsigned objNum {0};
-	search(objects, objectMats, objectInvMats,/* complexInfo, */inp.topObject, objNum);
-
-	for (const auto& i : inp.materials)
-	{
-		materials[i.second->mat_id] = {
-			static_cast<float>(i.second->ambref),
-			static_cast<float>(i.second->diffref),
-			static_cast<float>(i.second->specref),
-			static_cast<float>(i.second->rflec),
-			static_cast<float>(i.second->rfrac),
-			static_cast<float>(i.second->rfracind),
-			static_cast<float>(i.second->shiny),
-			static_cast<float>(i.second->color.x()),
-			static_cast<float>(i.second->color.y()),
-			static_cast<float>(i.second->color.z()), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0
-		};
-	}
-	unsigned lindex {0};
-	for (const auto& i : inp.lightSources)
-	{
-		lights[lindex++] = {
-			static_cast<float>(i.second->pos.x()),
-			static_cast<float>(i.second->pos.y()),
-			static_cast<float>(i.second->pos.z()),
-			static_cast<float>(i.second->color.x()),
-			static_cast<float>(i.second->color.y()),
-			static_cast<float>(i.second->color.z()), 0.f, 0.f
-		};
-	}
+	Raytracing::Renderer renderer(device, scene, shading, N, depth, options.half, options.sort);
+	renderer.setRays(rayStarts, rayDirs);
+	renderer.configure(options, workgroups, width);
 	print_info("Initialized device memory...");
-	ambient_data.write_to_device();
-	objects.write_to_device();
-	objectMats.write_to_device();
-	objectInvMats.write_to_device();
-	//complexInfo.write_to_device();
-	materials.write_to_device();
-	lights.write_to_device();
+	renderer.reportKernels();
 
 	print_info("Beginning raytracing...");
-	for (unsigned i = 0; i < inp.variables["raydepth"] - 1; i++)
+	std::vector<cl_float4> colors;
+	if (options.progressive) colors = renderProgressive(renderer, rayStarts, rayDirs, width, depth);
+	// The progressive passes are only a preview then, the samples make the final image
+	if (options.lightSamples > 0) colors = renderLightPasses(renderer, options, inp, width, true);
+	else if (options.samples > 1) colors = renderSamples(renderer, options, inp, width);
+	else if (!options.progressive)
+	{
+		renderer.render();
+		colors = renderer.colors();
+	}
+	print_info("Done with raytracing and color computation.");
+
+	if (options.half)
+	{
+		// Half precision only saves memory and bandwidth if the image stays the same, so compare it to a full precision render
+		Raytracing::Renderer reference(device, scene, shading, N, depth, false, false);
+		reference.setRays(rayStarts, rayDirs);
+		reference.configure(options, workgroups, width);
+		if (options.lightSamples > 0) Raytracing::Renderer::reportError(colors, renderLightPasses(reference, options, inp, width, false));
+		else if (options.samples > 1) Raytracing::Renderer::reportError(colors, renderSamples(reference, options, inp, width));
+		else
+		{
+			reference.render();
+			Raytracing::Renderer::reportError(colors, reference.colors());
+		}
+	}
+
+	if (options.sortBenchmark)
+	{
+		// Sorting only pays off once tracing the bounced rays costs more than sorting them, which depends on the scene
+		print_info("Comparing render times with and without sorting for " + std::to_string(scene.primitiveCount()) + " primitives in "
+			+ std::to_string(scene.instanceCount()) + " instances...");
+		Raytracing::Renderer unsorted(device, scene, shading, N, depth, options.half, false);
+		Raytracing::Renderer sorted(device, scene, shading, N, depth, options.half, true);
+		unsorted.setRays(rayStarts, rayDirs);
+		unsorted.configure(options, workgroups, width);
+		sorted.setRays(rayStarts, rayDirs);
+		sorted.configure(options, workgroups, width);
+		// The first render of each includes compiling and caching effects, so the second one is measured
+		for (unsigned i = 0; i < 2; i++)
+		{
+			unsorted.render();
+			sorted.render();
+		}
+		Raytracing::Renderer::reportSortTimings(unsorted, sorted);
+	}
+	print_info("Buffer pool: " + device.pool.statistics() + ".");
+	return colors;
+}
+
+/// @brief Renders an image on several devices at once
+/// @return The color of every pixel
+std::vector<cl_float4> renderMulti(const Raytracing::Options& options, const Raytracing::Interpreter& inp, const Raytracing::Scene& scene,
+	const Raytracing::Shading& shading, const std::vector<cl_float4>& rayStarts, const std::vector<cl_float4>& rayDirs)
+{
+	if (options.sortBenchmark) print_warning("The sort benchmark is only run when rendering on a single device.");
+	if (options.half) print_warning("The error of half precision is only reported when rendering on a single device.");
+	const std::vector<Device_Info> infos = Raytracing::DeviceSelector::selectAll(options.device);
+	Raytracing::MultiRenderer multi(infos, inp, scene, shading, options);
+	print_info("Beginning raytracing on " + std::to_string(infos.size()) + " devices...");
+	std::vector<cl_float4> colors = multi.render(rayStarts, rayDirs);
+	print_info("Done with raytracing and color computation.");
+	multi.report();
+	return colors;
+}
+
+/// @brief State of the mouse in the interactive window
+struct MouseDrag {
+	bool down = false;
+	int x = 0, y = 0;
+	// Pixels dragged since the last frame
+	int dx = 0, dy = 0;
+};
+
+void onMouse(int event, int x, int y, int, void* data)
+{
+	MouseDrag& drag = *static_cast<MouseDrag*>(data);
+	if (event == cv::EVENT_LBUTTONDOWN) drag.down = true;
+	else if (event == cv::EVENT_LBUTTONUP) drag.down = false;
+	else if (event == cv::EVENT_MOUSEMOVE && drag.down)
+	{
+		drag.dx += x - drag.x;
+		drag.dy += y - drag.y;
+	}
+	drag.x = x;
+	drag.y = y;
+}
+
+/// @brief Shows the scene in a window and moves the camera with the keyboard and mouse, every move traces the image again.
+/// With --watch the file is read again whenever it is saved, and only what changed is written to the device.
+void renderInteractive(const Raytracing::Options& options, Raytracing::Interpreter& fileInp, const Raytracing::Scene& fileScene, const Raytracing::Shading& fileShading)
+{
+	if (options.multi) print_warning("The interactive window renders on a single device.");
+	const Device_Info info = Raytracing::DeviceSelector::select(options.device, options.select, options.remeasure);
+
+	// The scene of the last reload, the one read at startup until then
+	std::unique_ptr<Raytracing::Interpreter> loadedInp;
+	std::unique_ptr<Raytracing::Scene> loadedScene;
+	std::unique_ptr<Raytracing::Shading> loadedShading;
+	const Raytracing::Interpreter* inp = &fileInp;
+	const Raytracing::Scene* scene = &fileScene;
+	const Raytracing::Shading* shading = &fileShading;
+
+	std::string defines = Raytracing::Renderer::defines(*inp, *shading, info);
+	std::unique_ptr<Device> device(new Device(info, defines + get_opencl_c_code()));
+	std::unique_ptr<Raytracing::Renderer> renderer;
+	uint width = 0, height = 0;
+	unsigned depth = 0;
+	// The scene stays on the device, a move only sends the camera and the primary rays are created there
+	auto createRenderer = [&]() {
+		renderer.reset();
+		width = static_cast<uint>(inp->variables.at("width"));
+		height = static_cast<uint>(inp->variables.at("height"));
+		depth = static_cast<unsigned>(inp->variables.at("raydepth"));
+		renderer.reset(new Raytracing::Renderer(*device, *scene, *shading, (ulong)width * height, depth, options.half, options.sort));
+		renderer->configure(options, Raytracing::Autotuner::workgroups(*device, options.retune), width);
+	};
+	createRenderer();
+
+	// Steps of one key press: a twentieth of the distance to the point looked at, and two degrees
+	const double turn = 2. * Utility::PI / 180.;
+	// Radians per dragged pixel
+	const double drag = .3 * Utility::PI / 180.;
+	// Looking straight up or down has no defined sideways direction
+	const double maxPitch = 89. * Utility::PI / 180.;
+	Utility::Vec3 eye;
+	double distance = 0., move = 0., yaw = 0., pitch = 0.;
+	auto resetCamera = [&]() {
+		eye = inp->EyePos;
+		distance = std::max(1e-3, (inp->Lookat - inp->EyePos).len());
+		move = distance / 20.;
+		const Utility::Vec3 view = (inp->Lookat - inp->EyePos).normalise();
+		yaw = std::atan2(view.z(), view.x());
+		pitch = std::asin(std::max(-1., std::min(1., view.y())));
+	};
+	resetCamera();
+
+	const std::string win = "Raytracing Output";
+	cv::namedWindow(win, cv::WINDOW_AUTOSIZE);
+	MouseDrag mouse;
+	cv::setMouseCallback(win, onMouse, &mouse);
+	print_info("W/S move forward and back, A/D sideways, R/F up and down, I/K/J/L or dragging turns, Esc or Q quits.");
+	std::unique_ptr<Raytracing::FileWatcher> watcher;
+	if (options.watch)
 	{
-		Kernel ray_kernel(device, starts[i].length(), "ray_kernel",
-			starts[i], dirs[i], starts[i + 1], dirs[i + 1], colors[i],
-			ambient_data, objects, objectMats, objectInvMats, /*complexInfo, */materials, lights); // kernel that runs on the device
+		watcher.reset(new Raytracing::FileWatcher(options.file));
+		print_info("Watching " + options.file + ", saving it shows the changes.");
+	}
+
+	bool moved = true;
+	while (true)
+	{
+		if (watcher && watcher->changed())
+		{
+			Clock clock;
+			std::unique_ptr<Raytracing::Interpreter> nextInp(new Raytracing::Interpreter());
+			std::unique_ptr<Raytracing::Scene> nextScene(new Raytracing::Scene());
+			std::unique_ptr<Raytracing::Shading> nextShading(new Raytracing::Shading());
+			try
+			{
+				nextInp->interpretFile(options.file);
+				nextScene->build(*nextInp);
+				nextShading->build(*nextInp, *nextScene);
+			}
+			catch (Utility::Exception e)
+			{
+				// A file saved halfway through an edit keeps the last scene on screen
+				Utility::printException(e);
+				print_warning("Keeping the last scene.");
+				continue;
+			}
+			const bool cameraChanged = (nextInp->EyePos - inp->EyePos).len() > 0. || (nextInp->Lookat - inp->Lookat).len() > 0.;
+			const bool sizeChanged = nextInp->variables.at("width") != inp->variables.at("width")
+				|| nextInp->variables.at("height") != inp->variables.at("height") || nextInp->variables.at("raydepth") != inp->variables.at("raydepth");
+			const std::string nextDefines = Raytracing::Renderer::defines(*nextInp, *nextShading, info);
+			inp = nextInp.get();
+			scene = nextScene.get();
+			shading = nextShading.get();
+			std::string what;
+			if (nextDefines != defines)
+			{
+				// Constants the kernels are compiled with changed, i.e. the height of the csg tree or the amount of materials
+				renderer.reset();
+				device.reset();
+				device.reset(new Device(info, nextDefines + get_opencl_c_code()));
+				defines = nextDefines;
+				createRenderer();
+				what = "compiled the kernels again";
+			}
+			else if (sizeChanged)
+			{
+				createRenderer();
+				what = "allocated the ray buffers again";
+			}
+			else
+			{
+				const ulong written = renderer->updateScene(*scene, *shading);
+				what = "wrote " + std::to_string(written) + " changed bytes";
+			}
+			// The old scene is only released after the renderer stopped using it
+			loadedInp = std::move(nextInp);
+			loadedScene = std::move(nextScene);
+			loadedShading = std::move(nextShading);
+			if (cameraChanged || sizeChanged) resetCamera();
+			print_info("Reloaded " + options.file + " and " + what + " in " + to_string(clock.stop() * 1000., 1u) + " ms.");
+			moved = true;
+		}
+
+		const Utility::Vec3 forward(std::cos(pitch) * std::cos(yaw), std::sin(pitch), std::cos(pitch) * std::sin(yaw));
+		if (moved)
+		{
+			Clock clock;
+			Utility::Vec3 corner, stepX, stepY;
+			inp->camera(eye, eye + forward * distance, corner, stepX, stepY);
+			renderer->setCamera(toFloat4(eye), toFloat4(corner), toFloat4(stepX), toFloat4(stepY), width);
+			renderer->render();
+			std::vector<uint8_t> bgr = Utility::colorsToBytes(renderer->colors(), (size_t)width * height, true);
+			const double frame = clock.stop();
+			cv::Mat matrix((int)height, (int)width, CV_8UC3, bgr.data());
+			cv::putText(matrix, to_string(frame * 1000., 1u) + " ms (" + to_string(1. / frame, 1u) + " fps)", cv::Point(8, 20),
+				cv::FONT_HERSHEY_SIMPLEX, .5, cv::Scalar(255, 255, 255));
+			cv::imshow(win, matrix);
+			moved = false;
+		}
+
+		const int key = cv::waitKey(15) & 0xFF;
+		if (key == 27 || key == 'q') break;
+		const Utility::Vec3 side = (Utility::Vec3(0, -1, 0) % forward).normalise();
+		const Utility::Vec3 up(0, 1, 0);
+		switch (key)
+		{
+		case 'w': eye = eye + forward * move; break;
+		case 's': eye = eye - forward * move; break;
+		case 'd': eye = eye + side * move; break;
+		case 'a': eye = eye - side * move; break;
+		case 'r': eye = eye + up * move; break;
+		case 'f': eye = eye - up * move; break;
+		case 'l': yaw += turn; break;
+		case 'j': yaw -= turn; break;
+		case 'i': pitch += turn; break;
+		case 'k': pitch -= turn; break;
+		default: break;
+		}
+		if (mouse.dx != 0 || mouse.dy != 0)
+		{
+			yaw += mouse.dx * drag;
+			pitch -= mouse.dy * drag;
+			mouse.dx = mouse.dy = 0;
+			moved = true;
+		}
+		pitch = std::max(-maxPitch, std::min(maxPitch, pitch));
+		moved = moved || std::string("wsdarfljik").find((char)key) != std::string::npos;
+	}
+	cv::destroyAllWindows();
+}
 
-		ray_kernel.run(); // run ray_kernel on the device
+/// @brief Renders every frame of an animation on a single device and writes them out
+/// @return False if the keyframes can't be read
+bool renderAnimation(const Raytracing::Options& options, Raytracing::Interpreter& inp, Raytracing::Scene& scene, const Raytracing::Shading& shading)
+{
+	Raytracing::Animation animation;
+	try
+	{
+		animation.load(options.animate);
+		animation.bind(inp, scene);
 	}
-	// The last rays in the reflection hierarchy don't create further rays, so they're passed a nullpointer.
+	catch (Utility::Exception e)
 	{
-		unsigned i = inp.variables["raydepth"] - 1;
-		Kernel ray_kernel(device, starts[i].length(),
-			"ray_kernel", starts[i], dirs[i], NULL, NULL, colors[i],
-			ambient_data, objects, objectMats, objectInvMats, /*complexInfo, */materials, lights);
-		ray_kernel.run();
+		Utility::printException(e);
+		return false;
 	}
+	if (options.multi) print_warning("Animations are rendered on a single device.");
+	if (options.half || options.sortBenchmark) print_warning("The error of half precision and the sort benchmark aren't reported for animations.");
 
-	print_info("Done with raytracing, computing colors...");
+	const Device_Info info = Raytracing::DeviceSelector::select(options.device, options.select, options.remeasure);
+	Device device(info, Raytracing::Renderer::defines(inp, shading, info) + get_opencl_c_code());
+	const unsigned depth = static_cast<unsigned>(inp.variables.at("raydepth"));
+	const uint width = static_cast<uint>(inp.variables.at("width"));
+	const uint height = static_cast<uint>(inp.variables.at("height"));
 
-	for (unsigned i = inp.variables["raydepth"] - 1; i > 0; i--)
+	// Device, program, scene and ray buffers are set up once, every frame only writes what changed
+	Raytracing::Renderer renderer(device, scene, shading, (ulong)width * height, depth, options.half, options.sort);
+	renderer.configure(options, Raytracing::Autotuner::workgroups(device, options.retune), width);
+	std::unique_ptr<Raytracing::FrameWriter> writer;
+	try
 	{
-		Kernel color_kernel(device, colors[i - 1].length(), "color_kernel", colors[i], colors[i - 1]);
-		color_kernel.run();
+		writer.reset(new Raytracing::FrameWriter(options.output, options.format, width, height, options.fps, options.half));
+	}
+	catch (Utility::Exception e)
+	{
+		Utility::printException(e);
+		return false;
 	}
-	colors[0].read_from_device();
 
-	print_info("Done with color computation.");
+	print_info("Rendering " + std::to_string(animation.frames) + " frames...");
+	std::vector<cl_float4> rayStarts, rayDirs;
+	std::map<std::string, double> camera;
+	Raytracing::FramePipeline pipeline(renderer, *writer);
+	Clock clock;
+	for (unsigned frame = 0; frame < animation.frames; frame++)
+	{
+		// Rays are only created again if the camera moved
+		std::map<std::string, double> next = camera;
+		animation.camera(frame, next);
+		if (frame == 0 || next != camera)
+		{
+			inp.setVariables(next);
+			convertRays(inp, rayStarts, rayDirs);
+			renderer.setRays(rayStarts, rayDirs);
+			camera = next;
+		}
+		if (animation.apply(frame, scene))
+		{
+			const bool rebuilt = scene.update();
+			renderer.updateInstances(scene, rebuilt);
+		}
+		// The frame is traced while the last one is read back and encoded
+		pipeline.render(frame);
+		if (writer->failed()) break;
+	}
+	pipeline.flush();
+	writer->finish();
+	const double total = clock.stop();
+	print_info("Rendered " + std::to_string(animation.frames) + " frames in " + to_string(total, 2u) + " s (" + to_string(animation.frames / total, 2u)
+		+ " frames per second), " + to_string(pipeline.waited(), 2u) + " s of it waiting for the device. Buffer pool: " + device.pool.statistics() + ".");
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	Raytracing::Options options;
+	Raytracing::Interpreter inp;
+	try
+	{
+		options = Raytracing::Options::parse(argc, argv);
+		// Frames streamed to stdout must not be mixed with messages
+		if (!options.animate.empty() && options.output == "-") std::cout.rdbuf(std::cerr.rdbuf());
+		if (!options.server.empty())
+		{
+			// Scenes are sent to the server, so no file is read here
+			Raytracing::RenderServer server(options.server, options);
+			server.run();
+			return 0;
+		}
+		inp.interpretFile(options.file);
+	}
+	catch (Utility::Exception e)
+	{
+		Utility::printException(e);
+		std::cin.get();
+		return -1;
+	}
+	Raytracing::Scene scene;
+	scene.build(inp);
+	print_info("Flattened scene into " + std::to_string(scene.prototypes.size()) + " prototypes with "
+		+ std::to_string(scene.primitiveCount()) + " primitives and " + std::to_string(scene.instanceCount()) + " instances ("
+		+ std::to_string(scene.nodeCount()) + " hierarchy nodes, " + std::to_string(scene.complexInfo.size()) + " csg nodes).");
+
+	Raytracing::Shading shading;
+	shading.build(inp, scene);
+
+	if (options.samples > 1 && (!options.animate.empty() || options.interactive || options.watch || options.multi))
+		print_warning("Several samples per pixel are only traced for single images on a single device.");
+	if (options.lightSamples > 0 && (!options.animate.empty() || options.interactive || options.watch || options.multi))
+		print_warning("Sampled lights are only averaged over passes for single images on a single device, the others show a single pass.");
+	if (options.lightSamples > 0 && options.samples > 1)
+		print_warning("With light sampling every pass is a jittered sample already, --samples is ignored in favour of --passes.");
+	if (!options.animate.empty()) return renderAnimation(options, inp, scene, shading) ? 0 : -1;
+	if (options.interactive || options.watch)
+	{
+		renderInteractive(options, inp, scene, shading);
+		return 0;
+	}
+
+	std::vector<cl_float4> rayStarts, rayDirs;
+	convertRays(inp, rayStarts, rayDirs);
+
+	if (options.multi && options.progressive) print_warning("Progressive previews are only shown when rendering on a single device.");
+	const std::vector<cl_float4> colors = options.multi ? renderMulti(options, inp, scene, shading, rayStarts, rayDirs)
+		: renderSingle(options, inp, scene, shading, rayStarts, rayDirs);
 
 	std::string win = "Raytracing Output";
 	cv::namedWindow(win, cv::WINDOW_AUTOSIZE);
-	auto ar = Utility::openclMemToArray(colors[0]);
+	auto ar = Utility::openclMemToArray(colors);
 	cv::Mat matrix((int)inp.variables["height"], (int)inp.variables["width"], CV_8UC3, ar.array);
 	cv::imshow(win, matrix);
 
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <fstream>
+
+#include <animation.hpp>
+
+using namespace Raytracing;
+using Utility::to_underlying;
+
+namespace {
+
+    double number(const std::string& value)
+    {
+        try
+        {
+            return std::stod(value);
+        }
+        catch (std::exception&)
+        {
+            throw Utility::WRONG_FORMAT_EXCEPTION;
+        }
+    }
+
+    bool equal(const Utility::Matrix4x4& a, const Utility::Matrix4x4& b)
+    {
+        for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j < 4; j++)
+                if (a.mat[i][j] != b.mat[i][j]) return false;
+        return true;
+    }
+
+}
+
+void Animation::load(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) throw Utility::MISSING_FILE_EXCEPTION;
+
+    // Object keys are set with the operators of RTI files
+    const std::map<std::string, TransformOps> ops = {
+        { OperatorStrings[to_underlying(Operators::Transform)], TransformOps::Transform },
+        { OperatorStrings[to_underlying(Operators::Scale)], TransformOps::Scale },
+        { OperatorStrings[to_underlying(Operators::RotateX)], TransformOps::Rotatex },
+        { OperatorStrings[to_underlying(Operators::RotateY)], TransformOps::Rotatey },
+        { OperatorStrings[to_underlying(Operators::RotateZ)], TransformOps::Rotatez }
+    };
+    const std::string& assign = OperatorStrings[to_underlying(Operators::Assignment)];
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::vector<std::string> tokens;
+        Utility::split(line, tokens);
+        if (tokens.empty() || tokens[0][0] == CreationChars[to_underlying(CreationSigns::Comment)]) continue;
+        if (tokens[0] == "frames" && tokens.size() == 3 && tokens[1] == assign)
+        {
+            frames = static_cast<unsigned>(number(tokens[2]));
+            if (frames == 0) throw Utility::WRONG_FORMAT_EXCEPTION;
+            continue;
+        }
+        if (tokens[0][0] != '@' || tokens.size() < 4) throw Utility::WRONG_FORMAT_EXCEPTION;
+        const unsigned frame = static_cast<unsigned>(number(Utility::remove_first(tokens[0])));
+        const std::string& target = tokens[1];
+        const std::string& op = tokens[2];
+
+        if ((target == "eyepos" || target == "lookat") && op == assign && tokens.size() == 6)
+            addKey(cameraKeys[target], frame, Utility::Vec3(number(tokens[3]), number(tokens[4]), number(tokens[5])));
+        else if (target[0] == CreationChars[to_underlying(CreationSigns::Object)] && ops.count(op))
+        {
+            const TransformOps t = ops.at(op);
+            // Rotations take an angle, moving and scaling a vector
+            const bool rotation = t == TransformOps::Rotatex || t == TransformOps::Rotatey || t == TransformOps::Rotatez;
+            if (tokens.size() != (rotation ? 4u : 6u)) throw Utility::WRONG_FORMAT_EXCEPTION;
+            const Utility::Vec3 value = rotation ? Utility::Vec3(number(tokens[3]), 0., 0.)
+                : Utility::Vec3(number(tokens[3]), number(tokens[4]), number(tokens[5]));
+            AnimatedObject& obj = objects[Utility::remove_first(target)];
+            obj.applied = false;
+            addKey(obj.channels[t], frame, value);
+        }
+        else throw Utility::WRONG_FORMAT_EXCEPTION;
+    }
+}
+
+void Animation::bind(const Interpreter& inp, const Scene& scene)
+{
+    for (auto& i : objects)
+    {
+        auto named = inp.objects.find(i.first);
+        if (named == inp.objects.end())
+        {
+            print_warning("The animated object " + i.first + " doesn't exist.");
+            throw Utility::WRONG_OBJECT_HIERARCHY_EXCEPTION;
+        }
+        AnimatedObject& obj = i.second;
+        obj.instances = scene.instancesOf(named->second.get());
+        if (obj.instances.empty())
+        {
+            print_warning("The animated object " + i.first + " is part of another object. Transform it once, e.g. with !" + i.first
+                + " += 0.0 0.0 0.0, and place it at the top of the tree so it becomes an instance.");
+            throw Utility::WRONG_OBJECT_HIERARCHY_EXCEPTION;
+        }
+        obj.matrices.resize(obj.instances.size());
+        obj.invmatrices.resize(obj.instances.size());
+        for (size_t k = 0; k < obj.instances.size(); k++) scene.getTransform(obj.instances[k], obj.matrices[k], obj.invmatrices[k]);
+        obj.applied = false;
+    }
+}
+
+void Animation::camera(unsigned frame, std::map<std::string, double>& variables) const
+{
+    for (auto& i : cameraKeys)
+    {
+        const Utility::Vec3 v = sample(i.second, frame);
+        variables[i.first + "_x"] = v.x();
+        variables[i.first + "_y"] = v.y();
+        variables[i.first + "_z"] = v.z();
+    }
+}
+
+bool Animation::apply(unsigned frame, Scene& scene)
+{
+    bool changed = false;
+    for (auto& i : objects)
+    {
+        AnimatedObject& obj = i.second;
+        Utility::Matrix4x4 matrix, invmatrix;
+        // Scale first and move last, the inverse is built in the opposite order
+        for (const TransformOps t : { TransformOps::Scale, TransformOps::Rotatex, TransformOps::Rotatey, TransformOps::Rotatez, TransformOps::Transform })
+        {
+            auto channel = obj.channels.find(t);
+            if (channel == obj.channels.end()) continue;
+            const Utility::Vec3 v = sample(channel->second, frame);
+            matrix = TransformedObject::opMatrix(t, v) * matrix;
+            invmatrix = invmatrix * TransformedObject::opInverseMatrix(t, v);
+        }
+        if (obj.applied && equal(matrix, obj.last)) continue;
+        for (size_t k = 0; k < obj.instances.size(); k++)
+        {
+            Utility::Matrix4x4 m = matrix;
+            Utility::Matrix4x4 inv = obj.invmatrices[k];
+            scene.setTransform(obj.instances[k], m * obj.matrices[k], inv * invmatrix);
+        }
+        obj.last = matrix;
+        obj.applied = true;
+        changed = true;
+    }
+    return changed;
+}
+
+void Animation::addKey(Channel& channel, unsigned frame, const Utility::Vec3& value)
+{
+    auto it = std::lower_bound(channel.begin(), channel.end(), frame, [](const Key& k, unsigned f) { return k.frame < f; });
+    if (it != channel.end() && it->frame == frame) it->value = value;
+    else channel.insert(it, Key { frame, value });
+}
+
+Utility::Vec3 Animation::sample(const Channel& channel, unsigned frame)
+{
+    auto next = std::lower_bound(channel.begin(), channel.end(), frame, [](const Key& k, unsigned f) { return k.frame < f; });
+    // Before the first and after the last key the value stays the same
+    if (next == channel.begin()) return next->value;
+    if (next == channel.end()) return channel.back().value;
+    if (next->frame == frame) return next->value;
+    const Key& prev = *(next - 1);
+    const double t = static_cast<double>(frame - prev.frame) / static_cast<double>(next->frame - prev.frame);
+    return prev.value * (1. - t) + next->value * t;
+}
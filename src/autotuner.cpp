@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+#include <autotuner.hpp>
+#include <calibration.hpp>
+
+using namespace Raytracing;
+
+namespace {
+
+    // Work group sizes that are tried
+    const uint CANDIDATES[] = { 32, 64, 128, 256 };
+    // Heights of the tiles primary rays are tried with, 1 keeps them in rows
+    const uint TILE_HEIGHTS[] = { 1, 2, 4, 8, 16 };
+    // Renders per candidate, the fastest one counts
+    const unsigned RUNS = 3;
+
+}
+
+Workgroups Autotuner::workgroups(Device& device, bool retune)
+{
+    const DeviceCache cache(CACHE_FILE);
+    Workgroups sizes;
+    std::string values;
+    if (!retune && cache.get(device.info, values))
+    {
+        std::istringstream in(values);
+        if (in >> sizes.intersect >> sizes.shade >> sizes.color >> sizes.tileWidth >> sizes.tileHeight)
+        {
+            print_info("Using tuned work group sizes from " + std::string(CACHE_FILE) + ".");
+            return sizes;
+        }
+        sizes = Workgroups();
+    }
+    print_info("Tuning work group sizes for " + device.info.name + ", this is only done once...");
+    sizes = tune(device);
+    cache.set(device.info, std::to_string(sizes.intersect) + " " + std::to_string(sizes.shade) + " " + std::to_string(sizes.color)
+        + " " + std::to_string(sizes.tileWidth) + " " + std::to_string(sizes.tileHeight));
+    print_info("Tuned work group sizes: intersect " + std::to_string(sizes.intersect) + ", shade " + std::to_string(sizes.shade)
+        + ", color " + std::to_string(sizes.color) + ", primary tiles " + std::to_string(sizes.tileWidth) + "x" + std::to_string(sizes.tileHeight) + ".");
+    return sizes;
+}
+
+Workgroups Autotuner::tune(Device& device)
+{
+    const CalibrationScene calibration;
+    const uint width = calibration.width;
+    Renderer renderer(device, calibration.scene, calibration.shading, calibration.rayStarts.size(), calibration.depth, false, false);
+    renderer.setRays(calibration.rayStarts, calibration.rayDirs);
+
+    // The kernels don't depend on each other's work group size, so all of them are tuned at once
+    Workgroups best;
+    double intersect = std::numeric_limits<double>::max();
+    double shade = intersect, color = intersect;
+    for (const uint size : CANDIDATES)
+    {
+        Workgroups sizes;
+        sizes.intersect = sizes.shade = sizes.color = sizes.tileWidth = size;
+        renderer.setWorkgroups(sizes, width);
+        const Workgroups& used = renderer.getWorkgroups();
+        const Renderer::LevelTiming t = measure(renderer, false);
+        // Sizes a kernel can't run with were reduced and are tried on their own
+        if (used.intersect == size && t.intersect < intersect)
+        {
+            intersect = t.intersect;
+            best.intersect = size;
+        }
+        if (used.shade == size && t.shade < shade)
+        {
+            shade = t.shade;
+            best.shade = size;
+        }
+        if (used.color == size && t.color < color)
+        {
+            color = t.color;
+            best.color = size;
+        }
+    }
+
+    // The tile shape of the primary rays changes how coherent they are, which affects intersecting and shading them
+    double primary = std::numeric_limits<double>::max();
+    for (const uint size : CANDIDATES)
+    {
+        for (const uint height : TILE_HEIGHTS)
+        {
+            if (size / height < 4) continue;
+            Workgroups sizes = best;
+            sizes.tileWidth = size / height;
+            sizes.tileHeight = height;
+            renderer.setWorkgroups(sizes, width);
+            const Workgroups& used = renderer.getWorkgroups();
+            if (used.tileWidth != sizes.tileWidth || used.tileHeight != sizes.tileHeight) continue;
+            const Renderer::LevelTiming t = measure(renderer, true);
+            if (t.intersect + t.bin + t.shade < primary)
+            {
+                primary = t.intersect + t.bin + t.shade;
+                best.tileWidth = sizes.tileWidth;
+                best.tileHeight = sizes.tileHeight;
+            }
+        }
+    }
+    return best;
+}
+
+Renderer::LevelTiming Autotuner::measure(Renderer& renderer, bool primaryOnly)
+{
+    const double max = std::numeric_limits<double>::max();
+    Renderer::LevelTiming best = { max, max, max, max, max };
+    for (unsigned r = 0; r < RUNS; r++)
+    {
+        renderer.render();
+        Renderer::LevelTiming sum = { 0., 0., 0., 0., 0. };
+        for (size_t i = 0; i < (primaryOnly ? 1 : renderer.timings.size()); i++)
+        {
+            sum.sort += renderer.timings[i].sort;
+            sum.intersect += renderer.timings[i].intersect;
+            sum.bin += renderer.timings[i].bin;
+            sum.shade += renderer.timings[i].shade;
+            sum.color += renderer.timings[i].color;
+        }
+        best.sort = std::min(best.sort, sum.sort);
+        best.intersect = std::min(best.intersect, sum.intersect);
+        best.bin = std::min(best.bin, sum.bin);
+        best.shade = std::min(best.shade, sum.shade);
+        best.color = std::min(best.color, sum.color);
+    }
+    return best;
+}
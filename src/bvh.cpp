@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include <bvh.hpp>
+
+using namespace Raytracing;
+
+void AABB::grow(const AABB& other) noexcept
+{
+    for (unsigned i = 0; i < 3; i++)
+    {
+        lo.vals[i] = std::min(lo.vals[i], other.lo.vals[i]);
+        hi.vals[i] = std::max(hi.vals[i], other.hi.vals[i]);
+    }
+}
+
+AABB AABB::overlap(const AABB& other) const noexcept
+{
+    AABB res;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        res.lo.vals[i] = std::max(lo.vals[i], other.lo.vals[i]);
+        res.hi.vals[i] = std::min(hi.vals[i], other.hi.vals[i]);
+        if (res.lo.vals[i] > res.hi.vals[i]) return AABB();
+    }
+    return res;
+}
+
+double AABB::surface() const noexcept
+{
+    if (empty()) return 0.;
+    const auto d = hi - lo;
+    return 2. * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+AABB AABB::transformed(const Utility::Matrix4x4& mat) const noexcept
+{
+    if (empty()) return AABB();
+    // Transform the center and add up the extents along every axis (Arvo's method)
+    const auto c = centroid();
+    const auto e = (hi - lo) * 0.5;
+    Utility::Vec3 nc, ne;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        nc.vals[i] = mat.mat[i][3];
+        for (unsigned j = 0; j < 3; j++)
+        {
+            nc.vals[i] += mat.mat[i][j] * c.vals[j];
+            ne.vals[i] += std::abs(mat.mat[i][j]) * e.vals[j];
+        }
+    }
+    return AABB(nc - ne, nc + ne);
+}
+
+void BVH::build(const std::vector<AABB>& bounds)
+{
+    nodes.clear();
+    parents.clear();
+    levels.clear();
+    order.resize(bounds.size());
+    leaves.resize(bounds.size());
+    for (unsigned i = 0; i < order.size(); i++) order[i] = i;
+    depth = 0;
+    sah = builtCost = 0.;
+    if (bounds.empty()) return;
+    nodes.reserve(2 * (bounds.size() / LEAF_SIZE + 1));
+    nodes.push_back(Node());
+    parents.push_back(0);
+    levels.push_back(0);
+    split(bounds, 0, 0, static_cast<unsigned>(bounds.size()), 1);
+    marks.assign(nodes.size(), 0);
+    stamp = 0;
+    for (unsigned n = 0; n < nodes.size(); n++) sah += weight(n) * nodes[n].box.surface();
+    builtCost = cost();
+}
+
+std::vector<unsigned> BVH::refit(const std::vector<AABB>& bounds, const std::vector<unsigned>& moved)
+{
+    // Collect the dirty nodes of every level; every node is only visited once,
+    // so this stays proportional to the amount of moved items times the depth.
+    std::vector<std::vector<unsigned>> todo(depth + 1);
+    stamp++;
+    for (auto item : moved)
+    {
+        for (unsigned n = leaves[item]; marks[n] != stamp; n = parents[n])
+        {
+            marks[n] = stamp;
+            todo[levels[n]].push_back(n);
+            if (n == 0) break;
+        }
+    }
+
+    // Bottom-up: all nodes of a level only depend on the level below
+    std::vector<unsigned> dirty;
+    const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    for (auto level = todo.rbegin(); level != todo.rend(); ++level)
+    {
+        const auto& nodesOfLevel = *level;
+        // The cost is changed on this thread only, the workers would race on it
+        for (auto n : nodesOfLevel) sah -= weight(n) * nodes[n].box.surface();
+        if (nodesOfLevel.size() < PARALLEL_THRESHOLD || threads == 1)
+        {
+            for (auto n : nodesOfLevel) update(bounds, n);
+        }
+        else
+        {
+            std::vector<std::thread> pool;
+            const size_t chunk = (nodesOfLevel.size() + threads - 1) / threads;
+            for (size_t begin = 0; begin < nodesOfLevel.size(); begin += chunk)
+                pool.emplace_back([&, begin] () {
+                    for (size_t i = begin; i < std::min(nodesOfLevel.size(), begin + chunk); i++) update(bounds, nodesOfLevel[i]);
+                });
+            for (auto& t : pool) t.join();
+        }
+        for (auto n : nodesOfLevel) sah += weight(n) * nodes[n].box.surface();
+        dirty.insert(dirty.end(), nodesOfLevel.begin(), nodesOfLevel.end());
+    }
+    return dirty;
+}
+
+double BVH::cost() const noexcept
+{
+    if (nodes.empty() || nodes[0].box.surface() <= 0.) return 0.;
+    return sah / nodes[0].box.surface();
+}
+
+void BVH::update(const std::vector<AABB>& bounds, unsigned node)
+{
+    AABB box;
+    if (nodes[node].count > 0)
+        for (unsigned i = nodes[node].first; i < nodes[node].first + nodes[node].count; i++) box.grow(bounds[order[i]]);
+    else
+    {
+        box.grow(nodes[nodes[node].first].box);
+        box.grow(nodes[nodes[node].first + 1].box);
+    }
+    nodes[node].box = box;
+}
+
+void BVH::split(const std::vector<AABB>& bounds, unsigned node, unsigned first, unsigned count, unsigned level)
+{
+    AABB box, centers;
+    for (unsigned i = first; i < first + count; i++)
+    {
+        box.grow(bounds[order[i]]);
+        const auto c = bounds[order[i]].centroid();
+        centers.grow(AABB(c, c));
+    }
+    nodes[node].box = box;
+    if (level > depth) depth = level;
+    if (count <= LEAF_SIZE)
+    {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        for (unsigned i = first; i < first + count; i++) leaves[order[i]] = node;
+        return;
+    }
+
+    // Longest axis of the centers
+    const auto d = centers.hi - centers.lo;
+    unsigned axis = 0;
+    if (d.y() > d.vals[axis]) axis = 1;
+    if (d.z() > d.vals[axis]) axis = 2;
+
+    const unsigned half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+        [&] (unsigned a, unsigned b) {
+            return bounds[a].lo.vals[axis] + bounds[a].hi.vals[axis] < bounds[b].lo.vals[axis] + bounds[b].hi.vals[axis];
+        });
+
+    // Children are stored next to each other
+    const unsigned left = static_cast<unsigned>(nodes.size());
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    parents.push_back(node);
+    parents.push_back(node);
+    levels.push_back(level);
+    levels.push_back(level);
+    nodes[node].first = left;
+    nodes[node].count = 0;
+    split(bounds, left, first, half, level + 1);
+    split(bounds, left + 1, first + half, count - half, level + 1);
+}
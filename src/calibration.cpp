@@ -0,0 +1,75 @@
+#include <calibration.hpp>
+
+using namespace Raytracing;
+
+namespace {
+
+    // Several instances of a few spheres over a plane with two lights
+    const std::string CALIBRATION_SCENE = R"(width := 256.0
+height := 256.0
+lookat_x := 0.0
+lookat_y := 0.0
+lookat_z := 0.0
+eyepos_x := -12.0
+eyepos_y := 4.0
+eyepos_z := 0.0
+ambient_r := 0.3
+ambient_g := 0.3
+ambient_b := 1.0
+ambient_int_r := 1.0
+ambient_int_g := 1.0
+ambient_int_b := 1.0
+raydepth := 3.0
+?shiny := 0.1 0.8 0.4 0.5 0.0 1.125 8.0 0.8 0.2 0.2
+?matte := 0.2 0.9 0.1 0.0 0.0 1.0 2.0 0.2 0.8 0.2
+?floor := 0.2 0.7 0.1 0.3 0.0 1.0 2.0 0.6 0.6 0.6
+!body := sphere
+!body ?= shiny
+!body *= 1.5 1.5 1.5
+!top := sphere
+!top ?= matte
+!top += 0.0 1.8 0.0
+!side := sphere
+!side ?= shiny
+!side += 0.0 0.5 1.4
+!a := body | top
+!b := a | side
+!c := b
+!c += 0.0 0.0 4.0
+!d := b
+!d += 0.0 0.0 -4.0
+!e := b
+!e += 4.0 0.0 2.0
+!f := b
+!f += 4.0 0.0 -2.0
+!g := b | c
+!h := g | d
+!i := h | e
+!j := i | f
+!plane := hp
+!plane ?= floor
+!plane += 0.0 -1.5 0.0
+!k := j | plane
+!k <=
+*x := -6.0 6.0 3.0 1.0 1.0 1.0
+*y := -2.0 5.0 -5.0 0.8 0.8 0.8
+)";
+
+}
+
+CalibrationScene::CalibrationScene()
+{
+    inp.interpretString(CALIBRATION_SCENE);
+    scene.build(inp);
+    shading.build(inp, scene);
+
+    width = static_cast<uint>(inp.variables["width"]);
+    depth = static_cast<unsigned>(inp.variables["raydepth"]);
+    rayStarts.resize(inp.rays.size());
+    rayDirs.resize(inp.rays.size());
+    for (size_t i = 0; i < inp.rays.size(); i++)
+    {
+        rayStarts[i] = { (float)inp.rays[i]->start.x(), (float)inp.rays[i]->start.y(), (float)inp.rays[i]->start.z(), 1.f };
+        rayDirs[i] = { (float)inp.rays[i]->dir.x(), (float)inp.rays[i]->dir.y(), (float)inp.rays[i]->dir.z(), 1.f };
+    }
+}
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cmath>
+
+#include <csgoptimizer.hpp>
+#include <baseobject.hpp>
+#include <fulltransobject.hpp>
+
+using namespace Raytracing;
+
+std::shared_ptr<Object> CsgOptimizer::optimize(const std::shared_ptr<Object>& top)
+{
+    nodesBefore = countNodes(top);
+    heightBefore = height(top);
+    findInstanced(top);
+    auto res = visit(top);
+    // Nothing can be seen at all, but the scene still needs a tree
+    if (!res) res = top;
+    nodesAfter = countNodes(res);
+    heightAfter = height(res);
+    return res;
+}
+
+unsigned CsgOptimizer::countNodes(const std::shared_ptr<Object>& top)
+{
+    std::set<const Object*> seen;
+    countNodes(top, seen);
+    return static_cast<unsigned>(seen.size());
+}
+
+unsigned CsgOptimizer::height(const std::shared_ptr<Object>& top)
+{
+    std::map<const Object*, unsigned> heights;
+    return height(top, heights);
+}
+
+void CsgOptimizer::findInstanced(const std::shared_ptr<Object>& obj)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        if (fto->obj->type() == ObjectType::Complex && !instanced.insert(fto->obj.get()).second) return;
+        findInstanced(fto->obj);
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        findInstanced(std::dynamic_pointer_cast<ComplexObject>(obj)->left);
+        findInstanced(std::dynamic_pointer_cast<ComplexObject>(obj)->right);
+    }
+}
+
+std::shared_ptr<Object> CsgOptimizer::visit(const std::shared_ptr<Object>& obj)
+{
+    auto it = done.find(obj.get());
+    if (it != done.end()) return it->second;
+
+    std::shared_ptr<Object> res = obj;
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        // Instances are kept, only the subtree below them is optimized
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        auto inner = visit(fto->obj);
+        if (inner) fto->obj = inner;
+        else res = nullptr;
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+        std::vector<std::shared_ptr<Object>> operands;
+        switch (cmp->operation)
+        {
+        case ComplexOps::Union:
+        {
+            collect(obj, ComplexOps::Union, operands, true);
+            // Empty operands don't add anything
+            std::vector<std::shared_ptr<Object>> kept;
+            for (auto& o : operands)
+                if (auto v = visit(o)) kept.push_back(v);
+            res = kept.empty() ? nullptr : balance(kept, 0, kept.size(), ComplexOps::Union);
+            break;
+        }
+        case ComplexOps::Intersection:
+        {
+            collect(obj, ComplexOps::Intersection, operands, true);
+            std::vector<std::shared_ptr<Object>> kept;
+            // Region all bounded operands have in common
+            AABB common;
+            bool bounded = false, empty = false;
+            for (auto& o : operands)
+            {
+                auto v = visit(o);
+                if (!v)
+                {
+                    empty = true;
+                    break;
+                }
+                kept.push_back(v);
+                const Bounds b = getBounds(v);
+                if (b.unbounded) continue;
+                common = bounded ? common.overlap(b.box) : b.box;
+                bounded = true;
+                if (common.empty())
+                {
+                    empty = true;
+                    break;
+                }
+            }
+            if (empty)
+            {
+                pruned++;
+                res = nullptr;
+            }
+            else res = balance(kept, 0, kept.size(), ComplexOps::Intersection);
+            break;
+        }
+        case ComplexOps::Subtraction:
+        {
+            // ((a - b) - c) - d is the same as a - (b | c | d)
+            auto base = cmp;
+            std::vector<std::shared_ptr<Object>> subtracted;
+            while (true)
+            {
+                subtracted.push_back(base->right);
+                if (base->left->type() != ObjectType::Complex || instanced.count(base->left.get())) break;
+                auto left = std::dynamic_pointer_cast<ComplexObject>(base->left);
+                if (left->operation != ComplexOps::Subtraction) break;
+                base = left;
+            }
+            auto from = visit(base->left);
+            if (!from)
+            {
+                res = nullptr;
+                break;
+            }
+            std::vector<std::shared_ptr<Object>> kept;
+            for (auto it = subtracted.rbegin(); it != subtracted.rend(); ++it)
+            {
+                auto v = visit(*it);
+                if (!v) continue;
+                // Operands that can't overlap with what they are subtracted from don't remove anything
+                if (!overlaps(from, v))
+                {
+                    pruned++;
+                    continue;
+                }
+                for (auto& o : collected(v, ComplexOps::Union)) kept.push_back(o);
+            }
+            if (kept.empty()) res = from;
+            else
+            {
+                auto right = balance(kept, 0, kept.size(), ComplexOps::Union);
+                res = std::make_shared<ComplexObject>(ComplexOps::Subtraction, from, right);
+            }
+            break;
+        }
+        }
+    }
+    done[obj.get()] = res;
+    return res;
+}
+
+void CsgOptimizer::collect(const std::shared_ptr<Object>& obj, ComplexOps op, std::vector<std::shared_ptr<Object>>& operands, bool root)
+{
+    // Subtrees with instances are kept as one operand, so they stay shared
+    if (obj->type() == ObjectType::Complex && (root || !instanced.count(obj.get())))
+    {
+        auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+        if (cmp->operation == op)
+        {
+            collect(cmp->left, op, operands, false);
+            collect(cmp->right, op, operands, false);
+            return;
+        }
+    }
+    operands.push_back(obj);
+}
+
+std::vector<std::shared_ptr<Object>> CsgOptimizer::collected(const std::shared_ptr<Object>& obj, ComplexOps op)
+{
+    std::vector<std::shared_ptr<Object>> operands;
+    collect(obj, op, operands, true);
+    return operands;
+}
+
+std::shared_ptr<Object> CsgOptimizer::balance(const std::vector<std::shared_ptr<Object>>& operands, size_t first, size_t count, ComplexOps op)
+{
+    if (count == 1) return operands[first];
+    auto left = balance(operands, first, count / 2, op);
+    auto right = balance(operands, first + count / 2, count - count / 2, op);
+    return std::make_shared<ComplexObject>(op, left, right);
+}
+
+CsgOptimizer::Bounds CsgOptimizer::getBounds(const std::shared_ptr<Object>& obj)
+{
+    auto it = bounds.find(obj.get());
+    if (it != bounds.end()) return it->second;
+
+    Bounds res { AABB(), false };
+    if (obj->type() == ObjectType::Base)
+    {
+        auto base = std::dynamic_pointer_cast<BaseObject>(obj);
+        if (base->bt == BaseTypes::Sphere)
+        {
+            const double r = std::abs(base->rd);
+            res.box = AABB(base->pos - Utility::Vec3(r, r, r), base->pos + Utility::Vec3(r, r, r));
+        }
+        else res.unbounded = true;
+    }
+    else if (obj->type() == ObjectType::Fulltransform)
+    {
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        res = getBounds(fto->obj);
+        if (!res.unbounded) res.box = res.box.transformed(fto->matrix);
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+        const Bounds l = getBounds(cmp->left);
+        const Bounds r = getBounds(cmp->right);
+        switch (cmp->operation)
+        {
+        case ComplexOps::Union:
+            res.unbounded = l.unbounded || r.unbounded;
+            res.box = l.box;
+            res.box.grow(r.box);
+            break;
+        case ComplexOps::Intersection:
+            res.unbounded = l.unbounded && r.unbounded;
+            if (l.unbounded) res.box = r.box;
+            else if (r.unbounded) res.box = l.box;
+            else res.box = l.box.overlap(r.box);
+            break;
+        case ComplexOps::Subtraction:
+            res = l;
+            break;
+        }
+    }
+    bounds[obj.get()] = res;
+    return res;
+}
+
+bool CsgOptimizer::overlaps(const std::shared_ptr<Object>& a, const std::shared_ptr<Object>& b)
+{
+    const Bounds ba = getBounds(a);
+    const Bounds bb = getBounds(b);
+    if (ba.unbounded || bb.unbounded) return true;
+    return !ba.box.overlap(bb.box).empty();
+}
+
+void CsgOptimizer::countNodes(const std::shared_ptr<Object>& obj, std::set<const Object*>& seen)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+        countNodes(std::dynamic_pointer_cast<Fulltransform>(obj)->obj, seen);
+    else if (obj->type() == ObjectType::Complex && seen.insert(obj.get()).second)
+    {
+        countNodes(std::dynamic_pointer_cast<ComplexObject>(obj)->left, seen);
+        countNodes(std::dynamic_pointer_cast<ComplexObject>(obj)->right, seen);
+    }
+}
+
+unsigned CsgOptimizer::height(const std::shared_ptr<Object>& obj, std::map<const Object*, unsigned>& heights)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+        return height(std::dynamic_pointer_cast<Fulltransform>(obj)->obj, heights);
+    if (obj->type() != ObjectType::Complex) return 0;
+    auto it = heights.find(obj.get());
+    if (it != heights.end()) return it->second;
+    auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+    const unsigned h = 1 + std::max(height(cmp->left, heights), height(cmp->right, heights));
+    heights[obj.get()] = h;
+    return h;
+}
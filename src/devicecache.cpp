@@ -0,0 +1,46 @@
+#include <fstream>
+#include <vector>
+
+#include <devicecache.hpp>
+
+using namespace Raytracing;
+
+bool DeviceCache::get(const Device_Info& info, std::string& values) const
+{
+    const std::string k = key(info);
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos || line.substr(0, tab) != k) continue;
+        values = line.substr(tab + 1);
+        return true;
+    }
+    return false;
+}
+
+void DeviceCache::set(const Device_Info& info, const std::string& values) const
+{
+    const std::string k = key(info);
+    std::vector<std::string> lines;
+    {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+            if (line.substr(0, line.find('\t')) != k) lines.push_back(line);
+    }
+    lines.push_back(k + "\t" + values);
+    std::ofstream out(path);
+    if (!out.is_open())
+    {
+        print_warning("Can't write " + path + ", the values will be measured again next time.");
+        return;
+    }
+    for (const std::string& line : lines) out << line << std::endl;
+}
+
+std::string DeviceCache::key(const Device_Info& info)
+{
+    return info.vendor + " / " + info.name + " / " + info.driver_version;
+}
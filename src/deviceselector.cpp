@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+
+#include <deviceselector.hpp>
+#include <devicecache.hpp>
+#include <calibration.hpp>
+#include <renderer.hpp>
+
+using namespace Raytracing;
+
+namespace {
+
+    // Renders that are timed per device after a first one to warm up
+    const unsigned RUNS = 3;
+
+    std::string lower(std::string s)
+    {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return s;
+    }
+
+}
+
+Device_Info DeviceSelector::select(const std::string& device, const std::string& mode, bool remeasure)
+{
+    const std::vector<Device_Info> devices = get_devices();
+    if (!device.empty())
+    {
+        const unsigned i = find(devices, device);
+        print_device_info(devices[i], i);
+        return devices[i];
+    }
+    if (mode == "flops" || devices.size() == 1) return select_device_with_most_flops(devices);
+
+    const DeviceCache cache(CACHE_FILE);
+    double best = -1.;
+    unsigned bestI = 0;
+    for (unsigned i = 0; i < devices.size(); i++)
+    {
+        double speed = 0.;
+        std::string values;
+        if (remeasure || !cache.get(devices[i], values) || !(std::istringstream(values) >> speed))
+        {
+            print_info("Measuring device " + std::to_string(i) + " (" + devices[i].name + "), this is only done once...");
+            speed = benchmark(devices[i]);
+            cache.set(devices[i], std::to_string(speed));
+        }
+        print_info("Device " + std::to_string(i) + " (" + devices[i].name + "): " + std::to_string(speed) + " Mrays/s");
+        if (speed > best)
+        {
+            best = speed;
+            bestI = i;
+        }
+    }
+    print_device_info(devices[bestI], bestI);
+    return devices[bestI];
+}
+
+std::vector<Device_Info> DeviceSelector::selectAll(const std::string& devices)
+{
+    const std::vector<Device_Info> all = get_devices();
+    if (devices.empty()) return all;
+    std::vector<Device_Info> res;
+    std::istringstream in(devices);
+    std::string device;
+    while (std::getline(in, device, ','))
+        if (!device.empty()) res.push_back(all[find(all, device)]);
+    return res;
+}
+
+unsigned DeviceSelector::find(const std::vector<Device_Info>& devices, const std::string& device)
+{
+    if (std::all_of(device.begin(), device.end(), [](unsigned char c) { return std::isdigit(c); }))
+    {
+        const unsigned long id = std::stoul(device);
+        if (id < devices.size()) return static_cast<unsigned>(id);
+    }
+    for (unsigned i = 0; i < devices.size(); i++)
+        if (lower(devices[i].name).find(lower(device)) != std::string::npos) return i;
+    print_error("There is no device with the id or name \"" + device + "\".");
+    return 0; // is never executed, print_error exits
+}
+
+double DeviceSelector::benchmark(const Device_Info& info)
+{
+    const CalibrationScene calibration;
+    Device device(info, Renderer::defines(calibration.inp, calibration.shading, info) + get_opencl_c_code());
+    Renderer renderer(device, calibration.scene, calibration.shading, calibration.rayStarts.size(), calibration.depth, false, false);
+    renderer.setRays(calibration.rayStarts, calibration.rayDirs);
+    renderer.render();
+
+    Clock clock;
+    clock.start();
+    for (unsigned r = 0; r < RUNS; r++) renderer.render();
+    const double seconds = clock.stop() / RUNS;
+    // Primary rays with all of their bounces and shadow rays
+    return seconds > 0. ? calibration.rayStarts.size() / seconds / 1e6 : 0.;
+}
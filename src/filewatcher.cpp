@@ -0,0 +1,30 @@
+#include <filewatcher.hpp>
+
+using namespace Raytracing;
+
+FileWatcher::FileWatcher(const std::string& path) : path(path), size(0), lastPoll(std::chrono::steady_clock::now())
+{
+    stat(time, size);
+}
+
+bool FileWatcher::changed()
+{
+    const auto now = std::chrono::steady_clock::now();
+    if (now - lastPoll < POLL_INTERVAL) return false;
+    lastPoll = now;
+    std::filesystem::file_time_type t;
+    std::uintmax_t s;
+    if (!stat(t, s) || (t == time && s == size)) return false;
+    time = t;
+    size = s;
+    return true;
+}
+
+bool FileWatcher::stat(std::filesystem::file_time_type& time, std::uintmax_t& size) const
+{
+    std::error_code error;
+    time = std::filesystem::last_write_time(path, error);
+    if (error) return false;
+    size = std::filesystem::file_size(path, error);
+    return !error;
+}
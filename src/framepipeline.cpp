@@ -0,0 +1,40 @@
+#include <framepipeline.hpp>
+
+using namespace Raytracing;
+
+FramePipeline::FramePipeline(Renderer& renderer, FrameWriter& writer)
+    : renderer(renderer), writer(writer), slots(SLOTS), next(0), waitTime(0.)
+{
+    for (Slot& slot : slots) slot.busy = false;
+}
+
+void FramePipeline::render(unsigned frame)
+{
+    Slot& slot = slots[next];
+    if (slot.busy) retire(slot);
+    renderer.enqueueRender();
+    renderer.readColors(slot.raw, slot.done);
+    slot.frame = frame;
+    slot.busy = true;
+    next = (next + 1) % SLOTS;
+}
+
+void FramePipeline::flush()
+{
+    // Slots are retired oldest first, so the writer gets the frames in order
+    for (unsigned i = 0; i < SLOTS; i++)
+    {
+        Slot& slot = slots[(next + i) % SLOTS];
+        if (slot.busy) retire(slot);
+    }
+}
+
+void FramePipeline::retire(Slot& slot)
+{
+    Clock clock;
+    slot.done.wait();
+    waitTime += clock.stop();
+    // The colors are converted by the writer, the slot gets a new buffer with the next frame
+    writer.push(slot.frame, std::move(slot.raw));
+    slot.busy = false;
+}
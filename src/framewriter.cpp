@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include <framewriter.hpp>
+#include <utility.hpp>
+
+using namespace Raytracing;
+
+namespace {
+
+    bool endsWith(const std::string& s, const std::string& end)
+    {
+        return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+    }
+
+    // Prefix of outputs that are Unix domain sockets
+    const std::string SOCKET_PREFIX = "unix:";
+    // Starts every frame of a Y4M stream
+    const std::string Y4M_FRAME = "FRAME\n";
+
+}
+
+FrameWriter::FrameWriter(const std::string& output, const std::string& format, uint width, uint height, uint fps, bool half)
+    : output(output), width(width), height(height), fps(fps), half(half), format(Format::Image), toStdout(output == "-"),
+    socket(-1), writing(0), stopping(false), broken(false)
+{
+    const bool toSocket = output.rfind(SOCKET_PREFIX, 0) == 0;
+    const std::string kind = !format.empty() ? format : endsWith(output, ".rgb") ? "rgb" : endsWith(output, ".rgba") ? "rgba"
+        : endsWith(output, ".y4m") ? "y4m" : toStdout || toSocket ? "rgb" : "";
+    if (kind == "rgb") this->format = Format::RGB;
+    else if (kind == "rgba") this->format = Format::RGBA;
+    else if (kind == "y4m") this->format = Format::Y4M;
+
+    if (this->format != Format::Image)
+    {
+#ifndef _WIN32
+        // A consumer going away must not end the program, writing to it fails instead
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+        if (toStdout)
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        }
+        else if (toSocket)
+        {
+#ifdef _WIN32
+            print_warning("Streaming to a Unix domain socket isn't supported by this build.");
+            throw Utility::WRITE_FILE_EXCEPTION;
+#else
+            const std::string path = output.substr(SOCKET_PREFIX.size());
+            sockaddr_un address;
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path)) throw Utility::WRITE_FILE_EXCEPTION;
+            std::strcpy(address.sun_path, path.c_str());
+            socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (socket < 0 || connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+            {
+                if (socket >= 0) close(socket);
+                socket = -1;
+                print_warning("Can't connect to " + path + ", the consumer has to listen on it before rendering starts.");
+                throw Utility::WRITE_FILE_EXCEPTION;
+            }
+#endif
+        }
+        else
+        {
+            file.open(output, std::ios::binary);
+            if (!file.is_open()) throw Utility::WRITE_FILE_EXCEPTION;
+        }
+        if (this->format == Format::Y4M)
+        {
+            // Full resolution chroma, so no colors bleed into their neighbours
+            const std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" + std::to_string(fps)
+                + ":1 Ip A1:1 C444\n";
+            if (!send(reinterpret_cast<const uint8_t*>(header.data()), header.size())) throw Utility::WRITE_FILE_EXCEPTION;
+        }
+    }
+    // Image files are independent of each other, a stream has to get its frames in order
+    const unsigned threads = this->format != Format::Image ? 1u : std::max(1u, std::min(MAX_THREADS, std::thread::hardware_concurrency() / 2));
+    for (unsigned i = 0; i < threads; i++) workers.emplace_back(&FrameWriter::work, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread& worker : workers) worker.join();
+    if (toStdout) std::fflush(stdout);
+    else if (file.is_open()) file.flush();
+#ifndef _WIN32
+    if (socket >= 0) close(socket);
+#endif
+}
+
+void FrameWriter::push(unsigned frame, std::vector<float>&& raw)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return pending.size() < MAX_PENDING * workers.size(); });
+    pending.emplace_back(frame, std::move(raw));
+    changed.notify_all();
+}
+
+void FrameWriter::finish()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return pending.empty() && writing == 0; });
+    if (toStdout) std::fflush(stdout);
+    else if (file.is_open()) file.flush();
+}
+
+bool FrameWriter::failed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return broken;
+}
+
+std::string FrameWriter::framePath(const std::string& output, unsigned frame)
+{
+    std::string path = output;
+    size_t first = path.find('#');
+    if (first == std::string::npos)
+    {
+        const size_t dot = path.find_last_of('.');
+        const size_t slash = path.find_last_of("/\\");
+        first = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? dot : path.size();
+        path.insert(first, "_####");
+        first++;
+    }
+    size_t last = first;
+    while (last < path.size() && path[last] == '#') last++;
+    std::string number = std::to_string(frame);
+    if (number.size() < last - first) number.insert(0, last - first - number.size(), '0');
+    return path.replace(first, last - first, number);
+}
+
+void FrameWriter::work()
+{
+    while (true)
+    {
+        std::pair<unsigned, std::vector<float>> frame;
+        bool skip;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            frame = std::move(pending.front());
+            pending.pop_front();
+            writing++;
+            skip = broken;
+        }
+        // The frame can be converted and encoded while the next ones are traced and encoded
+        changed.notify_all();
+        const bool written = skip || write(frame.first, frame.second);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            writing--;
+            if (!written) broken = true;
+        }
+        changed.notify_all();
+    }
+}
+
+bool FrameWriter::write(unsigned frame, const std::vector<float>& raw)
+{
+    if (format == Format::Image)
+    {
+        std::vector<uint8_t> bgr;
+        toBytes(raw, { 2, 1, 0 }, bgr);
+        const cv::Mat matrix((int)height, (int)width, CV_8UC3, bgr.data());
+        const std::string path = framePath(output, frame);
+        // A single image that can't be written doesn't stop the others
+        if (!cv::imwrite(path, matrix)) print_warning("Can't write frame " + std::to_string(frame) + " to " + path + ".");
+        return true;
+    }
+    if (format == Format::Y4M) toPlanes(raw, bytes);
+    else if (format == Format::RGBA) toBytes(raw, { 0, 1, 2, 3 }, bytes);
+    else toBytes(raw, { 0, 1, 2 }, bytes);
+    if (send(bytes.data(), bytes.size())) return true;
+    print_warning("Can't write frame " + std::to_string(frame) + " to " + output + ", the remaining frames are dropped.");
+    return false;
+}
+
+void FrameWriter::toBytes(const std::vector<float>& raw, const std::vector<unsigned>& channels, std::vector<uint8_t>& res) const
+{
+    const size_t count = static_cast<size_t>(width) * height;
+    const size_t n = channels.size();
+    const ushort* h = reinterpret_cast<const ushort*>(raw.data());
+    res.resize(n * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t c = 0; c < n; c++)
+        {
+            if (channels[c] == 3)
+            {
+                res[n * i + c] = 255;
+                continue;
+            }
+            const float v = half ? half_to_float(h[4 * i + channels[c]]) : raw[4 * i + channels[c]];
+            res[n * i + c] = static_cast<uint8_t>(std::min(1.f, std::max(0.f, v)) * 255.f);
+        }
+    }
+}
+
+void FrameWriter::toPlanes(const std::vector<float>& raw, std::vector<uint8_t>& res) const
+{
+    const size_t count = static_cast<size_t>(width) * height;
+    const size_t head = Y4M_FRAME.size();
+    const ushort* h = reinterpret_cast<const ushort*>(raw.data());
+    res.resize(head + 3 * count);
+    std::copy(Y4M_FRAME.begin(), Y4M_FRAME.end(), res.begin());
+    uint8_t* y = res.data() + head;
+    uint8_t* cb = y + count;
+    uint8_t* cr = cb + count;
+    for (size_t i = 0; i < count; i++)
+    {
+        float rgb[3];
+        for (unsigned c = 0; c < 3; c++) rgb[c] = std::min(1.f, std::max(0.f, half ? half_to_float(h[4 * i + c]) : raw[4 * i + c]));
+        // BT.601 in the limited range encoders expect
+        y[i] = static_cast<uint8_t>(16.f + 65.481f * rgb[0] + 128.553f * rgb[1] + 24.966f * rgb[2] + .5f);
+        cb[i] = static_cast<uint8_t>(128.f - 37.797f * rgb[0] - 74.203f * rgb[1] + 112.f * rgb[2] + .5f);
+        cr[i] = static_cast<uint8_t>(128.f + 112.f * rgb[0] - 93.786f * rgb[1] - 18.214f * rgb[2] + .5f);
+    }
+}
+
+bool FrameWriter::send(const uint8_t* data, size_t size)
+{
+#ifndef _WIN32
+    if (socket >= 0)
+    {
+        // Blocks while the consumer is behind, which holds up the render loop
+        while (size > 0)
+        {
+            const ssize_t n = ::send(socket, data, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+#endif
+    if (toStdout) return std::fwrite(data, 1, size, stdout) == size;
+    file.write(reinterpret_cast<const char*>(data), size);
+    return static_cast<bool>(file);
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <stdexcept>
 #include <cmath>
 
@@ -6,6 +7,8 @@
 #include <transformedobject.hpp>
 #include <fulltransobject.hpp>
 #include <complexobject.hpp>
+#include <csgoptimizer.hpp>
+#include <utilities.hpp>
 
 using namespace Raytracing;
 using Utility::to_underlying;
@@ -18,7 +21,7 @@ Interpreter::Interpreter()
         this->variables[i] = 0.0;
 }
 
-void Interpreter::interpret(std::ifstream& f)
+void Interpreter::interpret(std::istream& f)
 {
     bool object_tree_locked = false;
     std::map<std::string, double> stack; // Even though it behaves more like a heap
@@ -57,12 +60,27 @@ void Interpreter::interpret(std::ifstream& f)
                 if (tokens.size() == 3) // Object creation
                 {
                     if (tokens[2] == BasetypeStrings[to_underlying(BaseTypes::Sphere)])
+                    {
                         object_stack[lvalue] = std::make_shared<Raytracing::BaseObject>(Raytracing::BaseObject(Raytracing::BaseTypes::Sphere, Utility::Vec3(), 1., Raytracing::BASE_MATERIAL));
+                        this->base_objs++;
+                    }
                     else if (tokens[2] == BasetypeStrings[to_underlying(BaseTypes::HalfPlane)])
+                    {
                         object_stack[lvalue] = std::make_shared<Raytracing::BaseObject>(Raytracing::BaseObject(Raytracing::BaseTypes::HalfPlane, Utility::Vec3(), 1., Raytracing::BASE_MATERIAL));
+                        this->base_objs++;
+                    }
+                    else if (object_stack.count(tokens[2]))
+                    {
+                        // Another name for an existing object, transforming it later creates an instance.
+                        // Base objects are copied, so a material set on one name doesn't change the other. Identical base objects
+                        // are shared by the scene anyway, so the copy isn't counted as another one.
+                        const auto& other = object_stack[tokens[2]];
+                        if (other->type() == ObjectType::Base)
+                            object_stack[lvalue] = std::make_shared<Raytracing::BaseObject>(*std::dynamic_pointer_cast<Raytracing::BaseObject>(other));
+                        else object_stack[lvalue] = other;
+                    }
                     else
                         throw Utility::WRONG_FORMAT_EXCEPTION;
-                    this->base_objs++;
                 }
                 else if (tokens.size() == 5) // Union, Intersection, Exclusion
                 {
@@ -87,47 +105,27 @@ void Interpreter::interpret(std::ifstream& f)
             else if (com == OperatorStrings[to_underlying(Operators::Scale)])
             {
                 if (tokens.size() < 5) throw Utility::WRONG_FORMAT_EXCEPTION;
-                object_stack[lvalue] = std::shared_ptr<Object>(new TransformedObject(
-                    TransformOps::Scale,
-                    get(tokens[2]), get(tokens[3]), get(tokens[4]),
-                    object_stack[lvalue]
-                ));
+                transform(object_stack[lvalue], TransformOps::Scale, get(tokens[2]), get(tokens[3]), get(tokens[4]));
             }
             else if (com == OperatorStrings[to_underlying(Operators::RotateX)])
             {
                 if (tokens.size() < 3) throw Utility::WRONG_FORMAT_EXCEPTION;
-                object_stack[lvalue] = std::shared_ptr<Object>(new TransformedObject(
-                    TransformOps::Rotatex,
-                    get(tokens[2]), 0., 0.,
-                    object_stack[lvalue]
-                ));
+                transform(object_stack[lvalue], TransformOps::Rotatex, get(tokens[2]), 0., 0.);
             }
             else if (com == OperatorStrings[to_underlying(Operators::RotateY)])
             {
                 if (tokens.size() < 3) throw Utility::WRONG_FORMAT_EXCEPTION;
-                object_stack[lvalue] = std::shared_ptr<Object>(new TransformedObject(
-                    TransformOps::Rotatey,
-                    get(tokens[2]), 0., 0.,
-                    object_stack[lvalue]
-                ));
+                transform(object_stack[lvalue], TransformOps::Rotatey, get(tokens[2]), 0., 0.);
             }
             else if (com == OperatorStrings[to_underlying(Operators::RotateZ)])
             {
                 if (tokens.size() < 3) throw Utility::WRONG_FORMAT_EXCEPTION;
-                object_stack[lvalue] = std::shared_ptr<Object>(new TransformedObject(
-                    TransformOps::Rotatez,
-                    get(tokens[2]), 0., 0.,
-                    object_stack[lvalue]
-                ));
+                transform(object_stack[lvalue], TransformOps::Rotatez, get(tokens[2]), 0., 0.);
             }
             else if (com == OperatorStrings[to_underlying(Operators::Transform)])
             {
                 if (tokens.size() < 5) throw Utility::WRONG_FORMAT_EXCEPTION;
-                object_stack[lvalue] = std::shared_ptr<Object>(new TransformedObject(
-                    TransformOps::Transform,
-                    get(tokens[2]), get(tokens[3]), get(tokens[4]),
-                    object_stack[lvalue]
-                ));
+                transform(object_stack[lvalue], TransformOps::Transform, get(tokens[2]), get(tokens[3]), get(tokens[4]));
             }
             else if (com == OperatorStrings[to_underlying(Operators::Submit)])
             {
@@ -145,7 +143,9 @@ void Interpreter::interpret(std::ifstream& f)
                     get(tokens[4]),
                     get(tokens[5]),
                     get(tokens[6]),
-                    get(tokens[7])
+                    get(tokens[7]),
+                    // The falloff radius is optional, lights without one reach the whole scene
+                    tokens.size() > 8 ? std::max(0., get(tokens[8])) : 0.
                 ));
             } catch (std::logic_error e) {
                 std::cout << "Invalid light creation at " << line << std::endl;
@@ -188,7 +188,6 @@ void Interpreter::interpret(std::ifstream& f)
     } catch (std::out_of_range) {
         throw Utility::MISSING_VARIABLE_EXCEPTION;
     }
-    f.close();
     
     this->EyePos.vals[0] = variables["eyepos_x"];
     this->EyePos.vals[1] = variables["eyepos_y"];
@@ -198,26 +197,82 @@ void Interpreter::interpret(std::ifstream& f)
     this->Lookat.vals[2] = variables["lookat_z"];
 
     this->topObject = shorten(this->topObject, 0);
+    for (auto& i : object_stack)
+    {
+        auto r = this->replaced.find(i.second.get());
+        if (r != this->replaced.end()) i.second = r->second;
+    }
+    this->objects = object_stack;
+
+    CsgOptimizer optimizer;
+    this->topObject = optimizer.optimize(this->topObject);
+    this->tree_height = optimizer.heightAfter;
+    this->cmpOps = optimizer.nodesAfter;
+    print_info("Optimized the csg tree from " + std::to_string(optimizer.nodesBefore) + " complex objects (height " + std::to_string(optimizer.heightBefore)
+        + ") to " + std::to_string(optimizer.nodesAfter) + " (height " + std::to_string(optimizer.heightAfter) + "), " + std::to_string(optimizer.pruned)
+        + " intersections and subtractions couldn't overlap.");
 
     return;
 }
 
-void Interpreter::createRays()
+void Interpreter::transform(std::shared_ptr<Raytracing::Object>& obj, TransformOps op, double x, double y, double z)
 {
-    double m = variables["height"];
-    double k = variables["width"];
+    if (obj->type() == ObjectType::Base || obj->type() == ObjectType::Transformed)
+    {
+        obj = std::shared_ptr<Object>(new TransformedObject(op, x, y, z, obj));
+        return;
+    }
+    // Complex objects and their instances can't be part of a transformation chain,
+    // so the transformation is composed directly into an instance of the subtree.
+    const Utility::Vec3 scale(x, y, z);
+    std::shared_ptr<Raytracing::Fulltransform> inst;
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        auto old = std::dynamic_pointer_cast<Raytracing::Fulltransform>(obj);
+        // Never modify the old instance, other names might still refer to it
+        inst = std::make_shared<Raytracing::Fulltransform>(Raytracing::Fulltransform(
+            old->matrix * TransformedObject::opMatrix(op, scale),
+            TransformedObject::opInverseMatrix(op, scale) * old->invmatrix
+        ));
+        inst->obj = old->obj;
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        inst = std::make_shared<Raytracing::Fulltransform>(Raytracing::Fulltransform(
+            TransformedObject::opMatrix(op, scale),
+            TransformedObject::opInverseMatrix(op, scale)
+        ));
+        inst->obj = obj;
+    }
+    else throw Utility::WRONG_OBJECT_HIERARCHY_EXCEPTION;
+    inst->mat_id = obj->mat_id;
+    obj = inst;
+}
+
+void Interpreter::camera(const Utility::Vec3& eye, const Utility::Vec3& lookat, Utility::Vec3& corner, Utility::Vec3& stepX, Utility::Vec3& stepY) const
+{
+    double m = variables.at("height");
+    double k = variables.at("width");
     // Inverse Aspect ratio
     double iar = m / k;
-    auto t = Lookat - EyePos;
+    auto t = lookat - eye;
     auto b = Utility::Vec3(0, -1, 0) % t;
     auto tn = t.normalise();
     auto bn = b.normalise();
     auto vn = tn % bn;
     auto gx = std::tan(fov / 2.);
     auto gy = gx * iar;
-    auto qx = bn * ((2. * gx) / (k - 1.));
-    auto qy = vn * ((2. * gy) / (m - 1.));
-    auto p1m = tn - bn * gx - vn * gy;
+    stepX = bn * ((2. * gx) / (k - 1.));
+    stepY = vn * ((2. * gy) / (m - 1.));
+    corner = tn - bn * gx - vn * gy;
+}
+
+void Interpreter::createRays()
+{
+    double m = variables["height"];
+    double k = variables["width"];
+    Utility::Vec3 p1m, qx, qy;
+    camera(EyePos, Lookat, p1m, qx, qy);
     this->rays.resize(static_cast<size_t>(k) * static_cast<size_t>(m));
     for (unsigned i = 1; i <= static_cast<unsigned>(k); i++)
     {
@@ -233,10 +288,20 @@ void Interpreter::createRays()
 
 std::shared_ptr<Raytracing::Object> Interpreter::shorten(std::shared_ptr<Raytracing::Object>& obj, unsigned depth)
 {
-    if (depth > this->tree_height) tree_height = depth;
-    if (obj->type() == ObjectType::Complex)
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        // An instance of a subtree, it doesn't add a level to the csg tree
+        auto inst = std::dynamic_pointer_cast<Raytracing::Fulltransform>(obj);
+        inst->obj = shorten(inst->obj, depth);
+        return obj;
+    }
+    else if (obj->type() == ObjectType::Complex)
     {
+        // Subtrees can be shared by instances and only need to be shortened once
+        if (!this->shortened.insert(obj.get()).second) return obj;
         this->cmpOps++;
+        // Only complex objects are levels of the csg tree
+        if (depth + 1 > this->tree_height) this->tree_height = depth + 1;
         std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->left =
             shorten(std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->left, depth + 1);
         std::dynamic_pointer_cast<Raytracing::ComplexObject>(obj)->right =
@@ -253,8 +318,7 @@ std::shared_ptr<Raytracing::Object> Interpreter::shorten(std::shared_ptr<Raytrac
         while (tmp->type() == ObjectType::Transformed)
             tmp = std::dynamic_pointer_cast<Raytracing::TransformedObject>(tmp)->obj;
         t->obj = tmp;
-        // Base object 
-        this->tree_height++;
+        this->replaced[obj.get()] = t;
         return t;
     }
     else return obj;
@@ -270,6 +334,27 @@ void Interpreter::interpretFile(const std::string& path)
         return;
     }
     interpret(inFile);
+    inFile.close();
     createRays();
     return;
 }
+
+void Interpreter::interpretString(const std::string& content)
+{
+    std::istringstream in(content);
+    interpret(in);
+    createRays();
+}
+
+void Interpreter::setVariables(const std::map<std::string, double>& values)
+{
+    for (auto& i : values)
+    {
+        auto var = this->variables.find(i.first);
+        if (var == this->variables.end()) throw Utility::MISSING_VARIABLE_EXCEPTION;
+        var->second = i.second;
+    }
+    this->EyePos = Utility::Vec3(variables["eyepos_x"], variables["eyepos_y"], variables["eyepos_z"]);
+    this->Lookat = Utility::Vec3(variables["lookat_x"], variables["lookat_y"], variables["lookat_z"]);
+    createRays();
+}
@@ -6,6 +6,29 @@
  */
 string opencl_c_container() { return R( // ########################## begin of OpenCL C code ####################################################################
 
+// Material as written by the host, see MaterialRecord
+typedef struct {
+	float ambient, diffuse, specular;
+	float reflection, refraction, refraction_index;
+	float shininess;
+	float r, g, b;
+} Material;
+
+// Light source as written by the host, see LightRecord
+typedef struct {
+	float x, y, z;
+	float r, g, b;
+	float radius;
+} Light;
+
+// Settings of the whole scene, see SceneHeader
+typedef struct {
+	float ambient[3];
+	float ambient_intensity[3];
+	uint instances, lights, unbounded, nodes;
+	uint unbounded_lights, light_nodes, light_tree;
+} SceneHeader;
+
 // Return wether x is in [y - range, y + range]
 bool inrange(float x, float y, float range)
 {
@@ -82,12 +105,12 @@ float rlengthHC(const float4 vec)
 }
 
 // Scales color based on y value of raydirection (y).
-float3 color(const float3 dir, global float* amb_col)
+float3 color(const float3 dir, constant SceneHeader* header)
 {
 	float3 unit_dir = normalize(dir);
 	// Standard larp
 	float t = 0.5 * (unit_dir.y + 1.0);
-	return (1.0f - t) * (float3)(1.0, 1.0, 1.0) + t * (float3)(amb_col[0], amb_col[1], amb_col[2]);
+	return (1.0f - t) * (float3)(1.0, 1.0, 1.0) + t * (float3)(header->ambient[0], header->ambient[1], header->ambient[2]);
 }
 
 // Adds two intensities (e.g. color indices) logarithmically
@@ -113,21 +136,54 @@ float3 color_addition3(const float3 left, const float3 right)
 }
 
 )+R(
-// This function calculates the ray hit on an object and returns
-// the resulting start and dir vectors packed into a float8.
-float4 calc_rays(float3 start, float3 dir, float8 object, float16 mat, float16 invmat)
+// Layout of the primitive records, see Scene: the info holds flags and the material above them,
+// every record consists of the position and radius, the bounding sphere and the three rows of the inverse transformation.
+enum prim_layout { PRIM_HALF_PLANE = 1, PRIM_TRANSFORMED = 2, PRIM_MATERIAL_SHIFT = 2, PRIM_STRIDE = 5 };
+// Bit of the prototype of an instance set if the instance isn't transformed, too large for an enum
+constant uint INSTANCE_IDENTITY = 0x80000000u;
+
+// Transforms a point with a 3x4 affine matrix given by its rows
+float3 affine_point(const float3 p, const float4 r0, const float4 r1, const float4 r2)
+{
+	return (float3) (dot(r0.xyz, p) + r0.w, dot(r1.xyz, p) + r1.w, dot(r2.xyz, p) + r2.w);
+}
+
+// Transforms a direction with a 3x4 affine matrix given by its rows
+float3 affine_dir(const float3 d, const float4 r0, const float4 r1, const float4 r2)
+{
+	return (float3) (dot(r0.xyz, d), dot(r1.xyz, d), dot(r2.xyz, d));
+}
+
+// Transforms a normal with the transposed matrix, for a normal in object space this has to be the inverse matrix
+float3 affine_normal(const float3 n, const float4 r0, const float4 r1, const float4 r2)
+{
+	return r0.xyz * n.x + r1.xyz * n.y + r2.xyz * n.z;
+}
+
+// This function calculates the ray hit on a primitive and returns
+// the normal and the distance packed into a float4.
+float4 calc_rays(float3 start, float3 dir, const uint p, const uint info, global float4* primitives)
 {
-	float4 modStart = matmul34(start, 1.f, invmat);
-	float4 modDir = matmul34(dir, 0.f, invmat);
+	const float4 object = primitives[PRIM_STRIDE * p];
+	float4 r0, r1, r2;
+	// Primitives without own transformation skip the matrix multiplications
+	if (info & PRIM_TRANSFORMED)
+	{
+		r0 = primitives[PRIM_STRIDE * p + 2];
+		r1 = primitives[PRIM_STRIDE * p + 3];
+		r2 = primitives[PRIM_STRIDE * p + 4];
+		start = affine_point(start, r0, r1, r2);
+		dir = affine_dir(dir, r0, r1, r2);
+	}
 
 	float t;
-	float3 N;
+	float3 mN;
 
-	if (object.s5 == 0.f) {
-		float4 sc = dist(modStart, object);
-		float a = dot(modDir, modDir);
-		float half_b = dot(sc, modDir);
-		float c = dot(sc, sc) - object.s3 * object.s3;
+	if (!(info & PRIM_HALF_PLANE)) {
+		float3 sc = start - object.xyz;
+		float a = dot(dir, dir);
+		float half_b = dot(sc, dir);
+		float c = dot(sc, sc) - object.w * object.w;
 		float discr = half_b * half_b - a * c;
 		if (discr < 0.00001f) return (float4) (-1.0f, -1.0f, -1.0f, -1.0f);
 		
@@ -138,249 +194,257 @@ float4 calc_rays(float3 start, float3 dir, float8 object, float16 mat, float16 i
 			if (t < 0.00001f) return (float4) (-1.0f, -1.0f, -1.0f, -1.0f);
 		}
 		
-		float4 mP = modStart + t * modDir;
-		float4 mN = (float4) ((mP.x - object.x) / object.s3,
-			(mP.y - object.y) / object.s3,
-			(mP.z - object.z) / object.s3, 0.f);
-
-		N = matmul43T(mN, invmat);
+		mN = (start + t * dir - object.xyz) / object.w;
 
-	} else if (object.s5 == 1.f) {
+	} else {
 
-		float4 mN;
-		if (object.s3 == 1.f) mN = (float4) (0.f, 1.f, 0.f, 0.f);
-		else mN = (float4) (0.f, -1.f, 0.f, 0.f);
+		if (object.w == 1.f) mN = (float3) (0.f, 1.f, 0.f);
+		else mN = (float3) (0.f, -1.f, 0.f);
 
-		float nd = dot(mN, modDir);
+		float nd = dot(mN, dir);
 		if (nd < 0.00001f && nd > -0.00001f)
 			return (float4) (-1.0f, -1.0f, -1.0f, -1.0f);
 		
-		float nos = -rdotHC(mN, modStart);
-		t = -(nos / nd);
-		if (t > 0.f) return (float4) (-1.0f, -1.0f, -1.0f, -1.0f);
-
-		N = matmul43T(mN, invmat);
+		t = -dot(mN, start) / nd;
+		if (t < 0.00001f) return (float4) (-1.0f, -1.0f, -1.0f, -1.0f);
 	}
-	else return (float4) (-1.0f, -1.0f, -1.0f, -1.0f);
-	
-	return (float4) (N.xyz, t);
-}
-/*
-void pushElement(int item, global int* stack, int* index)
-{
-	stack[++(*index)] = item;
-}
-int popElement(global int* stack, int* index)
-{
-	return stack[*index--];
+
+	// Normals are transformed with the transposed inverse, the translation doesn't matter for them
+	if (info & PRIM_TRANSFORMED) mN = affine_normal(mN, r0, r1, r2);
+	return (float4) (mN, t);
 }
-void pushElementF(float item, global float* stack, int* index)
+
+// Checks if a ray hits a box before a given distance
+bool hit_box(const float3 start, const float3 inv_dir, const float4 lo, const float4 hi, const float t_max)
 {
-	stack[++(*index)] = item;
+	const float3 t0 = (lo.xyz - start) * inv_dir;
+	const float3 t1 = (hi.xyz - start) * inv_dir;
+	const float3 tn = fmin(t0, t1);
+	const float3 tf = fmax(t0, t1);
+	const float t_near = fmax(fmax(tn.x, tn.y), tn.z);
+	const float t_far = fmin(fmin(tf.x, tf.y), tf.z);
+	return t_near <= t_far && t_far >= 0.f && t_near < t_max;
 }
-float popElementF(global float* stack, int* index)
+
+// Checks if a ray can hit a bounding sphere between two distances, a negative radius means unbounded
+bool hit_bound(const float3 start, const float3 dir, const float4 bound, const float t_min, const float t_max)
 {
-	return stack[*index--];
+	if (bound.w < 0.f) return true;
+	const float3 oc = bound.xyz - start;
+	const float dd = dot(dir, dir);
+	const float tc = dot(oc, dir) / dd;
+	// Vector from the point of the ray closest to the center to the center
+	const float3 off = oc - tc * dir;
+	if (dot(off, off) > bound.w * bound.w) return false;
+	const float dt = bound.w * rsqrt(dd);
+	return tc + dt > t_min && tc - dt < t_max;
 }
-void pushElementF4(float4 item, global float4* stack, int* index)
+
+// Actions of the CSG traversal, several of them can be combined
+enum csg_action {
+	CSG_MISS = 1, CSG_RET_L = 2, CSG_RET_R = 4,
+	CSG_RET_L_IF_CLOSER = 8, CSG_RET_R_IF_CLOSER = 16,
+	CSG_LOOP_L = 32, CSG_LOOP_R = 64, CSG_LOOP_L_IF_CLOSER = 128, CSG_LOOP_R_IF_CLOSER = 256,
+	CSG_FLIP_R = 512
+};
+
+// Actions by operation (union, intersection, subtraction), state of the left and state of the right hit (enter, exit, miss).
+// Unlike the original table, a union that exits both children advances the closer one: it may be entered again before the other exit.
+constant int csg_table[27] = {
+	CSG_RET_L_IF_CLOSER | CSG_RET_R_IF_CLOSER, CSG_RET_R_IF_CLOSER | CSG_LOOP_L, CSG_RET_L,
+	CSG_RET_L_IF_CLOSER | CSG_LOOP_R, CSG_LOOP_L_IF_CLOSER | CSG_LOOP_R_IF_CLOSER, CSG_RET_L,
+	CSG_RET_R, CSG_RET_R, CSG_MISS,
+
+	CSG_LOOP_L_IF_CLOSER | CSG_LOOP_R_IF_CLOSER, CSG_RET_L_IF_CLOSER | CSG_LOOP_R, CSG_MISS,
+	CSG_RET_R_IF_CLOSER | CSG_LOOP_L, CSG_RET_L_IF_CLOSER | CSG_RET_R_IF_CLOSER, CSG_MISS,
+	CSG_MISS, CSG_MISS, CSG_MISS,
+
+	CSG_RET_L_IF_CLOSER | CSG_LOOP_R, CSG_LOOP_L_IF_CLOSER | CSG_LOOP_R_IF_CLOSER, CSG_RET_L,
+	CSG_RET_L_IF_CLOSER | CSG_RET_R_IF_CLOSER | CSG_FLIP_R, CSG_RET_R_IF_CLOSER | CSG_FLIP_R | CSG_LOOP_L, CSG_RET_L,
+	CSG_MISS, CSG_MISS, CSG_MISS
+};
+
+// First hit on a primitive after t_min, with the normal in the space the ray is given in.
+// Like calc_rays, but with a minimum distance t_min instead of a fixed one, so the traversal can continue behind a hit.
+// 0 < t_min is required, w is -1 for a miss.
+float4 csg_hit(float3 start, float3 dir, const uint p, const uint info, global float4* primitives, const float t_min)
 {
-	stack[++(*index)] = item;
+	const float4 miss = (float4) (0.f, 0.f, 0.f, -1.f);
+	const float4 object = primitives[PRIM_STRIDE * p];
+	float4 r0, r1, r2;
+	if (info & PRIM_TRANSFORMED)
+	{
+		r0 = primitives[PRIM_STRIDE * p + 2];
+		r1 = primitives[PRIM_STRIDE * p + 3];
+		r2 = primitives[PRIM_STRIDE * p + 4];
+		start = affine_point(start, r0, r1, r2);
+		dir = affine_dir(dir, r0, r1, r2);
+	}
+
+	float t;
+	float3 mN;
+	if (!(info & PRIM_HALF_PLANE)) {
+		float3 sc = start - object.xyz;
+		float a = dot(dir, dir);
+		float half_b = dot(sc, dir);
+		float c = dot(sc, sc) - object.w * object.w;
+		float discr = half_b * half_b - a * c;
+		if (discr < 0.00001f) return miss;
+
+		t = (-half_b - sqrt(discr)) / a;
+		if (t <= t_min)
+		{
+			t = (-half_b + sqrt(discr)) / a;
+			if (t <= t_min) return miss;
+		}
+		mN = (start + t * dir - object.xyz) / object.w;
+	} else {
+		if (object.w == 1.f) mN = (float3) (0.f, 1.f, 0.f);
+		else mN = (float3) (0.f, -1.f, 0.f);
+
+		float nd = dot(mN, dir);
+		if (nd < 0.00001f && nd > -0.00001f) return miss;
+		t = -dot(mN, start) / nd;
+		if (t <= t_min) return miss;
+	}
+
+	if (info & PRIM_TRANSFORMED) mN = affine_normal(mN, r0, r1, r2);
+	return (float4) (mN, t);
 }
-float4 popElementF4(global float4* stack, int* index)
+
+// Hit on a leaf of the CSG tree, leaves reference primitive i as -i - 1
+float4 csg_leaf(const float3 start, const float3 dir, const int ref, const float t_min, int* prim,
+	global float4* primitives, global uint* primInfo)
 {
-	return stack[*index--];
+	*prim = -ref - 1;
+	const uint info = primInfo[*prim];
+	if ((info & PRIM_TRANSFORMED) && !hit_bound(start, dir, primitives[PRIM_STRIDE * *prim + 1], t_min, INFINITY))
+		return (float4) (0.f, 0.f, 0.f, -1.f);
+	return csg_hit(start, dir, *prim, info, primitives, t_min);
 }
-char is_in(const int val, const int3 act)
+
+// Classifies a hit as entering (0) or exiting (1) the solid, or as a miss (2)
+int csg_state(const float4 hit, const float3 dir)
 {
-	return act.x == val || act.y == val || act.z == val;
+	if (hit.w < 0.f) return 2;
+	return dot(hit.xyz, dir) < 0.f ? 0 : 1;
 }
 
-// Modelled after http://ceur-ws.org/Vol-1576/090.pdf and https://github.com/bstempelj/webgl-csg-raytracing/blob/master/shaders/raytracer.frag.js
 )+R(
-float8 find_closest(float3 start, float3 dir, global float8* objects,
-	global float16* objectMats, global float16* objectInvMats, global int4* cmpInfo, float tree_height,
-	global int* state_stack, global float* time_stack, global float4* prim_stack, uint n)
-{
-	const int NONE = -1;
-	const int GotoLft = 1;
-	const int GotoRgh = 2;
-	const int Compute = 3;
-	const int LoadLft = 4;
-	const int LoadRgh = 5;
-	const int SaveLft = 6;
-
-	float t_min = 0.f;
-	uint node = 0;	
-	float4 l = (float4) (-1.f, -1.f, -1.f, -1.f);
-	float4 r = (float4) (-1.f, -1.f, -1.f, -1.f);
-	unsigned stateHead = -1, timeHead = -1, primHead = -1;
-	pushElement(Compute, state_stack, &stateHead);
-	int state = GotoLft;
-
-	char gotoL = 0, gotoR = 0;
+// Closest hit on a CSG tree, following Kensler's single hit algorithm
+// (also used by http://ceur-ws.org/Vol-1576/090.pdf and https://github.com/bstempelj/webgl-csg-raytracing/blob/master/shaders/raytracer.frag.js).
+// The recursion is replaced by stacks in private memory with one frame per complex node on the current path,
+// so CSG_STACK_SIZE has to be at least the height of the csg tree. Returns the normal and distance, w is -1 for a miss.
+float4 csg_closest(const float3 start, const float3 dir, const int root, int* prim,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo)
+{
+	// Node of every frame and what happens with the result of its child
+	int state_stack[CSG_STACK_SIZE];
+	// Distances after which the left and right child are searched
+	float2 time_stack[CSG_STACK_SIZE];
+	// Current hits of the left and right child and their primitives
+	float4 prim_stack[2 * CSG_STACK_SIZE];
+	int prim_ids[2 * CSG_STACK_SIZE];
+
+	const int FIRST_LEFT = 0;
+	const int LEFT = 1;
+	const int RIGHT = 2;
+	const float4 miss = (float4) (0.f, 0.f, 0.f, -1.f);
+
+	int head = -1;
+	// Complex node that is entered next, -1 while results are handed to the frames
+	int node = root;
+	// Distance after which the entered node is searched
+	float t_min = 0.00001f;
+	float4 res = miss;
+	int resPrim = -1;
 
 	while (true)
 	{
-		if (state == SaveLft)
-		{
-			t_min = popElementF(time_stack, &timeHead);
-			// PushPrimitive(l)
-			pushElementF4(l, prim_stack, &primHead);
-			state = GotoRgh;
-		}
-		else if (state == GotoLft || state == GotoRgh)
+		if (node >= 0)
 		{
-
-			if (state == GotoLft) node = cmpInfo[node].x;
-			else node = cmpInfo[node].y;
-
-			if (node >= 0) // Node is an operation
+			if (head == CSG_STACK_SIZE - 1)
 			{
-				gotoL = 1;
-				gotoR = 1;
-
-				if (gotoL && cmpInfo[node].x < 0)
-				{
-					int i = cmpInfo[node].x;
-					l = calc_rays(start, dir, objects[-i], objectMats[-i], objectInvMats[-i]);
-					gotoL = 0;
-				}
-				if (gotoR && cmpInfo[node].y < 0)
-				{
-					int i = cmpInfo[node].y;
-					r = calc_rays(start, dir, objects[-i], objectMats[-i], objectInvMats[-i]);
-					gotoR = 0;
-				}
-				if (gotoL || gotoR)
-				{
-					if (gotoL)
-					{
-						//PushPrimitive(L(node), t_l)
-						pushElementF4(l, prim_stack, &primHead);
-						pushElement(LoadLft, state_stack, &stateHead);
-					}
-					else if (gotoR)
-					{
-						pushElementF4(r, prim_stack, &primHead);
-						pushElement(LoadRgh, state_stack, &stateHead);
-					}
-					else
-					{
-						pushElementF(t_min, time_stack, &timeHead);
-						pushElement(LoadLft, state_stack, &stateHead);
-						pushElement(SaveLft, state_stack, &stateHead);
-					}
-					if (gotoL) state = GotoLft;
-					else state = GotoRgh;
-				}
-				else state = Compute;
+				*prim = -1;
+				return miss;
 			}
-			else // Node is a primitive
+			head++;
+			state_stack[head] = 4 * node + FIRST_LEFT;
+			time_stack[head] = (float2) (t_min, t_min);
+			const int left = complexInfo[node].x;
+			if (left >= 0)
 			{
-				if (state == GotoLft) l = calc_rays(start, dir, objects[-node], objectMats[-node], objectInvMats[-node]);
-				else r = calc_rays(start, dir, objects[-node], objectMats[-node], objectInvMats[-node]);
-				
-				state = Compute;
-				node = cmpInfo[node].z;
+				node = left;
+				continue;
 			}
+			res = csg_leaf(start, dir, left, t_min, &resPrim, primitives, primInfo);
+			node = -1;
 		}
-		else if (state == LoadLft || state == LoadRgh || state == Compute)
+		if (head < 0)
 		{
-			const int NONE = -2;
-			const int MISS = -1;
-			const int RETR = 0;
-			const int RETL = 1;
-			const int RETLIFCLOSER = 2;
-			const int RETRIFCLOSER = 3;
-			const int LOOPL = 4;
-			const int LOOPR = 5;
-			const int LOOPLIFCLOSER = 6;
-			const int LOOPRIFCLOSER = 7;
-			const int FLIPR = 8;
-
-			if (state == LoadLft) l = popElementF4(prim_stack, &primHead);
-			else if (state == LoadRgh) r = popElementF4(prim_stack, &primHead);
-
-			char stateL, stateR;
-			// Classify
-			if (l.x == l.y && l.y == l.z && l.z == l.w && l.w == -1.f) stateL = 0;
-			else stateL = dot(as_float3(l), l.w * dir) < 0.f? -1 : 1;
-			if (r.x == r.y && r.y == r.z && r.z == r.w && r.w == -1.f) stateR = 0;
-			else stateR = dot(as_float3(r), r.w * dir) < 0.f? -1 : 1;
-
-			// Table search
-			int3 actions;
-			switch(cmpInfo[node].w)
-			{
-			case 0: // Union
-				if (stateL == 0 && stateR == 0) actions = (int3) (MISS, NONE, NONE);
-				else if (stateL == 0) actions = (int3) (RETR, NONE, NONE);
-				else if (stateR == 0) actions = (int3) (RETL, NONE, NONE);
-				else if (stateL < 0 && stateR < 0) actions = (int3) (RETLIFCLOSER, RETRIFCLOSER, NONE);
-				else if (stateL > 0 && stateR > 0) actions = (int3) (LOOPLIFCLOSER, LOOPRIFCLOSER, NONE);
-				else if (stateL < 0 && stateR > 0) actions = (int3) (RETRIFCLOSER, LOOPL, NONE);
-				else actions = (int3) (RETLIFCLOSER, LOOPR, NONE);
-				break;
-			case 1: // Intersection
-				if (stateL == 0 || stateR == 0) actions = (int3) (MISS, NONE, NONE);
-				else if (stateL < 0 && stateR < 0) actions = (int3) (LOOPLIFCLOSER, LOOPRIFCLOSER, NONE);
-				else if (stateL > 0 && stateR > 0) actions = (int3) (RETLIFCLOSER, RETRIFCLOSER, NONE);
-				else if (stateL < 0 && stateR > 0) actions = (int3) (RETLIFCLOSER, LOOPR, NONE);
-				else actions = (int3) (RETRIFCLOSER, LOOPL, NONE);
-				break;
-			case 2: // Subtraction
-				if (stateL == 0) actions = (int3) (MISS, NONE, NONE);
-				else if (stateR == 0) actions = (int3) (RETL, NONE, NONE);
-				else if (stateL < 0 && stateR < 0) actions = (int3) (RETLIFCLOSER, LOOPR, NONE);
-				else if (stateL > 0 && stateR > 0) actions = (int3) (RETRIFCLOSER, FLIPR, LOOPL);
-				else if (stateL < 0 && stateR > 0) actions = (int3) (LOOPLIFCLOSER, LOOPRIFCLOSER, NONE);
-				else actions = (int3) (RETLIFCLOSER, RETRIFCLOSER, FLIPR);
-				break;
-			default: // What?
-				actions = (int3) (NONE, NONE, NONE);
-			}
-			if (is_in(MISS, actions)) return (float8) (-1.f, -1.f, -1.f, -1.f, -1.f, -1.f, -1.f, -1.f);
+			*prim = resPrim;
+			return res;
+		}
 
-			if (is_in(RETL, actions) || (is_in(RETLIFCLOSER, actions) && l.w <= r.w))
+		// Store the result of the child that was searched last
+		const int cur = state_stack[head] / 4;
+		const int step = state_stack[head] % 4;
+		const int4 info = complexInfo[cur];
+		const int slot = step == RIGHT ? 2 * head + 1 : 2 * head;
+		prim_stack[slot] = res;
+		prim_ids[slot] = resPrim;
+
+		bool goLeft = false;
+		if (step != FIRST_LEFT)
+		{
+			const float4 l = prim_stack[2 * head];
+			const float4 r = prim_stack[2 * head + 1];
+			const int act = csg_table[9 * info.z + 3 * csg_state(l, dir) + csg_state(r, dir)];
+			if (act & CSG_MISS)
 			{
-				r = l;
-				state = popElement(state_stack, &stateHead);
-				node = cmpInfo[node].z;
+				res = miss;
+				resPrim = -1;
+				head--;
+				continue;
 			}
-			if (is_in(RETR, actions) || (is_in(RETRIFCLOSER, actions) && r.w < l.w))
+			if ((act & CSG_RET_L) || ((act & CSG_RET_L_IF_CLOSER) && l.w <= r.w))
 			{
-				if (is_in(FLIPR, actions))
-					l = (float4) (-r.x, -r.y, -r.z, r.w);
-				else l = r;
-				state = popElement(state_stack, &stateHead);
-				node = cmpInfo[node].z;
+				res = l;
+				resPrim = prim_ids[2 * head];
+				head--;
+				continue;
 			}
-			else if (is_in(LOOPL, actions) || (is_in(LOOPLIFCLOSER, actions) && l.w <= r.w))
+			if ((act & CSG_RET_R) || ((act & CSG_RET_R_IF_CLOSER) && r.w < l.w))
 			{
-				t_min = l.w;
-				pushElementF4(r, prim_stack, &primHead);
-				pushElement(LoadRgh, state_stack, &stateHead);
-				state = GotoLft;
+				res = (act & CSG_FLIP_R) ? (float4) (-r.xyz, r.w) : r;
+				resPrim = prim_ids[2 * head + 1];
+				head--;
+				continue;
 			}
-			else if (is_in(LOOPR, actions) || (is_in(LOOPRIFCLOSER, actions) && r.w < l.w))
+			if ((act & CSG_LOOP_L) || ((act & CSG_LOOP_L_IF_CLOSER) && l.w <= r.w))
 			{
-				t_min = r.w;
-				pushElementF4(l, prim_stack, &primHead);
-				pushElement(LoadLft, state_stack, &stateHead);
-				state = GotoRgh;
+				time_stack[head].x = l.w;
+				goLeft = true;
 			}
+			else if ((act & CSG_LOOP_R) || ((act & CSG_LOOP_R_IF_CLOSER) && r.w < l.w))
+				time_stack[head].y = r.w;
 			else
 			{
-				r.w = -1.f;
-				state = popElement(state_stack, &stateHead);
+				res = miss;
+				resPrim = -1;
+				head--;
+				continue;
 			}
 		}
-		if (stateHead == -1 && node == 0) break;
+
+		// Search one of the children again, after the first left search it's always the right one
+		const int child = goLeft ? info.x : info.y;
+		t_min = goLeft ? time_stack[head].x : time_stack[head].y;
+		state_stack[head] = 4 * cur + (goLeft ? LEFT : RIGHT);
+		if (child >= 0) node = child;
+		else res = csg_leaf(start, dir, child, t_min, &resPrim, primitives, primInfo);
 	}
-	if (t_min < 0.0001) return (float8) (-1.f, -1.f, -1.f, -1.f, -1.f, -1.f, -1.f, -1.f);
-	float3 P = start + t_min * dir;
-	return (float8) (P.x, P.y, P.z, 0.f, l.x, l.y, l.z, 0.f);
-}*/
+}
 
 float rtAbs(float a)
 {
@@ -394,110 +458,585 @@ float3 refract(const float3 dir, const float3 n, float nonp)
 	return r_out_perp + r_out_parallel;
 }
 
-float8 find_closest(float3 start, float3 dir, global float8* objects,
-	global float16* objectMats, global float16* objectInvMats, float objNum)
+// Tests all primitives of an instance and keeps the closest hit in shortest,
+// with the normal still in the space of the instance.
+void hit_instance(const float3 start, const float3 dir, const uint i, float4* shortest, int* ind, uint* inst,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo,
+	global int4* prototypes, global float4* instances, global uint* instanceProtos)
 {
-	float4 shortest = (float4) (0.f, 0.f, 0.f, 100000.f);
-	uint ind = 0;
-	for (uint i = 0; i < (int)objNum; i++)
+	const uint protoInfo = instanceProtos[i];
+	float3 iStart = start, iDir = dir;
+	// The ray is transformed only once for all primitives of the instance, and not at all if the instance isn't transformed
+	if (!(protoInfo & INSTANCE_IDENTITY))
+	{
+		const float4 r0 = instances[3 * i], r1 = instances[3 * i + 1], r2 = instances[3 * i + 2];
+		iStart = affine_point(start, r0, r1, r2);
+		iDir = affine_dir(dir, r0, r1, r2);
+	}
+	const int4 proto = prototypes[protoInfo & ~INSTANCE_IDENTITY];
+	if (proto.z >= 0)
 	{
-		float4 t = calc_rays(start, dir, objects[i], objectMats[i], objectInvMats[i]);
+		// Intersections and subtractions need the CSG traversal
+		int p = -1;
+		const float4 t = csg_closest(iStart, iDir, proto.z, &p, primitives, primInfo, complexInfo);
+		if (t.w >= 0.f && t.w < (*shortest).w)
+		{
+			*shortest = t;
+			*ind = p;
+			*inst = i;
+		}
+		return;
+	}
+	// Pure unions skip the CSG machinery and simply test all primitives
+	for (int p = proto.x; p < proto.x + proto.y; p++)
+	{
+		const uint info = primInfo[p];
+		// Transformed primitives are only transformed if the ray can hit their bounds,
+		// untransformed spheres are tested right away without any matrix multiplication
+		if ((info & PRIM_TRANSFORMED) && !hit_bound(iStart, iDir, primitives[PRIM_STRIDE * p + 1], 0.f, (*shortest).w)) continue;
+		float4 t = calc_rays(iStart, iDir, p, info, primitives);
 		if (t.x == t.y && t.y == t.z && t.z == t.w && t.w == -1.f) continue;
-		if (rtAbs(t.w) < shortest.w)
+		if (t.w < (*shortest).w)
 		{
-			shortest = t;
-			ind = i;
+			*shortest = t;
+			*ind = p;
+			*inst = i;
+		}
+	}
+}
+
+float8 find_closest(float3 start, float3 dir, global float4* primitives, global uint* primInfo, global int4* complexInfo,
+	global int4* prototypes, global float4* instances, global uint* instanceProtos, global float4* bvhNodes,
+	constant SceneHeader* header)
+{
+	float4 shortest = (float4) (0.f, 0.f, 0.f, 100000.f);
+	int ind = -1;
+	uint inst = 0;
+	// Instances without bounds are always tested
+	for (uint i = 0; i < header->unbounded; i++)
+		hit_instance(start, dir, i, &shortest, &ind, &inst, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos);
+
+	if (header->nodes > 0)
+	{
+		const float3 inv_dir = (float3) (
+			1.f / (fabs(dir.x) > 1e-8f ? dir.x : copysign(1e-8f, dir.x)),
+			1.f / (fabs(dir.y) > 1e-8f ? dir.y : copysign(1e-8f, dir.y)),
+			1.f / (fabs(dir.z) > 1e-8f ? dir.z : copysign(1e-8f, dir.z)));
+		uint stack[32];
+		int head = 0;
+		stack[head++] = 0;
+		while (head > 0)
+		{
+			const uint node = stack[--head];
+			const float4 lo = bvhNodes[2 * node];
+			const float4 hi = bvhNodes[2 * node + 1];
+			if (!hit_box(start, inv_dir, lo, hi, shortest.w)) continue;
+			const uint first = as_uint(lo.w);
+			const uint count = as_uint(hi.w);
+			if (count > 0)
+			{
+				for (uint i = first; i < first + count; i++)
+					hit_instance(start, dir, i, &shortest, &ind, &inst, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos);
+			}
+			else
+			{
+				stack[head++] = first + 1;
+				stack[head++] = first;
+			}
 		}
 	}
-	if (shortest.w == 100000.f) return (float8) (-1.0f, -1.0f, -1.0f, -1.0f, -1.0f, -1.0f, -1.0f, -1.0f);
-	return (float8) (start + shortest.w * dir, 0.f, shortest.xyz, (float)ind);
+	if (ind < 0) return (float8) (-1.0f, -1.0f, -1.0f, -1.0f, -1.0f, -1.0f, -1.0f, -1.0f);
+	const float3 N = (instanceProtos[inst] & INSTANCE_IDENTITY) ? normalize(shortest.xyz)
+		: normalize(affine_normal(shortest.xyz, instances[3 * inst], instances[3 * inst + 1], instances[3 * inst + 2]));
+	return (float8) (start + shortest.w * dir, 0.f, N, (float)ind);
 }
-bool light_reachable(float3 P, float8 light, global float8* objects,global float16* objectMats, global float16* objectInvMats, float objNum)
+bool light_reachable(float3 P, float3 light, global float4* primitives, global uint* primInfo, global int4* complexInfo,
+	global int4* prototypes, global float4* instances, global uint* instanceProtos, global float4* bvhNodes, constant SceneHeader* header)
 {
-	float3 V = P - light.xyz;
-	float8 t = find_closest(P, V, objects, objectMats, objectInvMats, objNum);
+	float3 V = P - light;
+	float8 t = find_closest(P, V, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes, header);
 	return t.s3 == -1.f || length(t.xyz) > length(V);
 }
 
 )+R(
 
-// Base ray calculation as to be called from the CPU.
-kernel void ray_kernel(global float4* start1, global float4* dir1,
-	global float4* start2, global float4* dir2,
-	global float4* out, global float* ambient_data,
-	global float8* objects, global float16* objectMats, global float16* objectInvMats, //global int4* cmpInfo,
-	global float16* materials, global float8* lights) {
+// Ray directions and colors are either stored as full float4 or, with half_rays set, as four halves each.
+// Half directions are octahedral encoded into two halves, followed by the refraction index and a one so
+// that a stored direction is never all zero - zeroed buffers mark rays that don't exist.
+float2 oct_encode(const float3 d)
+{
+	const float3 a = d / (fabs(d.x) + fabs(d.y) + fabs(d.z));
+	if (a.z >= 0.f) return a.xy;
+	return (float2) ((1.f - fabs(a.y)) * (a.x >= 0.f ? 1.f : -1.f), (1.f - fabs(a.x)) * (a.y >= 0.f ? 1.f : -1.f));
+}
+
+float3 oct_decode(const float2 e)
+{
+	float3 d = (float3) (e.xy, 1.f - fabs(e.x) - fabs(e.y));
+	const float t = max(-d.z, 0.f);
+	d.x += d.x >= 0.f ? -t : t;
+	d.y += d.y >= 0.f ? -t : t;
+	return normalize(d);
+}
+
+float4 load_dir(global float* dirs, const uint i, const uint half_rays)
+{
+	if (!half_rays) return vload4(i, dirs);
+	const float4 e = vload_half4(i, (global half*) dirs);
+	if (e.w == 0.f) return (float4) (0.f, 0.f, 0.f, 0.f);
+	return (float4) (oct_decode(e.xy), e.z);
+}
+
+void store_dir(global float* dirs, const uint i, const float4 d, const uint half_rays)
+{
+	if (!half_rays) vstore4(d, i, dirs);
+	else vstore_half4_rte((float4) (oct_encode(d.xyz), d.w, 1.f), i, (global half*) dirs);
+}
+
+float4 load_color(global float* colors, const uint i, const uint half_rays)
+{
+	if (!half_rays) return vload4(i, colors);
+	return vload_half4(i, (global half*) colors);
+}
+
+void store_color(global float* colors, const uint i, const float4 c, const uint half_rays)
+{
+	if (!half_rays) vstore4(c, i, colors);
+	else vstore_half4_rte(c, i, (global half*) colors);
+}
+
+// Scrambles the bits of x, so close inputs give unrelated outputs
+uint hash(uint x)
+{
+	x *= 0x9E3779B1u;
+	x ^= x >> 16;
+	x *= 0x7FEB352Du;
+	x ^= x >> 15;
+	x *= 0x846CA68Bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// Offset of a sample within its pixel in [-0.5, 0.5), the first sample of every pixel goes through its center.
+// The offsets follow the R2 sequence, shifted by a hash of the pixel so neighbouring pixels don't share a pattern.
+float2 jitter(const uint pixel, const uint sample)
+{
+	if (sample == 0) return (float2) (0.f, 0.f);
+	const uint h = hash(pixel);
+	const float2 o = (float2) ((float) (h & 0xFFFFu), (float) (h >> 16)) / 65536.f + (float) sample * (float2) (0.7548776662f, 0.5698402910f);
+	return o - floor(o) - 0.5f;
+}
+
+// Creates the primary rays of a pinhole camera on the device, the same way Interpreter::createRays does on the host.
+// The ray through pixel (x, y) starts at the eye and points to corner + x * step_x + y * step_y, later samples are jittered within the pixel.
+// Ray n belongs to pixel pixels[n], or to pixel n if no list of pixels is given.
+kernel void camera_kernel(global float4* starts, global float* dirs, const float4 eye, const float4 corner, const float4 step_x, const float4 step_y,
+	const uint width, const uint count, const uint half_rays, global uint* pixels, const uint sample)
+{
 	const uint n = get_global_id(0);
+	if (n >= count) return;
+	const uint p = pixels == NULL ? n : pixels[n];
+	const float2 o = jitter(p, sample);
+	const float x = (float) (p % width) + o.x;
+	const float y = (float) (p / width) + o.y;
+	starts[n] = (float4) (eye.xyz, 1.f);
+	store_dir(dirs, n, (float4) (normalize(corner.xyz + x * step_x.xyz + y * step_y.xyz), 1.f), half_rays);
+}
+
+// Resets the rays of one level before rendering, rays of the first level are set by the host or camera_kernel
+kernel void clear_kernel(global float4* starts, global float* dirs, global float* colors, const uint count, const uint first_level, const uint half_rays)
+{
+	const uint n = get_global_id(0);
+	if (n >= count) return;
+	if (!first_level)
+	{
+		starts[n] = (float4) (0.f, 0.f, 0.f, 0.f);
+		// Zeroes the direction no matter if it is stored as four floats or four halves
+		store_color(dirs, n, (float4) (0.f, 0.f, 0.f, 0.f), half_rays);
+	}
+	store_color(colors, n, (float4) (-1.f, 0.f, 0.f, 0.f), half_rays);
+}
+
+// Rays of a level can be sorted by a key made of their quantized direction and origin before tracing them,
+// so neighbouring work items traverse the same parts of the scene. The keys are sorted with a radix sort
+// of SORT_BITS bits per pass, every work group handles SORT_BLOCK keys.
+enum sort_settings {
+	SORT_BLOCK = 256,
+	SORT_BITS = 4,
+	SORT_RADIX = 16
+};
+// Key of rays that don't exist
+constant uint SORT_DEAD = 0xFFFFFFFFu;
+
+// Spreads the lower 10 bits of x so there are two zero bits between each of them
+uint spread3(uint x)
+{
+	x &= 0x3FFu;
+	x = (x | (x << 16)) & 0x030000FFu;
+	x = (x | (x << 8)) & 0x0300F00Fu;
+	x = (x | (x << 4)) & 0x030C30C3u;
+	x = (x | (x << 2)) & 0x09249249u;
+	return x;
+}
+
+// Computes the key of every ray: 6 bits of the octahedral encoded direction above the 24 bit morton code of
+// the origin within the scene bounds. Rays that don't exist get the highest key so they end up together at the end.
+kernel void sort_key_kernel(global float4* starts, global float* dirs, global uint* keys, global uint* order,
+	const float4 lo, const float4 scale, const uint count, const uint half_rays)
+{
+	const uint n = get_global_id(0);
+	if (n >= count) return;
+	order[n] = n;
+	const float4 s = starts[n];
+	const float4 d = load_dir(dirs, n, half_rays);
+	if (s.x == 0.f && s.y == 0.f && s.z == 0.f && d.x == 0.f && d.y == 0.f)
+	{
+		keys[n] = SORT_DEAD;
+		return;
+	}
+	const float3 q = clamp((s.xyz - lo.xyz) * scale.xyz, 0.f, 255.f);
+	const float2 e = clamp((oct_encode(d.xyz) * 0.5f + 0.5f) * 8.f, 0.f, 7.f);
+	const uint dir_key = ((uint)e.x << 3) | (uint)e.y;
+	keys[n] = (dir_key << 24) | (spread3((uint)q.x) << 2) | (spread3((uint)q.y) << 1) | spread3((uint)q.z);
+}
+
+// Counts the digits of the keys in every block, hist is stored digit by digit so scanning it gives the offsets of every block
+kernel void sort_histogram_kernel(global uint* keys, global uint* hist, const uint count, const uint shift)
+{
+	local uint counts[SORT_RADIX];
+	const uint n = get_global_id(0);
+	const uint l = get_local_id(0);
+	if (l < SORT_RADIX) counts[l] = 0u;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (n < count) atomic_inc(&counts[(keys[n] >> shift) & (SORT_RADIX - 1)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (l < SORT_RADIX) hist[l * get_num_groups(0) + get_group_id(0)] = counts[l];
+}
+
+// Exclusive prefix sum of the histogram, run with a single work group of SORT_BLOCK work items
+kernel void sort_scan_kernel(global uint* hist, const uint size)
+{
+	local uint sums[SORT_BLOCK];
+	const uint l = get_local_id(0);
+	const uint chunk = (size + SORT_BLOCK - 1) / SORT_BLOCK;
+	const uint first = min(l * chunk, size);
+	const uint end = min(first + chunk, size);
+	uint sum = 0u;
+	for (uint i = first; i < end; i++) sum += hist[i];
+	sums[l] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (l == 0)
+	{
+		uint acc = 0u;
+		for (uint i = 0; i < SORT_BLOCK; i++)
+		{
+			const uint t = sums[i];
+			sums[i] = acc;
+			acc += t;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint acc = sums[l];
+	for (uint i = first; i < end; i++)
+	{
+		const uint t = hist[i];
+		hist[i] = acc;
+		acc += t;
+	}
+}
+
+// Moves keys and ray indices to their sorted position, keys with the same digit keep their order
+kernel void sort_scatter_kernel(global uint* keys, global uint* order, global uint* sorted_keys, global uint* sorted_order,
+	global uint* hist, const uint count, const uint shift)
+{
+	local uint digits[SORT_BLOCK];
+	const uint n = get_global_id(0);
+	const uint l = get_local_id(0);
+	const uint digit = n < count ? (keys[n] >> shift) & (SORT_RADIX - 1) : SORT_RADIX;
+	digits[l] = digit;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (n >= count) return;
+	uint rank = 0u;
+	for (uint i = 0; i < l; i++) rank += digits[i] == digit ? 1u : 0u;
+	const uint dst = hist[digit * get_num_groups(0) + get_group_id(0)] + rank;
+	sorted_keys[dst] = keys[n];
+	sorted_order[dst] = order[n];
+}
+
+)+R(
+
+// Hit records hold two float4 per ray: the hit position and the hit primitive, or one of these, and the normal
+enum hit_kind {
+	HIT_SKY = -1,
+	HIT_NONE = -2
+};
+
+// Finds what a ray hits and writes its hit record
+void intersect(global float4* start1, global float* dir1, global float4* hits, const uint n,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo, global int4* prototypes, global float4* instances, global uint* instanceProtos, global float4* bvhNodes,
+	constant SceneHeader* header, const uint half_rays)
+{
+	const float4 d1 = load_dir(dir1, n, half_rays);
 
 	// We have an uninitialized vector, either because no reflection was found here or because
 	// something went wrong - anyways, we don't need to do any calculations here.
 	if (start1[n].x == 0. && start1[n].y == 0. && start1[n].z == 0. &&
-		dir1[n].x == 0. && dir1[n].y == 0. && start1[n].z == 0.) return;
+		d1.x == 0. && d1.y == 0. && start1[n].z == 0.)
+	{
+		hits[2 * n] = (float4) (0.f, 0.f, 0.f, as_float((int)HIT_NONE));
+		return;
+	}
+
+	const float8 res = find_closest(as_float3(start1[n]), d1.xyz, primitives, primInfo, complexInfo,
+		prototypes, instances, instanceProtos, bvhNodes, header);
+	hits[2 * n] = (float4) (res.s012, as_float(res.s3 == -1.0f ? (int)HIT_SKY : (int)res.s7));
+	hits[2 * n + 1] = (float4) (res.s456, 0.f);
+}
+
+// Decides if a reflected or refracted ray is traced, w is the weight it adds to the pixel with.
+// Rays weighing nothing or less than min_weight aren't traced. Rays lighter than roulette are traced with the probability
+// w / roulette and then weigh roulette, so on average they add as much as before while most of them are dropped.
+bool keep_ray(float* w, const uint seed, const float min_weight, const float roulette)
+{
+	if (*w <= 0.f || *w < min_weight) return false;
+	if (*w >= roulette) return true;
+	if ((float) (hash(seed) >> 8) * (1.f / 16777216.f) * roulette >= *w) return false;
+	*w = roulette;
+	return true;
+}
+
+// Next number in [0, 1) of a sequence, state is advanced
+float next_random(uint* state)
+{
+	*state = hash(*state);
+	return (float) (*state >> 8) * (1.f / 16777216.f);
+}
+
+// Estimate of the power of a light, the brightest channel of its color. Has to match Shading::power.
+float light_power(const Light light)
+{
+	return max(max(max(light.r, light.g), light.b), 0.001f);
+}
+
+// Estimate of how much a light adds at P, its power over the squared distance. Lights whose radius doesn't reach P add nothing.
+float light_importance(const float3 P, const Light light)
+{
+	const float3 d = (float3) (light.x, light.y, light.z) - P;
+	const float dist2 = dot(d, d);
+	if (light.radius > 0.f && dist2 >= light.radius * light.radius) return 0.f;
+	return light_power(light) / max(dist2, 1e-4f);
+}
+
+// Estimate of how much the lights of a node of the light tree add at P. The distance is at least half the diagonal of the node,
+// so nodes around P aren't overrated.
+float node_importance(const float3 P, SHADING_SPACE const float4* tree, const uint node)
+{
+	const float3 lo = tree[3 * node].xyz;
+	const float3 hi = tree[3 * node + 1].xyz;
+	const float3 d = 0.5f * (lo + hi) - P;
+	return tree[3 * node + 2].x / max(dot(d, d), max(0.25f * dot(hi - lo, hi - lo), 1e-4f));
+}
+
+// Picks a light with a probability about proportional to how much it adds at P, walking down the light tree and choosing
+// one child by the importance of both, then one light of the leaf. The cost only grows with the height of the tree.
+// Returns the index of the light and its probability in pdf, or -1 if no light reaches P.
+int sample_light(const float3 P, SHADING_SPACE const float4* tree, SHADING_SPACE const uint* order, SHADING_SPACE const Light* lights,
+	uint* state, float* pdf)
+{
+	*pdf = 1.f;
+	uint node = 0;
+	while (as_uint(tree[3 * node + 1].w) == 0)
+	{
+		const uint left = as_uint(tree[3 * node].w);
+		const float wl = node_importance(P, tree, left);
+		const float wr = node_importance(P, tree, left + 1);
+		if (wl + wr <= 0.f) return -1;
+		const float p = wl / (wl + wr);
+		if (next_random(state) < p)
+		{
+			node = left;
+			*pdf *= p;
+		}
+		else
+		{
+			node = left + 1;
+			*pdf *= 1.f - p;
+		}
+	}
+	const uint first = as_uint(tree[3 * node].w);
+	const uint count = as_uint(tree[3 * node + 1].w);
+	float total = 0.f;
+	for (uint i = first; i < first + count; i++) total += light_importance(P, lights[order[i]]);
+	if (total <= 0.f) return -1;
+	float u = next_random(state) * total;
+	for (uint i = first; i < first + count; i++)
+	{
+		const float w = light_importance(P, lights[order[i]]);
+		if (w > 0.f && (u < w || i + 1 == first + count))
+		{
+			*pdf *= w / total;
+			return (int) order[i];
+		}
+		u -= w;
+	}
+	return -1;
+}
+
+// Adds the diffuse and specular light of one light source at a hit, multiplied by scale. Lights with a radius fade out smoothly towards it.
+// The shadow ray is only cast if the light falls onto the front of the surface and still reaches the hit.
+// With linear set the light is summed up plainly instead of added logarithmically, for estimates that are only combined once finished.
+void add_light(const Light light, const float scale, const bool linear, const Material mat, const float3 P, const float3 N, const float3 V, float3* difc, float3* spec,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo, global int4* prototypes, global float4* instances,
+	global uint* instanceProtos, global float4* bvhNodes, constant SceneHeader* header)
+{
+	const float3 lpos = (float3) (light.x, light.y, light.z);
+	float falloff = scale;
+	if (light.radius > 0.f)
+	{
+		const float d = length(lpos - P) / light.radius;
+		if (d >= 1.f) return;
+		falloff = scale * (1.f - d * d) * (1.f - d * d);
+	}
+	// Vector from light source to object point
+	float3 l = normalize(lpos - P);
+	// Dot product with normal
+	float lambertian = max(dot(l, N), 0.f);
+	// Without diffuse light there is no specular one either, so the light adds nothing
+	if (lambertian <= 0.0001f) return;
+	if (!light_reachable(P + N * 0.1f, lpos, primitives, primInfo, complexInfo,
+		prototypes, instances, instanceProtos, bvhNodes, header)) return;
+	// Perfectly reflected light ray
+	float3 r = -l - 2 * dot(-l, N) * N;
+	float specAngle = max(dot(r, V), 0.f);
+	float specular = pow(specAngle, mat.shininess);
+
+	const float3 dif = falloff * mat.diffuse * lambertian * (float3) (mat.r, mat.g, mat.b);
+	const float3 spc = falloff * mat.specular * specular * (float3) (light.r, light.g, light.b);
+	if (linear)
+	{
+		*difc += dif;
+		*spec += spc;
+	}
+	else
+	{
+		*difc = color_addition3(*difc, dif);
+		*spec = color_addition3(*spec, spc);
+	}
+}
+
+// Computes the color of a ray from its hit record and creates the reflected and refracted rays.
+// The w of a start is the weight the ray adds to its pixel with, the product of the weights of all rays it was reflected from.
+void shade(global float4* start1, global float* dir1, global float4* start2, global float* dir2,
+	global float* out, global float4* hits, const uint n, constant SceneHeader* header,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo, global int4* prototypes, global float4* instances, global uint* instanceProtos, global float4* bvhNodes,
+	SHADING_SPACE const Material* materials, SHADING_SPACE const Light* lights, SHADING_SPACE const float4* light_nodes,
+	SHADING_SPACE const float4* light_tree, SHADING_SPACE const uint* light_order, const uint half_rays,
+	const float min_weight, const float roulette, const uint light_samples, const uint light_seed)
+{
+	const float4 hit = hits[2 * n];
+	const int prim = as_int(hit.w);
+	if (prim == HIT_NONE) return;
+	const float4 d1 = load_dir(dir1, n, half_rays);
 
 	bool last = start2 == NULL && dir2 == NULL;
 
-	const float8 res = find_closest(as_float3(start1[n]), as_float3(dir1[n]), objects, objectMats, objectInvMats, ambient_data[6]);
 	// We're looking at the sky and don't need further calculations
-	if (res.s3 == -1.0f) {
-		float3 c = color(dir1[n].xyz, ambient_data);
-		out[n] = (float4) (c.xyz, start1[n].w);
+	if (prim == HIT_SKY) {
+		float3 c = color(d1.xyz, header);
+		store_color(out, n, (float4) (c.xyz, start1[n].w), half_rays);
 		return;
 	}
 	else { // Reflection found! That unfortunately means further calculations
-		float16 mat = materials[(int)objects[(int)res.s7].s4];
+		const Material mat = materials[primInfo[prim] >> PRIM_MATERIAL_SHIFT];
 
-		const float3 I = as_float3(start1[n] + dir1[n]);
-		const float3 N = (float3) (res.s456);
-		const float3 P = (float3) (res.s012);
-		const float3 REF = as_float3(dir1[n]) - 2.f * dot(as_float3(dir1[n]), N) * N;
+		const float3 I = as_float3(start1[n] + d1);
+		const float3 N = hits[2 * n + 1].xyz;
+		const float3 P = hit.xyz;
+		const float3 REF = d1.xyz - 2.f * dot(d1.xyz, N) * N;
 		const float3 V = normalize(start1[n].xyz - P);
 
 		// K_a * I_a
-		float3 ambc = mat.s0 * (float3)(ambient_data[0], ambient_data[1], ambient_data[2]);
+		float3 ambc = mat.ambient * (float3)(header->ambient[0], header->ambient[1], header->ambient[2]);
 
 		float3 difc = (float3) (0.f, 0.f, 0.f);
 		float3 spec = (float3) (0.f, 0.f, 0.f);
-		for (uint li = 0; li < (int)ambient_data[7]; li++)
+		if (light_samples > 0)
 		{
-			// Vector from light source to object point
-			float3 l = normalize(lights[li].xyz - P);
-			if (!light_reachable(P + N * 0.1f, lights[li], objects, objectMats, objectInvMats, ambient_data[6])) continue;
-			// Dot product with normal
-			float lambertian = max(dot(l, N), 0.f);
-			float specular = 0.f;
-			if (lambertian > 0.0001f)
+			// Only a few lights are picked at random, each one adds its light divided by how likely it was to be picked.
+			// The samples are summed up linearly, so the estimate stays unbiased, and only the finished one is added to the ambient light below.
+			uint state = hash(as_uint(P.x) ^ hash(as_uint(P.y) ^ hash(as_uint(P.z) ^ hash(light_seed))));
+			for (uint s = 0; s < light_samples && header->light_tree > 0; s++)
 			{
-				// Perfectly reflected light ray
-				float3 r = -l - 2 * dot(-l, N) * N;
-				float specAngle = max(dot(r, V), 0.f);
-				specular = pow(specAngle, mat.s6);
+				float pdf;
+				const int li = sample_light(P, light_tree, light_order, lights, &state, &pdf);
+				// A pick that reaches no light is a sample adding nothing, the others are still divided by all samples
+				if (li < 0) continue;
+				add_light(lights[li], 1.f / (pdf * (float) light_samples), true, mat, P, N, V, &difc, &spec,
+					primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes, header);
+			}
+		}
+		else
+		{
+			// Lights without a radius reach every hit
+			for (uint li = 0; li < header->unbounded_lights; li++)
+				add_light(lights[li], 1.f, false, mat, P, N, V, &difc, &spec, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes, header);
+			// Of the others, only the ones whose sphere contains the hit are visited
+			if (header->light_nodes > 0)
+			{
+				uint stack[32];
+				int head = 0;
+				stack[head++] = 0;
+				while (head > 0)
+				{
+					const uint node = stack[--head];
+					const float4 lo = light_nodes[2 * node];
+					const float4 hi = light_nodes[2 * node + 1];
+					if (any(P < lo.xyz) || any(P > hi.xyz)) continue;
+					const uint first = as_uint(lo.w);
+					const uint count = as_uint(hi.w);
+					if (count > 0)
+					{
+						for (uint li = first; li < first + count; li++)
+							add_light(lights[li], 1.f, false, mat, P, N, V, &difc, &spec, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes, header);
+					}
+					else
+					{
+						stack[head++] = first + 1;
+						stack[head++] = first;
+					}
+				}
 			}
-
-			difc = color_addition3(difc, mat.s1 * lambertian * mat.s789);
-			spec = color_addition3(spec, mat.s2 * specular * lights[li].s345);
 		}
 
-		out[n] = (float4) ( //ambc + difc + spec,
+		store_color(out, n, (float4) ( //ambc + difc + spec,
 			intensity_addition(ambc.x, intensity_addition(difc.x, spec.x)),
 			intensity_addition(ambc.y, intensity_addition(difc.y, spec.y)),
 			intensity_addition(ambc.z, intensity_addition(difc.z, spec.z)),
 			start1[n].w
-		);
+		), half_rays);
 		if (!last)
 		{
+			// The hit point decides the roulette too, so the same ray index doesn't survive in every level and sample
+			const uint seed = hash(as_uint(P.x) ^ hash(as_uint(P.y) ^ hash(as_uint(P.z))));
+			float reflected = start1[n].w * mat.reflection;
+			float refracted = start1[n].w * mat.refraction;
+
 			// Reflected rays
-			dir2[2 * n] = (float4) (REF.xyz, mat.s5);
-			start2[2 * n] = (float4) (P.xyz, mat.s3);
+			if (keep_ray(&reflected, seed ^ (2 * n), min_weight, roulette))
+			{
+				store_dir(dir2, 2 * n, (float4) (REF.xyz, mat.refraction_index), half_rays);
+				start2[2 * n] = (float4) (P.xyz, reflected);
+			}
 
 			// Refracted rays
-			float refr = dot(dir1[n].xyz, N) > 0.f? dir1[n].w / mat.s5 : mat.s5 / dir1[n].w;
-			float cos_theta = min(dot(-dir1[n].xyz, n), 1.f);
+			float refr = dot(d1.xyz, N) > 0.f? d1.w / mat.refraction_index : mat.refraction_index / d1.w;
+			float cos_theta = min(dot(-d1.xyz, N), 1.f);
 			float sin_theta = sqrt(1.f - cos_theta * cos_theta);
 			bool can_refract = refr * sin_theta <= 1.f;
-			if (can_refract)
+			if (can_refract && keep_ray(&refracted, seed ^ (2 * n + 1), min_weight, roulette))
 			{
-				start2[2 * n + 1] = (float4) (P.xyz, mat.s4);
-				dir2[2 * n + 1] = (float4) (refract(dir1[n].xyz, N, refr), mat.s5);
+				start2[2 * n + 1] = (float4) (P.xyz, refracted);
+				store_dir(dir2, 2 * n + 1, (float4) (refract(d1.xyz, N, refr), mat.refraction_index), half_rays);
 			}
 		}
 	}
@@ -505,6 +1044,47 @@ kernel void ray_kernel(global float4* start1, global float4* dir1,
 
 )+R(
 
+// Traces rays as to be called from the CPU: intersect_kernel writes a hit record for every ray, the host groups
+// them by material and shade_kernel then shades them in that order. Rays are traced in the order given but read
+// and write their data at their original index, so the reflection tree stays untouched.
+kernel void intersect_kernel(global float4* start1, global float* dir1, global float4* hits,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo, global int4* prototypes, global float4* instances, global uint* instanceProtos, global float4* bvhNodes,
+	constant SceneHeader* header, const uint half_rays, const uint count, global uint* order)
+{
+	if (get_global_id(0) >= count) return;
+	const uint n = order == NULL ? get_global_id(0) : order[get_global_id(0)];
+	intersect(start1, dir1, hits, n, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes, header, half_rays);
+}
+
+// Writes the material of every hit as its key, the sky comes first and rays that don't exist last.
+// With init_order set, the order starts out as initial, or as the identity if initial is a nullpointer.
+kernel void bin_key_kernel(global float4* hits, global uint* primInfo, global uint* keys, global uint* order,
+	global uint* initial, const uint count, const uint dead_key, const uint init_order)
+{
+	const uint k = get_global_id(0);
+	if (k >= count) return;
+	if (init_order) order[k] = initial == NULL ? k : initial[k];
+	const int prim = as_int(hits[2 * order[k]].w);
+	if (prim == HIT_NONE) keys[k] = dead_key;
+	else if (prim == HIT_SKY) keys[k] = 0u;
+	else keys[k] = (primInfo[prim] >> PRIM_MATERIAL_SHIFT) + 1u;
+}
+
+kernel void shade_kernel(global float4* start1, global float* dir1, global float4* start2, global float* dir2,
+	global float* out, global float4* hits, constant SceneHeader* header,
+	global float4* primitives, global uint* primInfo, global int4* complexInfo, global int4* prototypes, global float4* instances, global uint* instanceProtos, global float4* bvhNodes,
+	SHADING_SPACE const Material* materials, SHADING_SPACE const Light* lights, SHADING_SPACE const float4* light_nodes,
+	SHADING_SPACE const float4* light_tree, SHADING_SPACE const uint* light_order, const uint half_rays,
+	const uint count, global uint* order, const float min_weight, const float roulette, const uint light_samples, const uint light_seed)
+{
+	if (get_global_id(0) >= count) return;
+	const uint n = order[get_global_id(0)];
+	shade(start1, dir1, start2, dir2, out, hits, n, header, primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes,
+		materials, lights, light_nodes, light_tree, light_order, half_rays, min_weight, roulette, light_samples, light_seed);
+}
+
+)+R(
+
 bool null(const float4 op)
 {
 	return op.x == -1.f && op.y == 0.f && op.z == 0.f && op.w == 0.f;
@@ -515,32 +1095,60 @@ bool null(const float4 op)
 // ray color.
 // How you can imagine this working is that the kernels work their way up from
 // last reflected/refracted rays to the original, screen rays in reverse order
-// From what ray_kernel did.
-kernel void color_kernel(global float4* cur_level, global float4* next_level) {
+// The w of a color is the weight of its ray for the pixel, so a reflected ray weighs its w divided by that of the ray it came from.
+kernel void color_kernel(global float* cur_level, global float* next_level, const uint half_rays, const uint count) {
 	const uint n = get_global_id(0);
+	if (n >= count) return;
 
 	// Calculates the indices of the reflected and the refracted ray in the cur_level array.
 	const int first = 2 * n;
 	const int second = 2 * n + 1;
 
+	const float4 first_color = load_color(cur_level, first, half_rays);
+	const float4 second_color = load_color(cur_level, second, half_rays);
+	const float4 own_color = load_color(next_level, n, half_rays);
 	float4 add_color;
 
 	// If both rays (or one of them) didn't get calculated (for whatever reason),
 	// We don't have to do any color addition and can simply skip that.
-	if (null(cur_level[first]) && null(cur_level[second]))
+	// Weights too small for half precision can't be divided by.
+	if ((null(first_color) && null(second_color)) || own_color.w <= 0.f)
 		return;
 	// Only refraction
-	else if (null(cur_level[first]))
-		add_color = cur_level[second].w * cur_level[second];
+	else if (null(first_color))
+		add_color = second_color.w / own_color.w * second_color;
 	// Only reflection
-	else if (null(cur_level[second]))
-		add_color = cur_level[first].w * cur_level[first];
+	else if (null(second_color))
+		add_color = first_color.w / own_color.w * first_color;
 	// Both
 	else
-		add_color = color_addition(cur_level[first].w * cur_level[first], cur_level[second].w * cur_level[second]);
+		add_color = color_addition(first_color.w / own_color.w * first_color, second_color.w / own_color.w * second_color);
 	
-	next_level[n] = color_addition(next_level[n], add_color);
+	// The weight stays the one of this ray, the ray above divides by it in turn
+	store_color(next_level, n, (float4) (color_addition(own_color, add_color).xyz, own_color.w), half_rays);
 	//next_level[n] = cur_level[first];
 }
 
+// Adds the colors of a batch of samples to the sums of their pixels, and their squares to measure how much the samples of a pixel vary.
+// The w of a sum counts the samples. The first batch replaces the sums.
+kernel void accumulate_kernel(global float* colors, global float4* sums, global float4* squares, global uint* pixels, const uint count,
+	const uint first, const uint half_rays)
+{
+	const uint n = get_global_id(0);
+	if (n >= count) return;
+	const uint p = pixels == NULL ? n : pixels[n];
+	const float4 c = load_color(colors, n, half_rays);
+	const float4 sample = null(c) ? (float4) (0.f, 0.f, 0.f, 1.f) : (float4) (c.xyz, 1.f);
+	if (first)
+	{
+		sums[p] = sample;
+		squares[p] = sample * sample;
+	}
+	else
+	{
+		sums[p] += sample;
+		squares[p] += sample * sample;
+	}
+}
+
 );} // ############################################################### end of OpenCL C code #####################################################################
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <multirenderer.hpp>
+#include <autotuner.hpp>
+
+using namespace Raytracing;
+
+MultiRenderer::MultiRenderer(const std::vector<Device_Info>& infos, const Interpreter& inp, const Scene& scene, const Shading& shading,
+    const Options& options)
+    : chunksDone(infos.size(), 0), width(static_cast<uint>(inp.variables.at("width"))), chunkRays(static_cast<ulong>(width) * CHUNK_ROWS)
+{
+    const unsigned depth = static_cast<unsigned>(inp.variables.at("raydepth"));
+    for (const Device_Info& info : infos)
+    {
+        devices.push_back(std::unique_ptr<Device>(new Device(info, Renderer::defines(inp, shading, info) + get_opencl_c_code())));
+        renderers.push_back(std::unique_ptr<Renderer>(new Renderer(*devices.back(), scene, shading, chunkRays, depth, options.half, options.sort)));
+        renderers.back()->configure(options, Autotuner::workgroups(*devices.back(), options.retune), width);
+    }
+}
+
+std::vector<cl_float4> MultiRenderer::render(const std::vector<cl_float4>& starts, const std::vector<cl_float4>& dirs)
+{
+    std::vector<cl_float4> res(starts.size());
+    const ulong chunks = (starts.size() + chunkRays - 1) / chunkRays;
+    std::atomic<ulong> next(0);
+    std::fill(chunksDone.begin(), chunksDone.end(), 0);
+
+    // One thread per device takes the next chunk as soon as it is done with the last one. Every thread only uses
+    // its own device and renderer, and writes its own part of the image.
+    std::vector<std::thread> threads;
+    for (size_t d = 0; d < renderers.size(); d++)
+    {
+        threads.emplace_back([&, d]() {
+            Renderer& renderer = *renderers[d];
+            for (ulong chunk = next++; chunk < chunks; chunk = next++)
+            {
+                const ulong first = chunk * chunkRays;
+                const ulong count = std::min<ulong>(chunkRays, starts.size() - first);
+                renderer.setRays(starts.data() + first, dirs.data() + first, count);
+                renderer.render();
+                const std::vector<cl_float4> colors = renderer.colors();
+                std::copy(colors.begin(), colors.begin() + count, res.begin() + first);
+                chunksDone[d]++;
+            }
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    return res;
+}
+
+void MultiRenderer::report() const
+{
+    unsigned total = 0;
+    for (const unsigned c : chunksDone) total += c;
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        print_info("Device " + devices[d]->info.name + " rendered " + std::to_string(chunksDone[d]) + " of " + std::to_string(total)
+            + " chunks (" + std::to_string(total > 0 ? 100 * chunksDone[d] / total : 0) + "%).");
+    }
+}
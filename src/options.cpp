@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include <iostream>
+
+#include <options.hpp>
+
+using namespace Raytracing;
+
+Options Options::parse(int argc, char* argv[])
+{
+    Options res;
+    bool fileGiven = false;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--half") res.half = true;
+        else if (arg == "--sort") res.sort = true;
+        else if (arg == "--sort-benchmark") res.sortBenchmark = true;
+        else if (arg == "--retune") res.retune = true;
+        else if (arg == "--remeasure") res.remeasure = true;
+        else if (arg == "--multi") res.multi = true;
+        else if (arg == "--progressive") res.progressive = true;
+        else if (arg == "--interactive") res.interactive = true;
+        else if (arg == "--watch") res.watch = true;
+        else if ((arg == "--device" || arg == "--select" || arg == "--server" || arg == "--animate" || arg == "--output"
+            || arg == "--format" || arg == "--fps" || arg == "--samples" || arg == "--adaptive"
+            || arg == "--min-weight" || arg == "--roulette" || arg == "--light-samples" || arg == "--passes") && i + 1 < argc)
+        {
+            const std::string value = argv[++i];
+            if (arg == "--device") res.device = value;
+            else if (arg == "--server") res.server = value;
+            else if (arg == "--animate") res.animate = value;
+            else if (arg == "--output") res.output = value;
+            else if (arg == "--format" && (value == "rgb" || value == "rgba" || value == "y4m")) res.format = value;
+            else if (arg == "--fps" && std::atoi(value.c_str()) > 0) res.fps = static_cast<uint>(std::atoi(value.c_str()));
+            else if (arg == "--samples" && std::atoi(value.c_str()) > 0) res.samples = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (arg == "--light-samples" && std::atoi(value.c_str()) > 0) res.lightSamples = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (arg == "--passes" && std::atoi(value.c_str()) > 0) res.passes = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (arg == "--adaptive" && std::atof(value.c_str()) > 0.) res.adaptive = static_cast<float>(std::atof(value.c_str()));
+            else if ((arg == "--min-weight" || arg == "--roulette") && std::atof(value.c_str()) >= 0. && std::atof(value.c_str()) < 1.)
+            {
+                if (arg == "--min-weight") res.minWeight = static_cast<float>(std::atof(value.c_str()));
+                else res.roulette = static_cast<float>(std::atof(value.c_str()));
+            }
+            else if (arg == "--format" || arg == "--fps" || arg == "--samples" || arg == "--adaptive" || arg == "--min-weight" || arg == "--roulette"
+                || arg == "--light-samples" || arg == "--passes")
+            {
+                std::cout << "Invalid value " << value << " for " << arg << std::endl;
+                printUsage();
+                throw Utility::INVALID_OPTION_EXCEPTION;
+            }
+            else if (value == "benchmark" || value == "flops") res.select = value;
+            else
+            {
+                std::cout << "Unknown device selection " << value << std::endl;
+                printUsage();
+                throw Utility::INVALID_OPTION_EXCEPTION;
+            }
+        }
+        else if (arg.rfind("--", 0) != 0 && !fileGiven)
+        {
+            res.file = arg;
+            fileGiven = true;
+        }
+        else
+        {
+            std::cout << "Unknown option " << arg << std::endl;
+            printUsage();
+            throw Utility::INVALID_OPTION_EXCEPTION;
+        }
+    }
+    return res;
+}
+
+void Options::printUsage()
+{
+    std::cout << "Usage: raytracing [file] [options]" << std::endl
+        << "  file              The RTI file to render, input.rti if none is given" << std::endl
+        << "  --half            Store ray directions and colors in half precision and report the error against full precision" << std::endl
+        << "  --sort            Sort rays by direction and origin after every bounce before tracing them" << std::endl
+        << "  --sort-benchmark  Render with and without sorting and print the time of every level" << std::endl
+        << "  --retune          Tune the work group sizes for this device again instead of using the cached ones" << std::endl
+        << "  --device <d>      Render on the device with this id or with d in its name" << std::endl
+        << "  --select <mode>   Choose the fastest device by 'benchmark' (default) or by estimated 'flops'" << std::endl
+        << "  --remeasure       Measure the speed of all devices again instead of using the cached one" << std::endl
+        << "  --multi           Render on all devices at once, or on the ones given by --device as a list like 0,2" << std::endl
+        << "  --progressive     Show a coarse preview right away and refine it in passes until the full image is done" << std::endl
+        << "  --interactive     Show the scene in a window and move the camera with W/A/S/D/R/F and I/J/K/L or the mouse" << std::endl
+        << "  --watch           Like --interactive, and show the changes whenever the file is saved" << std::endl
+        << "  --server <socket> Keep the device and scenes loaded and render jobs sent to this Unix domain socket" << std::endl
+        << "  --animate <keys>  Render every frame of an animation with the camera and object keyframes in this file" << std::endl
+        << "  --output <path>   Where animation frames go, frame_####.png by default. A path ending in .rgb, .rgba or .y4m gets" << std::endl
+        << "                    all frames as one stream, - streams them to stdout and unix:<socket> to a listening Unix socket" << std::endl
+        << "  --format <f>      Stream frames as 'rgb', 'rgba' or 'y4m' regardless of the output's extension" << std::endl
+        << "  --fps <n>         Frames per second written into y4m streams, 30 by default" << std::endl
+        << "  --samples <n>     Trace n jittered rays per pixel and average them to smooth edges, 1 by default" << std::endl
+        << "  --adaptive <t>    With --samples, trace 4 rays per pixel first and all of them only where the colors vary by more than t" << std::endl
+        << "  --min-weight <w>  Don't trace reflections and refractions that add less than w to their pixel, 0 by default" << std::endl
+        << "  --roulette <w>    Trace reflections and refractions adding less than w only by chance, and weigh the ones traced more" << std::endl
+        << "  --light-samples <k> Shade every hit with k lights picked at random by their power and distance instead of all lights" << std::endl
+        << "  --passes <n>      Average at most n passes with --light-samples, fewer once the image stops changing, 64 by default" << std::endl;
+}
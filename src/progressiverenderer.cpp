@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include <progressiverenderer.hpp>
+
+using namespace Raytracing;
+
+ProgressiveRenderer::ProgressiveRenderer(Renderer& renderer, const std::vector<cl_float4>& starts, const std::vector<cl_float4>& dirs,
+    uint width, unsigned depth)
+    : renderer(renderer), starts(starts), dirs(dirs), width(width), height(static_cast<uint>((starts.size() + width - 1) / width)), pass(0),
+    traced(0), colors(starts.size(), cl_float4 { 0.f, 0.f, 0.f, 0.f }), shown(starts.size(), cl_float4 { 0.f, 0.f, 0.f, 0.f })
+{
+    const unsigned preview = std::min(depth, PREVIEW_DEPTH);
+    for (uint stride = FIRST_STRIDE; stride >= 1; stride /= 2) passes.push_back(Pass { stride, preview });
+    if (depth > preview) passes.push_back(Pass { 1, depth });
+}
+
+void ProgressiveRenderer::next()
+{
+    if (done()) return;
+    const Pass& cur = passes[pass];
+    // Pixels traced before with the same depth are kept, they lie on the grid of twice the stride
+    const bool refine = pass > 0 && passes[pass - 1].depth == cur.depth;
+    pixels.clear();
+    for (uint y = 0; y < height; y += cur.stride)
+        for (uint x = 0; x < width; x += cur.stride)
+        {
+            const uint i = y * width + x;
+            if (i >= starts.size()) break;
+            if (refine && x % (2 * cur.stride) == 0 && y % (2 * cur.stride) == 0) continue;
+            pixels.push_back(i);
+        }
+
+    passStarts.resize(pixels.size());
+    passDirs.resize(pixels.size());
+    for (size_t k = 0; k < pixels.size(); k++)
+    {
+        passStarts[k] = starts[pixels[k]];
+        passDirs[k] = dirs[pixels[k]];
+    }
+    if (!pixels.empty())
+    {
+        renderer.setExtent(pixels.size(), cur.depth);
+        renderer.setRays(passStarts.data(), passDirs.data(), pixels.size());
+        renderer.render();
+        const std::vector<cl_float4> res = renderer.colors();
+        for (size_t k = 0; k < pixels.size(); k++) colors[pixels[k]] = res[k];
+    }
+    traced = pixels.size();
+
+    // Every pixel shows the closest traced pixel above and left of it
+    for (uint y = 0; y < height; y++)
+        for (uint x = 0; x < width && y * width + x < shown.size(); x++)
+            shown[y * width + x] = colors[(y - y % cur.stride) * width + x - x % cur.stride];
+
+    pass++;
+    if (done())
+    {
+        renderer.setExtent(starts.size(), passes.back().depth);
+        renderer.setRays(starts, dirs);
+    }
+}
+
+std::string ProgressiveRenderer::describe() const
+{
+    if (pass == 0) return "nothing traced yet";
+    const Pass& last = passes[pass - 1];
+    return "pass " + std::to_string(pass) + " of " + std::to_string(passes.size()) + ", every " + std::to_string(last.stride)
+        + ". pixel with depth " + std::to_string(last.depth) + " (" + std::to_string(traced) + " rays)";
+}
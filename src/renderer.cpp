@@ -0,0 +1,650 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <renderer.hpp>
+
+using namespace Raytracing;
+
+namespace {
+
+    // Creates a device buffer holding a copy of the given host data, empty data still gets a buffer of length 1 because OpenCL can't create empty ones.
+    // A buffer that already has the right length is overwritten instead.
+    template<typename T>
+    void upload(Memory<T>& mem, Device& device, const std::vector<T>& data)
+    {
+        const ulong length = data.size() > 0 ? data.size() : 1;
+        if (mem.length() != length || mem.data() == nullptr) mem = Memory<T>(device, length, 1U, true, true, T {});
+        if (data.empty()) mem[0] = T {};
+        std::copy(data.begin(), data.end(), mem.data());
+        mem.write_to_device();
+    }
+
+    // Writes the runs of elements that differ from the host copy of a buffer, returns the bytes written.
+    // The writes don't block, the caller waits for the queue.
+    template<typename T>
+    ulong update(Memory<T>& mem, Device& device, const std::vector<T>& data)
+    {
+        const ulong length = data.size() > 0 ? data.size() : 1;
+        if (mem.length() != length || mem.data() == nullptr)
+        {
+            upload(mem, device, data);
+            return mem.capacity();
+        }
+        if (data.empty()) return 0;
+        auto same = [&](size_t i) { return std::memcmp(&data[i], mem.data() + i, sizeof(T)) == 0; };
+        ulong written = 0;
+        for (size_t i = 0; i < data.size();)
+        {
+            if (same(i))
+            {
+                i++;
+                continue;
+            }
+            size_t j = i + 1;
+            while (j < data.size() && !same(j)) j++;
+            std::copy(data.begin() + i, data.begin() + j, mem.data() + i);
+            mem.write_to_device(i, j - i, false);
+            written += (j - i) * sizeof(T);
+            i = j;
+        }
+        return written;
+    }
+
+    // Octahedral encoding of a direction, has to match oct_encode in the kernel
+    void octEncode(const cl_float4& d, float& u, float& v)
+    {
+        const float sum = std::fabs(d.s[0]) + std::fabs(d.s[1]) + std::fabs(d.s[2]);
+        u = d.s[0] / sum;
+        v = d.s[1] / sum;
+        if (d.s[2] < 0.f)
+        {
+            const float x = u, y = v;
+            u = (1.f - std::fabs(y)) * (x >= 0.f ? 1.f : -1.f);
+            v = (1.f - std::fabs(x)) * (y >= 0.f ? 1.f : -1.f);
+        }
+    }
+
+}
+
+Renderer::Renderer(Device& device, const Scene& scene, const Shading& shading, ulong rays, unsigned depth, bool half, bool sort)
+    : timings(depth, LevelTiming { 0., 0., 0., 0., 0. }), sampledRays(0), device(device), half(half), sort(sort && depth > 1),
+    materialCount(0), floatsPerRay(half ? 2u : 4u),
+    starts(depth), dirs(depth), colorLevels(depth), minWeight(DEFAULT_MIN_WEIGHT), roulette(0.f), lightSamples(0), lightSeed(0),
+    sortLo { 0.f, 0.f, 0.f, 0.f }, sortScale { 0.f, 0.f, 0.f, 0.f },
+    extentRays(rays), extentDepth(depth), timed(true)
+{
+    // The sort kernels are written for work groups of exactly SORT_BLOCK items, so unlike the others they can't be made smaller.
+    // Every level is binned by material with them, not only sorted rays.
+    for (const char* kernel : { "sort_histogram_kernel", "sort_scan_kernel", "sort_scatter_kernel" })
+    {
+        if (fit(kernel, SORT_BLOCK) < SORT_BLOCK)
+            print_error("The device can't run " + std::string(kernel) + " with work groups of " + std::to_string(SORT_BLOCK)
+                + " items, which sorting and binning rays by material need.");
+    }
+    setScene(scene, shading);
+
+    for (unsigned i = 0; i < depth; i++)
+    {
+        const ulong count = rays << i;
+        starts[i] = Memory<cl_float4>(device, count, 1U, true, true, cl_float4 {0.f, 0.f, 0.f, 0.f});
+        dirs[i] = Memory<float>(device, count * floatsPerRay, 1U, true, true, 0.f);
+        colorLevels[i] = Memory<float>(device, count * floatsPerRay, 1U, true, true, 0.f);
+    }
+
+    // Hit records, keys and indices are only needed for one level at a time, so they are sized for the largest one
+    const ulong count = rays << (depth - 1);
+    const ulong blocks = (count + SORT_BLOCK - 1) / SORT_BLOCK;
+    hits = Memory<cl_float4>(device, 2 * count, 1U, false, true, cl_float4 {0.f, 0.f, 0.f, 0.f});
+    keys = Memory<cl_uint>(device, count, 1U, false, true, 0u);
+    order = Memory<cl_uint>(device, count, 1U, false, true, 0u);
+    sortedKeys = Memory<cl_uint>(device, count, 1U, false, true, 0u);
+    sortedOrder = Memory<cl_uint>(device, count, 1U, false, true, 0u);
+    hist = Memory<cl_uint>(device, SORT_RADIX * blocks, 1U, false, true, 0u);
+}
+
+void Renderer::setScene(const Scene& scene, const Shading& shading)
+{
+    upload(primitives, device, scene.primitives);
+    upload(primInfo, device, scene.primInfo);
+    upload(complexInfo, device, scene.complexInfo);
+    upload(prototypes, device, scene.prototypes);
+    upload(instances, device, scene.instances);
+    upload(instanceProtos, device, scene.instanceProtos);
+    upload(bvhNodes, device, scene.bvhNodes);
+    upload(materials, device, shading.materials);
+    upload(lights, device, shading.lights);
+    upload(lightNodes, device, shading.lightNodes);
+    upload(lightTree, device, shading.lightTree);
+    upload(lightOrder, device, shading.lightOrder);
+    upload(header, device, std::vector<SceneHeader> { shading.header });
+    materialCount = static_cast<uint>(shading.materials.size());
+    setSortBounds(scene);
+}
+
+ulong Renderer::updateScene(const Scene& scene, const Shading& shading)
+{
+    ulong written = update(primitives, device, scene.primitives);
+    written += update(primInfo, device, scene.primInfo);
+    written += update(complexInfo, device, scene.complexInfo);
+    written += update(prototypes, device, scene.prototypes);
+    written += update(instances, device, scene.instances);
+    written += update(instanceProtos, device, scene.instanceProtos);
+    written += update(bvhNodes, device, scene.bvhNodes);
+    written += update(materials, device, shading.materials);
+    written += update(lights, device, shading.lights);
+    written += update(lightNodes, device, shading.lightNodes);
+    written += update(lightTree, device, shading.lightTree);
+    written += update(lightOrder, device, shading.lightOrder);
+    written += update(header, device, std::vector<SceneHeader> { shading.header });
+    header.finish();
+    materialCount = static_cast<uint>(shading.materials.size());
+    setSortBounds(scene);
+    return written;
+}
+
+void Renderer::updateInstances(const Scene& scene, bool rebuilt)
+{
+    if (rebuilt)
+    {
+        upload(instances, device, scene.instances);
+        upload(instanceProtos, device, scene.instanceProtos);
+        upload(bvhNodes, device, scene.bvhNodes);
+        header[0].unbounded = scene.unbounded;
+        header[0].nodes = scene.nodeCount();
+        header.write_to_device();
+    }
+    else
+    {
+        // Neighbouring instances and nodes are written together, every instance is three and every node two float4
+        auto write = [](Memory<cl_float4>& mem, const std::vector<cl_float4>& data, std::vector<unsigned> changed, unsigned stride) {
+            std::sort(changed.begin(), changed.end());
+            for (size_t i = 0; i < changed.size();)
+            {
+                size_t j = i + 1;
+                while (j < changed.size() && changed[j] == changed[j - 1] + 1) j++;
+                const ulong offset = static_cast<ulong>(changed[i]) * stride;
+                const ulong length = static_cast<ulong>(changed[j - 1] - changed[i] + 1) * stride;
+                std::copy(data.begin() + offset, data.begin() + offset + length, mem.data() + offset);
+                mem.write_to_device(offset, length, false);
+                i = j;
+            }
+        };
+        write(instances, scene.instances, scene.changedInstances, 3);
+        write(bvhNodes, scene.bvhNodes, scene.changedNodes, 2);
+        instances.finish();
+    }
+    setSortBounds(scene);
+}
+
+void Renderer::setSortBounds(const Scene& scene)
+{
+    // Bounced rays start on a surface, so origins are quantized within the bounds of the hierarchy for sorting them.
+    // Origins on unbounded primitives outside of it are clamped to its sides, which only makes the key less precise.
+    sortLo = cl_float4 { 0.f, 0.f, 0.f, 0.f };
+    sortScale = cl_float4 { 0.f, 0.f, 0.f, 0.f };
+    if (this->sort && scene.nodeCount() > 0)
+    {
+        const cl_float4& lo = scene.bvhNodes[0];
+        const cl_float4& hi = scene.bvhNodes[1];
+        for (unsigned a = 0; a < 3; a++)
+        {
+            sortLo.s[a] = lo.s[a];
+            sortScale.s[a] = hi.s[a] > lo.s[a] ? 255.f / (hi.s[a] - lo.s[a]) : 0.f;
+        }
+    }
+}
+
+void Renderer::setRays(const std::vector<cl_float4>& rayStarts, const std::vector<cl_float4>& rayDirs)
+{
+    setRays(rayStarts.data(), rayDirs.data(), rayStarts.size());
+}
+
+void Renderer::setRays(const cl_float4* rayStarts, const cl_float4* rayDirs, size_t count)
+{
+    // Rays past the given ones are zeroed, which marks them as not existing
+    const size_t extent = static_cast<size_t>(extentRays);
+    count = std::min<size_t>(count, extent);
+    std::copy(rayStarts, rayStarts + count, starts[0].data());
+    std::fill(starts[0].data() + count, starts[0].data() + extent, cl_float4 {0.f, 0.f, 0.f, 0.f});
+    if (half)
+    {
+        // Two halves for the encoded direction, one for the refraction index and a one marking the ray as used
+        ushort* h = reinterpret_cast<ushort*>(dirs[0].data());
+        for (size_t i = 0; i < count; i++)
+        {
+            float u, v;
+            octEncode(rayDirs[i], u, v);
+            h[4 * i + 0] = float_to_half(u);
+            h[4 * i + 1] = float_to_half(v);
+            h[4 * i + 2] = float_to_half(rayDirs[i].s[3]);
+            h[4 * i + 3] = float_to_half(1.f);
+        }
+    }
+    else std::copy(&rayDirs[0].s[0], &rayDirs[0].s[0] + 4 * count, dirs[0].data());
+    std::fill(dirs[0].data() + count * floatsPerRay, dirs[0].data() + extent * floatsPerRay, 0.f);
+    starts[0].write_to_device(0, extent);
+    dirs[0].write_to_device(0, extent * floatsPerRay);
+}
+
+void Renderer::setCamera(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY, uint width)
+{
+    generateRays(eye, corner, stepX, stepY, width, 0, false);
+}
+
+void Renderer::generateRays(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY, uint width,
+    unsigned sample, bool listed)
+{
+    // Every sample picks other lights
+    lightSeed = sample;
+    // Only four vectors go to the device, the queue runs the kernel before the next render
+    Kernel camera_kernel(device, extentRays, "camera_kernel", starts[0], dirs[0], eye, corner, stepX, stepY, width,
+        static_cast<uint>(extentRays), static_cast<uint>(half), NULL, static_cast<uint>(sample));
+    if (listed) camera_kernel.set_parameters(9, samplePixels);
+    camera_kernel.enqueue();
+}
+
+void Renderer::accumulate(bool first, bool listed)
+{
+    Kernel accumulate_kernel(device, extentRays, "accumulate_kernel", colorLevels[0], sampleSums, sampleSquares, NULL,
+        static_cast<uint>(extentRays), static_cast<uint>(first), static_cast<uint>(half));
+    if (listed) accumulate_kernel.set_parameters(3, samplePixels);
+    launch(accumulate_kernel);
+}
+
+std::vector<cl_float4> Renderer::renderSamples(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY,
+    uint width, unsigned samples, float threshold)
+{
+    const ulong pixels = starts[0].length();
+    const unsigned depth = extentDepth;
+    samples = std::max(1u, samples);
+
+    // Every pixel gets the first samples
+    const bool adaptive = threshold > 0.f && samples > ADAPTIVE_BASE_SAMPLES;
+    const unsigned base = adaptive ? ADAPTIVE_BASE_SAMPLES : samples;
+    for (unsigned s = 0; s < base; s++) addPass(eye, corner, stepX, stepY, width, s);
+    sampledRays = pixels * base;
+
+    if (adaptive)
+    {
+        sampleSums.read_from_device();
+        sampleSquares.read_from_device();
+        if (samplePixels.length() != pixels) samplePixels = Memory<cl_uint>(device, pixels, 1U, true, true, 0u);
+        auto mean = [&](ulong p) {
+            const cl_float4& s = sampleSums[p];
+            return cl_float4 { s.s[0] / s.s[3], s.s[1] / s.s[3], s.s[2] / s.s[3], 1.f };
+        };
+        // A pixel gets more samples if its samples deviate from their mean, or its mean differs from the pixel right of or below it
+        std::vector<bool> refine(pixels, false);
+        for (ulong p = 0; p < pixels; p++)
+        {
+            const cl_float4 m = mean(p);
+            for (unsigned c = 0; c < 3; c++)
+            {
+                const float variance = sampleSquares[p].s[c] / sampleSums[p].s[3] - m.s[c] * m.s[c];
+                if (variance > threshold * threshold) refine[p] = true;
+            }
+            for (const ulong q : { p + 1, p + width })
+            {
+                if (q >= pixels || (q == p + 1 && q % width == 0)) continue;
+                const cl_float4 n = mean(q);
+                for (unsigned c = 0; c < 3; c++)
+                    if (std::fabs(m.s[c] - n.s[c]) > threshold) refine[p] = refine[q] = true;
+            }
+        }
+        ulong listed = 0;
+        for (ulong p = 0; p < pixels; p++)
+            if (refine[p]) samplePixels[listed++] = static_cast<cl_uint>(p);
+        if (listed > 0)
+        {
+            samplePixels.write_to_device(0, listed);
+            setExtent(listed, depth);
+            for (unsigned s = base; s < samples; s++)
+            {
+                generateRays(eye, corner, stepX, stepY, width, s, true);
+                render();
+                accumulate(false, true);
+            }
+            sampledRays += listed * (samples - base);
+        }
+        setExtent(pixels, depth);
+    }
+    // Later renders trace through the pixel centers again
+    generateRays(eye, corner, stepX, stepY, width, 0, false);
+
+    double error;
+    return passAverage(error);
+}
+
+void Renderer::addPass(const cl_float4& eye, const cl_float4& corner, const cl_float4& stepX, const cl_float4& stepY, uint width, unsigned pass)
+{
+    const ulong pixels = starts[0].length();
+    if (sampleSums.length() != pixels)
+    {
+        sampleSums = Memory<cl_float4>(device, pixels, 1U, true, true, cl_float4 {0.f, 0.f, 0.f, 0.f});
+        sampleSquares = Memory<cl_float4>(device, pixels, 1U, true, true, cl_float4 {0.f, 0.f, 0.f, 0.f});
+    }
+    setExtent(pixels, extentDepth);
+    generateRays(eye, corner, stepX, stepY, width, pass, false);
+    render();
+    accumulate(pass == 0, false);
+}
+
+std::vector<cl_float4> Renderer::passAverage(double& error)
+{
+    const ulong pixels = starts[0].length();
+    sampleSums.read_from_device();
+    sampleSquares.read_from_device();
+    std::vector<cl_float4> res(pixels);
+    error = 0.;
+    for (ulong p = 0; p < pixels; p++)
+    {
+        const cl_float4& s = sampleSums[p];
+        const float n = s.s[3];
+        res[p] = { s.s[0] / n, s.s[1] / n, s.s[2] / n, 1.f };
+        // The variance of the samples divided by their amount is the variance of their average
+        for (unsigned c = 0; c < 3; c++)
+            error += std::sqrt(std::max(0.f, sampleSquares[p].s[c] / n - res[p].s[c] * res[p].s[c]) / n);
+    }
+    error /= 3. * static_cast<double>(std::max<ulong>(1, pixels));
+    return res;
+}
+
+void Renderer::setExtent(ulong rays, unsigned depth)
+{
+    extentRays = std::min(rays, starts[0].length());
+    extentDepth = std::max(1u, std::min(depth, static_cast<unsigned>(starts.size())));
+}
+
+void Renderer::setTermination(float minWeight, float roulette)
+{
+    this->minWeight = std::max(0.f, minWeight);
+    this->roulette = std::max(0.f, roulette);
+}
+
+void Renderer::setLightSampling(unsigned samples)
+{
+    lightSamples = samples;
+}
+
+void Renderer::configure(const Options& options, const Workgroups& sizes, uint width)
+{
+    setWorkgroups(sizes, width);
+    setTermination(options.minWeight, options.roulette);
+    setLightSampling(options.lightSamples);
+}
+
+void Renderer::setWorkgroups(const Workgroups& sizes, uint width)
+{
+    workgroups.intersect = fit("intersect_kernel", sizes.intersect);
+    workgroups.shade = fit("shade_kernel", sizes.shade);
+    workgroups.color = fit("color_kernel", sizes.color);
+    workgroups.tileWidth = sizes.tileWidth;
+    workgroups.tileHeight = sizes.tileHeight;
+    // Tiles that don't fit are made flatter until they do
+    const uint primary = fit("intersect_kernel", sizes.tileWidth * sizes.tileHeight);
+    while (workgroups.tileWidth * workgroups.tileHeight > primary)
+    {
+        if (workgroups.tileHeight > 1) workgroups.tileHeight /= 2;
+        else workgroups.tileWidth /= 2;
+    }
+    if (workgroups.tileHeight <= 1) return;
+
+    // Tiles are stored one after another, each one row by row. Tiles at the right and bottom border are cut off.
+    const uint count = static_cast<uint>(starts[0].length());
+    const uint height = (count + width - 1) / width;
+    tileOrder = Memory<cl_uint>(device, count, 1U, true, true, 0u);
+    uint k = 0;
+    for (uint ty = 0; ty < height; ty += workgroups.tileHeight)
+        for (uint tx = 0; tx < width; tx += workgroups.tileWidth)
+            for (uint y = ty; y < std::min(ty + workgroups.tileHeight, height); y++)
+                for (uint x = tx; x < std::min(tx + workgroups.tileWidth, width); x++)
+                    if (y * width + x < count) tileOrder[k++] = y * width + x;
+    tileOrder.write_to_device();
+}
+
+uint Renderer::fit(const std::string& kernel, uint size) const
+{
+    const ulong max = cl::Kernel(device.get_cl_program(), kernel.c_str()).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device.info.cl_device);
+    while (size > 1 && size > max) size /= 2;
+    return size;
+}
+
+void Renderer::render()
+{
+    timed = true;
+    trace();
+}
+
+void Renderer::enqueueRender()
+{
+    // Enqueueing takes no time worth reporting, so the timings of the last timed render are kept
+    const std::vector<LevelTiming> kept = timings;
+    timed = false;
+    trace();
+    timings = kept;
+}
+
+void Renderer::readColors(std::vector<float>& raw, cl::Event& done)
+{
+    raw.resize(colorLevels[0].range());
+    cl::CommandQueue queue = device.get_cl_queue();
+    queue.enqueueReadBuffer(colorLevels[0].get_cl_buffer(), false, 0, colorLevels[0].capacity(), raw.data(), nullptr, &done);
+    // Submit everything enqueued so far, the device must not wait for the next frame to be enqueued
+    queue.flush();
+}
+
+std::vector<cl_float4> Renderer::decodeColors(const float* raw, size_t count, bool half)
+{
+    std::vector<cl_float4> res(count);
+    if (half)
+    {
+        const ushort* h = reinterpret_cast<const ushort*>(raw);
+        for (size_t i = 0; i < res.size(); i++)
+            res[i] = { half_to_float(h[4 * i]), half_to_float(h[4 * i + 1]), half_to_float(h[4 * i + 2]), half_to_float(h[4 * i + 3]) };
+    }
+    else std::copy(raw, raw + 4 * count, &res[0].s[0]);
+    return res;
+}
+
+void Renderer::launch(Kernel& kernel) const
+{
+    if (timed) kernel.run();
+    else kernel.enqueue();
+}
+
+void Renderer::trace()
+{
+    const unsigned depth = extentDepth;
+    for (unsigned i = 0; i < depth; i++)
+    {
+        Kernel clear_kernel(device, levelCount(i), "clear_kernel", starts[i], dirs[i], colorLevels[i],
+            levelCount(i), static_cast<uint>(i == 0), static_cast<uint>(half));
+        launch(clear_kernel);
+    }
+
+    Clock clock;
+    for (unsigned i = 0; i < depth; i++)
+    {
+        const uint count = levelCount(i);
+        // Primary rays are coherent already
+        const bool sorted = sort && i > 0;
+        clock.start();
+        if (sorted) sortLevel(i);
+        timings[i].sort = clock.stop();
+
+        // Primary rays are traced tile by tile if a tile shape is set, one tile per work group. The tiles cover all rays, not an extent.
+        const bool tiled = i == 0 && workgroups.tileHeight > 1 && extentRays == starts[0].length();
+        const uint intersectGroup = i == 0 && extentRays == starts[0].length() ? workgroups.tileWidth * workgroups.tileHeight : workgroups.intersect;
+
+        // Unsorted rays don't have an order, so they're passed a nullpointer.
+        clock.start();
+        Kernel intersect_kernel(device, count, intersectGroup, "intersect_kernel", starts[i], dirs[i], hits,
+            primitives, primInfo, complexInfo, prototypes, instances, instanceProtos, bvhNodes,
+            header, static_cast<uint>(half), count, NULL);
+        if (sorted) intersect_kernel.set_parameters(13, order);
+        if (tiled) intersect_kernel.set_parameters(13, tileOrder);
+        launch(intersect_kernel);
+        timings[i].intersect = clock.stop();
+
+        clock.start();
+        Memory<cl_uint>& binned = binLevel(i, sorted, tiled);
+        timings[i].bin = clock.stop();
+
+        // The last rays in the reflection hierarchy don't create further rays, so they're passed a nullpointer.
+        clock.start();
+        Kernel shade_kernel(device, count, workgroups.shade, "shade_kernel",
+            starts[i], dirs[i], NULL, NULL, colorLevels[i], hits,
+            header, primitives, primInfo, complexInfo,
+            prototypes, instances, instanceProtos, bvhNodes, materials, lights, lightNodes, lightTree, lightOrder,
+            static_cast<uint>(half), count, binned, minWeight, roulette, lightSamples, lightSeed);
+        if (i + 1 < depth) shade_kernel.set_parameters(2, starts[i + 1], dirs[i + 1]);
+        launch(shade_kernel);
+        timings[i].shade = clock.stop();
+    }
+
+    for (unsigned i = depth - 1; i > 0; i--)
+    {
+        const uint count = levelCount(i - 1);
+        clock.start();
+        Kernel color_kernel(device, count, workgroups.color, "color_kernel", colorLevels[i], colorLevels[i - 1], static_cast<uint>(half), count);
+        launch(color_kernel);
+        timings[i].color = clock.stop();
+    }
+}
+
+void Renderer::sortLevel(unsigned level)
+{
+    const uint count = levelCount(level);
+    Kernel key_kernel(device, count, "sort_key_kernel", starts[level], dirs[level], keys, order,
+        sortLo, sortScale, count, static_cast<uint>(half));
+    launch(key_kernel);
+    // The keys use all 32 bits, which is an even amount of passes, so the result ends up in order
+    radixSort(count, 32);
+}
+
+Memory<cl_uint>& Renderer::binLevel(unsigned level, bool sorted, bool tiled)
+{
+    const uint count = levelCount(level);
+    // Keys are 0 for the sky, the material + 1 for hits and the highest key for rays that don't exist
+    uint bits = 1;
+    while ((1u << bits) < materialCount + 2) bits++;
+    const uint deadKey = (1u << bits) - 1;
+    // Sorted rays keep their order, others start out in the order they were intersected in
+    Kernel bin_key_kernel(device, count, "bin_key_kernel", hits, primInfo, keys, order, NULL, count, deadKey, static_cast<uint>(!sorted));
+    if (tiled) bin_key_kernel.set_parameters(4, tileOrder);
+    launch(bin_key_kernel);
+    return radixSort(count, bits);
+}
+
+Memory<cl_uint>& Renderer::radixSort(uint count, uint bits)
+{
+    const uint blocks = (count + SORT_BLOCK - 1) / SORT_BLOCK;
+    // Every pass sorts by the next digit and swaps the buffers
+    bool even = true;
+    for (uint shift = 0; shift < bits; shift += SORT_BITS)
+    {
+        Memory<cl_uint>& fromKeys = even ? keys : sortedKeys;
+        Memory<cl_uint>& fromOrder = even ? order : sortedOrder;
+        Memory<cl_uint>& toKeys = even ? sortedKeys : keys;
+        Memory<cl_uint>& toOrder = even ? sortedOrder : order;
+        Kernel histogram(device, count, SORT_BLOCK, "sort_histogram_kernel", fromKeys, hist, count, shift);
+        launch(histogram);
+        Kernel scan(device, SORT_BLOCK, SORT_BLOCK, "sort_scan_kernel", hist, SORT_RADIX * blocks);
+        launch(scan);
+        Kernel scatter(device, count, SORT_BLOCK, "sort_scatter_kernel", fromKeys, fromOrder, toKeys, toOrder, hist, count, shift);
+        launch(scatter);
+        even = !even;
+    }
+    return even ? order : sortedOrder;
+}
+
+std::vector<cl_float4> Renderer::colors()
+{
+    colorLevels[0].read_from_device(0, extentRays * floatsPerRay);
+    return decodeColors(colorLevels[0].data(), extentRays, half);
+}
+
+std::string Renderer::defines(const Interpreter& inp, const Shading& shading, const Device_Info& info, bool shareable)
+{
+    // The csg traversal keeps one stack frame per level of the csg tree in private memory, so its size has to be known when compiling
+    uint stack = std::max(1u, inp.tree_height);
+    if (shareable)
+    {
+        uint rounded = MIN_SHARED_STACK;
+        while (rounded < stack) rounded <<= 1;
+        stack = rounded;
+    }
+    std::string res = "\n#define CSG_STACK_SIZE " + std::to_string(stack);
+    // Materials and lights are only read, so they go to constant memory if there is enough of it
+    if (shading.fitsConstant(info)) res += "\n#define SHADING_SPACE constant";
+    else
+    {
+        res += "\n#define SHADING_SPACE global";
+        print_warning("Materials and lights don't fit into constant memory (" + std::to_string(shading.tableBytes()) + " bytes), they are kept in global memory.");
+    }
+    return res;
+}
+
+ulong Renderer::rayBytes(ulong rays, unsigned depth, bool half)
+{
+    // Origins are always float4, directions and colors are two float4 or two half4
+    const ulong perRay = sizeof(cl_float4) + 2 * (half ? 4 * sizeof(ushort) : sizeof(cl_float4));
+    // Hit records are two float4 per ray of the largest level
+    return perRay * ((rays << depth) - rays) + 2 * sizeof(cl_float4) * (rays << (depth - 1));
+}
+
+ulong Renderer::sortBytes(ulong rays, unsigned depth)
+{
+    const ulong count = rays << (depth - 1);
+    // Two key and two index buffers for the largest level and the digit counts of its blocks
+    return 4 * count * sizeof(cl_uint) + SORT_RADIX * ((count + SORT_BLOCK - 1) / SORT_BLOCK) * sizeof(cl_uint);
+}
+
+void Renderer::reportError(const std::vector<cl_float4>& image, const std::vector<cl_float4>& reference)
+{
+    double squared = 0., maximum = 0.;
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        for (unsigned c = 0; c < 3; c++)
+        {
+            const double e = std::fabs(static_cast<double>(image[i].s[c]) - reference[i].s[c]);
+            squared += e * e;
+            maximum = std::max(maximum, e);
+        }
+    }
+    const double rmse = image.empty() ? 0. : std::sqrt(squared / (3. * image.size()));
+    const std::string psnr = rmse > 0. ? std::to_string(20. * std::log10(1. / rmse)) + " dB" : "infinite";
+    print_info("Error against full precision: RMSE " + std::to_string(rmse) + ", max " + std::to_string(maximum)
+        + " (" + std::to_string(static_cast<int>(std::ceil(maximum * 255.))) + "/255), PSNR " + psnr + ".");
+}
+
+void Renderer::reportSortTimings(const Renderer& unsorted, const Renderer& sorted)
+{
+    double unsortedTotal = 0., sortedTotal = 0.;
+    for (size_t i = 0; i < unsorted.timings.size() && i < sorted.timings.size(); i++)
+    {
+        const LevelTiming& u = unsorted.timings[i];
+        const LevelTiming& s = sorted.timings[i];
+        unsortedTotal += u.total();
+        sortedTotal += s.total();
+        print_info("Level " + std::to_string(i) + ": " + std::to_string(1e3 * u.total()) + " ms unsorted, "
+            + std::to_string(1e3 * (s.total() - s.sort)) + " ms sorted + " + std::to_string(1e3 * s.sort) + " ms sorting.");
+    }
+    print_info("Total: " + std::to_string(1e3 * unsortedTotal) + " ms unsorted, " + std::to_string(1e3 * sortedTotal) + " ms sorted, sorting "
+        + (sortedTotal < unsortedTotal ? "pays off" : "doesn't pay off") + " for this scene.");
+}
+
+void Renderer::reportKernels() const
+{
+    const std::vector<std::string> names = { "intersect_kernel", "shade_kernel", "bin_key_kernel" };
+    for (const std::string& name : names)
+    {
+        cl::Kernel kernel(device.get_cl_program(), name.c_str());
+        const cl::Device& cl_device = device.info.cl_device;
+        print_info(name + ": " + std::to_string(kernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(cl_device)) + " bytes private, "
+            + std::to_string(kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(cl_device)) + " bytes local, max work group size "
+            + std::to_string(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cl_device)) + ", preferred multiple "
+            + std::to_string(kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(cl_device)) + ".");
+    }
+}
@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include <renderserver.hpp>
+#include <autotuner.hpp>
+#include <deviceselector.hpp>
+
+using namespace Raytracing;
+
+#ifdef _WIN32
+
+RenderServer::RenderServer(const std::string& path, const Options& options)
+    : path(path), options(options), info(), listener(-1), versions(0), rendererDevice(nullptr), rendererRays(0), rendererDepth(0),
+    rendererWidth(0), rendererVersion(0), stopping(false)
+{
+    print_error("The render server needs Unix domain sockets, which this build doesn't support.");
+}
+
+RenderServer::~RenderServer() {}
+
+void RenderServer::run() {}
+
+#else
+
+namespace {
+
+    // Connections waiting to be accepted
+    const int BACKLOG = 16;
+    // Largest inline scene, image side and ray depth a job may ask for, so a single request can't exhaust the memory of the server
+    const double MAX_INLINE_BYTES = 64.0 * 1024.0 * 1024.0;
+    const double MAX_IMAGE_SIZE = 16384.0;
+    const double MAX_DEPTH = 24.0;
+
+    // Reads a line without its line break, returns false if the connection was closed before
+    bool readLine(int client, std::string& line)
+    {
+        line.clear();
+        char c;
+        while (true)
+        {
+            const ssize_t n = recv(client, &c, 1, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return !line.empty();
+            if (c == '\n') break;
+            if (c != '\r') line += c;
+        }
+        return true;
+    }
+
+    // Reads exactly size bytes, returns false if the connection was closed before
+    bool readBytes(int client, std::string& data, size_t size)
+    {
+        data.resize(size);
+        size_t done = 0;
+        while (done < size)
+        {
+            const ssize_t n = recv(client, &data[done], size - done, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Sends all bytes, a client that closed the connection early only loses its reply
+    void sendAll(int client, const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t n = send(client, data, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    void sendLine(int client, const std::string& line)
+    {
+        const std::string text = line + "\n";
+        sendAll(client, text.data(), text.size());
+    }
+
+    double number(const std::string& value)
+    {
+        try
+        {
+            return std::stod(value);
+        }
+        catch (std::exception&)
+        {
+            throw Utility::WRONG_FORMAT_EXCEPTION;
+        }
+    }
+
+    // Checks that a size is a whole number between 0 and max, NaN fails both comparisons
+    double checkedSize(double value, double max)
+    {
+        if (!(value >= 0.0 && value <= max) || std::floor(value) != value) throw Utility::WRONG_FORMAT_EXCEPTION;
+        return value;
+    }
+
+}
+
+RenderServer::RenderServer(const std::string& path, const Options& options)
+    : path(path), options(options), info(DeviceSelector::select(options.device, options.select, options.remeasure)), listener(-1),
+    versions(0), rendererDevice(nullptr), rendererRays(0), rendererDepth(0), rendererWidth(0), rendererVersion(0), stopping(false)
+{
+    // A client closing its connection before the reply was sent must not end the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) print_error("The socket path " + path + " is too long.");
+    std::strcpy(address.sun_path, path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) print_error("Can't create a socket.");
+    // A server that didn't shut down properly leaves its socket file behind
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listener, BACKLOG) < 0)
+        print_error("Can't listen on " + path + ".");
+}
+
+RenderServer::~RenderServer()
+{
+    if (listener >= 0)
+    {
+        close(listener);
+        unlink(path.c_str());
+    }
+}
+
+void RenderServer::run()
+{
+    // Jobs are read here and rendered by the worker, so clients can queue jobs while another one is traced
+    std::thread worker(&RenderServer::work, this);
+    print_info("Waiting for render jobs on " + path + "...");
+    while (true)
+    {
+        const int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR) continue;
+            print_warning("Can't accept connections on " + path + " anymore.");
+            break;
+        }
+        Job job;
+        job.client = client;
+        try
+        {
+            if (!readJob(client, job))
+            {
+                sendLine(client, "ok");
+                close(client);
+                break;
+            }
+        }
+        catch (Utility::Exception e)
+        {
+            sendLine(client, "error " + e.description);
+            close(client);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            queue.push_back(std::move(job));
+        }
+        queueChanged.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_one();
+    worker.join();
+    print_info("Render server stopped.");
+}
+
+bool RenderServer::readJob(int client, Job& job) const
+{
+    size_t inlineBytes = 0;
+    bool hasInline = false;
+    std::string line;
+    while (readLine(client, line) && !line.empty() && line != "end")
+    {
+        std::istringstream in(line);
+        std::string key;
+        std::vector<std::string> values;
+        in >> key;
+        for (std::string value; in >> value;) values.push_back(value);
+
+        if (key == "quit") return false;
+        else if (key == "scene" && values.size() == 1) job.scenePath = values[0];
+        else if (key == "output" && values.size() == 1) job.output = values[0];
+        else if (key == "inline" && values.size() == 1)
+        {
+            inlineBytes = static_cast<size_t>(checkedSize(number(values[0]), MAX_INLINE_BYTES));
+            hasInline = true;
+        }
+        else if ((key == "width" || key == "height") && values.size() == 1) job.overrides[key] = checkedSize(number(values[0]), MAX_IMAGE_SIZE);
+        else if (key == "raydepth" && values.size() == 1) job.overrides[key] = checkedSize(number(values[0]), MAX_DEPTH);
+        else if ((key == "eyepos" || key == "lookat") && values.size() == 3)
+        {
+            job.overrides[key + "_x"] = number(values[0]);
+            job.overrides[key + "_y"] = number(values[1]);
+            job.overrides[key + "_z"] = number(values[2]);
+        }
+        else throw Utility::WRONG_FORMAT_EXCEPTION;
+    }
+    // A job renders exactly one scene
+    if (hasInline == !job.scenePath.empty()) throw Utility::WRONG_FORMAT_EXCEPTION;
+    if (hasInline && !readBytes(client, job.sceneContent, inlineBytes)) throw Utility::WRONG_FORMAT_EXCEPTION;
+    return true;
+}
+
+void RenderServer::work()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this]() { return stopping || !queue.empty(); });
+            // Jobs queued before quitting are still rendered
+            if (queue.empty()) return;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        try
+        {
+            process(job);
+        }
+        catch (Utility::Exception e)
+        {
+            sendLine(job.client, "error " + e.description);
+        }
+        // A job too large for the memory of the host fails on its own instead of ending the server
+        catch (std::bad_alloc&)
+        {
+            sendLine(job.client, "error Not enough memory for the job.");
+        }
+        close(job.client);
+    }
+}
+
+void RenderServer::process(Job& job)
+{
+    Clock clock;
+    std::unique_ptr<LoadedScene> inlineScene;
+    LoadedScene& loaded = load(job, inlineScene);
+
+    // Rays only have to be created again if the camera or the size of the image changed
+    std::map<std::string, double> variables = loaded.variables;
+    for (auto& i : job.overrides) variables[i.first] = i.second;
+    // The scene itself may ask for sizes no override would be allowed to either
+    const uint width = static_cast<uint>(checkedSize(variables["width"], MAX_IMAGE_SIZE));
+    const uint height = static_cast<uint>(checkedSize(variables["height"], MAX_IMAGE_SIZE));
+    const unsigned depth = static_cast<unsigned>(checkedSize(variables["raydepth"], MAX_DEPTH));
+    if (width < 2 || height < 2 || depth < 1) throw Utility::WRONG_FORMAT_EXCEPTION;
+    if (variables != loaded.rayVariables)
+    {
+        loaded.inp.setVariables(variables);
+        const size_t count = loaded.inp.rays.size();
+        loaded.rayStarts.resize(count);
+        loaded.rayDirs.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const Ray& ray = *loaded.inp.rays[i];
+            loaded.rayStarts[i] = { (float)ray.start.x(), (float)ray.start.y(), (float)ray.start.z(), 1.f };
+            loaded.rayDirs[i] = { (float)ray.dir.x(), (float)ray.dir.y(), (float)ray.dir.z(), 1.f };
+        }
+        loaded.rayVariables = variables;
+    }
+
+    Device& device = deviceFor(loaded);
+    if (!workgroups) workgroups.reset(new Workgroups(Autotuner::workgroups(device, options.retune)));
+    const ulong rays = loaded.rayStarts.size();
+    if (!renderer || rendererDevice != &device || rendererRays != rays || rendererDepth != depth || rendererWidth != width)
+    {
+        // The buffers of the old renderer go back to the pool before allocating new ones, a pool of another program's device
+        // won't be used for a while and is emptied
+        renderer.reset();
+        if (rendererDevice != nullptr && rendererDevice != &device) rendererDevice->pool.trim();
+        renderer.reset(new Renderer(device, loaded.scene, loaded.shading, rays, depth, options.half, options.sort));
+        renderer->configure(options, *workgroups, width);
+        rendererDevice = &device;
+        rendererRays = rays;
+        rendererDepth = depth;
+        rendererWidth = width;
+        rendererVersion = loaded.version;
+    }
+    else if (rendererVersion != loaded.version)
+    {
+        renderer->setScene(loaded.scene, loaded.shading);
+        rendererVersion = loaded.version;
+    }
+    renderer->setRays(loaded.rayStarts, loaded.rayDirs);
+
+    Clock trace;
+    renderer->render();
+    const std::vector<cl_float4> colors = renderer->colors();
+    const double traced = trace.stop();
+
+    if (!job.output.empty())
+    {
+        std::vector<uint8_t> bgr = Utility::colorsToBytes(colors, rays, true);
+        const cv::Mat matrix((int)height, (int)width, CV_8UC3, bgr.data());
+        if (!cv::imwrite(job.output, matrix)) throw Utility::WRITE_FILE_EXCEPTION;
+        sendLine(job.client, "ok file " + job.output + " " + std::to_string(traced) + " " + std::to_string(clock.stop()));
+    }
+    else
+    {
+        sendLine(job.client, "ok image " + std::to_string(width) + " " + std::to_string(height) + " " + std::to_string(traced)
+            + " " + std::to_string(clock.stop()));
+        const std::vector<uint8_t> rgb = Utility::colorsToBytes(colors, rays, false);
+        sendAll(job.client, reinterpret_cast<const char*>(rgb.data()), rgb.size());
+    }
+    print_info("Rendered " + (job.scenePath.empty() ? std::string("an inline scene") : job.scenePath) + " at " + std::to_string(width) + "x"
+        + std::to_string(height) + " in " + std::to_string(clock.stop()) + " s, tracing took " + std::to_string(traced) + " s. Buffer pool: "
+        + device.pool.statistics() + ".");
+}
+
+RenderServer::LoadedScene& RenderServer::load(const Job& job, std::unique_ptr<LoadedScene>& inlineScene)
+{
+    std::string content = job.sceneContent;
+    std::filesystem::file_time_type time;
+    if (!job.scenePath.empty())
+    {
+        std::error_code error;
+        time = std::filesystem::last_write_time(job.scenePath, error);
+        if (error) throw Utility::MISSING_FILE_EXCEPTION;
+        auto cached = scenes.find(job.scenePath);
+        if (cached != scenes.end() && cached->second->time == time) return *cached->second;
+
+        std::ifstream file(job.scenePath);
+        if (!file.is_open()) throw Utility::MISSING_FILE_EXCEPTION;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        content = buffer.str();
+    }
+
+    std::unique_ptr<LoadedScene> loaded(new LoadedScene());
+    loaded->inp.interpretString(content);
+    loaded->scene.build(loaded->inp);
+    loaded->shading.build(loaded->inp, loaded->scene);
+    loaded->variables = loaded->inp.variables;
+    loaded->time = time;
+    loaded->version = ++versions;
+
+    if (job.scenePath.empty())
+    {
+        inlineScene = std::move(loaded);
+        return *inlineScene;
+    }
+    std::unique_ptr<LoadedScene>& entry = scenes[job.scenePath];
+    entry = std::move(loaded);
+    return *entry;
+}
+
+Device& RenderServer::deviceFor(const LoadedScene& loaded)
+{
+    const std::string defines = Renderer::defines(loaded.inp, loaded.shading, info, true);
+    std::unique_ptr<Device>& device = devices[defines];
+    if (!device)
+    {
+        print_info("Compiling the kernels for a new program...");
+        device.reset(new Device(info, defines + get_opencl_c_code()));
+    }
+    return *device;
+}
+
+#endif
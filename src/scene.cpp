@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <cmath>
+
+#include <scene.hpp>
+#include <complexobject.hpp>
+#include <fulltransobject.hpp>
+
+using namespace Raytracing;
+
+namespace {
+    bool isIdentity(const Utility::Matrix4x4& m)
+    {
+        for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j < 4; j++)
+                if (m.mat[i][j] != (i == j ? 1. : 0.)) return false;
+        return true;
+    }
+
+    // Upper bound of how much a matrix can stretch a vector, i.e. its largest singular value.
+    // The largest eigenvalue of M^T M is bounded by its largest absolute row sum (Gershgorin),
+    // which is exact for rotations combined with scalings along the axes.
+    double maxStretch(const Utility::Matrix4x4& m)
+    {
+        double res = 0.;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            double row = 0.;
+            for (unsigned j = 0; j < 3; j++)
+            {
+                double mtm = 0.;
+                for (unsigned k = 0; k < 3; k++) mtm += m.mat[k][i] * m.mat[k][j];
+                row += std::abs(mtm);
+            }
+            res = std::max(res, row);
+        }
+        return std::sqrt(res);
+    }
+}
+
+void Scene::build(const Interpreter& inp)
+{
+    *this = Scene();
+    findInstanced(inp.topObject);
+    search(inp.topObject);
+    finish();
+}
+
+size_t Scene::deviceBytes() const noexcept
+{
+    return primitives.size() * sizeof(cl_float4) + primInfo.size() * sizeof(cl_uint) + complexInfo.size() * sizeof(cl_int4) + prototypes.size() * sizeof(cl_int4) + instances.size() * sizeof(cl_float4)
+        + instanceProtos.size() * sizeof(cl_uint) + bvhNodes.size() * sizeof(cl_float4);
+}
+
+void Scene::search(const std::shared_ptr<Object>& obj)
+{
+    const unsigned first = static_cast<unsigned>(found.size());
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        if (fto->obj->type() == ObjectType::Base)
+            addInstance(baseProto(std::dynamic_pointer_cast<BaseObject>(fto->obj)), fto->matrix, fto->invmatrix);
+        else
+            addInstance(complexProto(fto->obj), fto->matrix, fto->invmatrix);
+    }
+    else if (complexProtos.count(obj.get()) || instanced.count(obj.get()))
+    {
+        // A subtree that also has instances elsewhere is used through its prototype as well
+        addInstance(complexProto(obj), Utility::Matrix4x4(), Utility::Matrix4x4());
+    }
+    else if (obj->type() == ObjectType::Complex && std::dynamic_pointer_cast<ComplexObject>(obj)->operation != ComplexOps::Union)
+    {
+        // Intersections and subtractions need the CSG traversal
+        addInstance(complexProto(obj), Utility::Matrix4x4(), Utility::Matrix4x4());
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        // Unions at the top are implicit, every part simply becomes an instance
+        search(std::dynamic_pointer_cast<ComplexObject>(obj)->left);
+        search(std::dynamic_pointer_cast<ComplexObject>(obj)->right);
+    }
+    else if (obj->type() == ObjectType::Base)
+    {
+        addInstance(baseProto(std::dynamic_pointer_cast<BaseObject>(obj)), Utility::Matrix4x4(), Utility::Matrix4x4());
+    }
+    // The tree is searched depth first, so the instances below an object are a range
+    sources[obj.get()].push_back({ first, static_cast<unsigned>(found.size()) });
+}
+
+void Scene::findInstanced(const std::shared_ptr<Object>& obj)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        if (fto->obj->type() != ObjectType::Base) instanced.insert(fto->obj.get());
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        findInstanced(std::dynamic_pointer_cast<ComplexObject>(obj)->left);
+        findInstanced(std::dynamic_pointer_cast<ComplexObject>(obj)->right);
+    }
+}
+
+void Scene::searchPrototype(const std::shared_ptr<Object>& obj, Utility::Matrix4x4 matrix, Utility::Matrix4x4 invmatrix)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        // Nested instances are flattened into the prototype
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        searchPrototype(fto->obj, matrix * fto->matrix, fto->invmatrix * invmatrix);
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        searchPrototype(std::dynamic_pointer_cast<ComplexObject>(obj)->left, matrix, invmatrix);
+        searchPrototype(std::dynamic_pointer_cast<ComplexObject>(obj)->right, matrix, invmatrix);
+    }
+    else if (obj->type() == ObjectType::Base)
+    {
+        const auto p = addPrimitive(std::dynamic_pointer_cast<BaseObject>(obj), matrix, invmatrix);
+        protoBounds.back().grow(p.first);
+        if (p.second) protoUnbounded.back() = true;
+    }
+}
+
+int Scene::searchCsg(const std::shared_ptr<Object>& obj, Utility::Matrix4x4 matrix, Utility::Matrix4x4 invmatrix, AABB& box, bool& unbounded)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+    {
+        auto fto = std::dynamic_pointer_cast<Fulltransform>(obj);
+        return searchCsg(fto->obj, matrix * fto->matrix, fto->invmatrix * invmatrix, box, unbounded);
+    }
+    else if (obj->type() == ObjectType::Complex)
+    {
+        auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+        const int node = static_cast<int>(complexInfo.size());
+        complexInfo.push_back({ 0, 0, Utility::to_underlying(cmp->operation), 0 });
+        AABB lbox, rbox;
+        bool lunb = false, runb = false;
+        const int l = searchCsg(cmp->left, matrix, invmatrix, lbox, lunb);
+        const int r = searchCsg(cmp->right, matrix, invmatrix, rbox, runb);
+        complexInfo[node].s[0] = l;
+        complexInfo[node].s[1] = r;
+
+        // Bounds of the combination: everything for a union, the overlap for an intersection
+        // and the left side for a subtraction
+        switch (cmp->operation)
+        {
+        case ComplexOps::Union:
+            unbounded = lunb || runb;
+            box = lbox;
+            box.grow(rbox);
+            break;
+        case ComplexOps::Intersection:
+            unbounded = lunb && runb;
+            if (lunb) box = rbox;
+            else if (runb) box = lbox;
+            else box = lbox.overlap(rbox);
+            break;
+        case ComplexOps::Subtraction:
+            unbounded = lunb;
+            box = lbox;
+            break;
+        }
+        return node;
+    }
+    // Base objects are referenced by negative indices
+    const int prim = static_cast<int>(primitiveCount());
+    const auto p = addPrimitive(std::dynamic_pointer_cast<BaseObject>(obj), matrix, invmatrix);
+    box = p.first;
+    unbounded = p.second;
+    return -prim - 1;
+}
+
+bool Scene::isUnion(const std::shared_ptr<Object>& obj)
+{
+    if (obj->type() == ObjectType::Fulltransform)
+        return isUnion(std::dynamic_pointer_cast<Fulltransform>(obj)->obj);
+    if (obj->type() == ObjectType::Complex)
+    {
+        auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+        return cmp->operation == ComplexOps::Union && isUnion(cmp->left) && isUnion(cmp->right);
+    }
+    return true;
+}
+
+unsigned Scene::baseProto(const std::shared_ptr<BaseObject>& obj)
+{
+    const auto key = std::make_tuple(static_cast<int>(obj->bt), obj->pos.x(), obj->pos.y(), obj->pos.z(), obj->rd, obj->mat_id);
+    auto it = baseProtos.find(key);
+    if (it != baseProtos.end()) return it->second;
+    const unsigned p = beginProto();
+    Utility::Matrix4x4 id;
+    const auto prim = addPrimitive(obj, id, id);
+    protoBounds.back() = prim.first;
+    protoUnbounded.back() = prim.second;
+    endProto();
+    baseProtos[key] = p;
+    return p;
+}
+
+unsigned Scene::complexProto(const std::shared_ptr<Object>& obj)
+{
+    auto it = complexProtos.find(obj.get());
+    if (it != complexProtos.end()) return it->second;
+    const unsigned p = beginProto();
+    if (isUnion(obj))
+        // Pure unions don't need the CSG traversal, all primitives are simply tested
+        searchPrototype(obj, Utility::Matrix4x4(), Utility::Matrix4x4());
+    else
+    {
+        AABB box;
+        bool unb = false;
+        prototypes.back().s[2] = searchCsg(obj, Utility::Matrix4x4(), Utility::Matrix4x4(), box, unb);
+        protoBounds.back() = box;
+        protoUnbounded.back() = unb;
+    }
+    endProto();
+    complexProtos[obj.get()] = p;
+    return p;
+}
+
+unsigned Scene::beginProto()
+{
+    prototypes.push_back({ static_cast<int>(primitiveCount()), 0, -1, 0 });
+    protoBounds.push_back(AABB());
+    protoUnbounded.push_back(false);
+    return static_cast<unsigned>(prototypes.size() - 1);
+}
+
+void Scene::endProto()
+{
+    prototypes.back().s[1] = static_cast<int>(primitiveCount()) - prototypes.back().s[0];
+}
+
+std::pair<AABB, bool> Scene::addPrimitive(const std::shared_ptr<BaseObject>& obj, const Utility::Matrix4x4& matrix, const Utility::Matrix4x4& invmatrix)
+{
+    // Primitives without transformation don't need the matrix multiplications
+    const bool transformed = !isIdentity(invmatrix);
+    primInfo.push_back((obj->bt == BaseTypes::Sphere ? 0 : PRIM_HALF_PLANE) | (transformed ? PRIM_TRANSFORMED : 0)
+        | (static_cast<cl_uint>(obj->mat_id) << PRIM_MATERIAL_SHIFT));
+    primitives.push_back({
+        static_cast<float>(obj->pos.x()),
+        static_cast<float>(obj->pos.y()),
+        static_cast<float>(obj->pos.z()),
+        static_cast<float>(obj->rd)
+    });
+
+    std::pair<AABB, bool> res = { AABB(), true };
+    cl_float4 bound = { 0.f, 0.f, 0.f, -1.f };
+    if (obj->bt == BaseTypes::Sphere)
+    {
+        const double r = std::abs(obj->rd);
+        res = { AABB(obj->pos - Utility::Vec3(r, r, r), obj->pos + Utility::Vec3(r, r, r)).transformed(matrix), false };
+        // Rays are tested against this before they are transformed into the space of the primitive
+        const auto& m = matrix.mat;
+        const auto& p = obj->pos;
+        bound = {
+            static_cast<float>(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3]),
+            static_cast<float>(m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3]),
+            static_cast<float>(m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]),
+            static_cast<float>(r * maxStretch(matrix) * (1. + 1e-5))
+        };
+    }
+    primitives.push_back(bound);
+
+    // The last row of an affine transformation is always the same
+    const auto& inv = invmatrix.mat;
+    for (unsigned r = 0; r < 3; r++)
+        primitives.push_back({ static_cast<float>(inv[r][0]), static_cast<float>(inv[r][1]), static_cast<float>(inv[r][2]), static_cast<float>(inv[r][3]) });
+    return res;
+}
+
+void Scene::addInstance(unsigned proto, const Utility::Matrix4x4& matrix, const Utility::Matrix4x4& invmatrix)
+{
+    found.push_back({ proto, matrix, invmatrix, protoBounds[proto].transformed(matrix) });
+}
+
+void Scene::setTransform(unsigned instance, const Utility::Matrix4x4& matrix, const Utility::Matrix4x4& invmatrix)
+{
+    auto& inst = found[instance];
+    inst.matrix = matrix;
+    inst.invmatrix = invmatrix;
+    inst.box = protoBounds[inst.proto].transformed(matrix);
+    moved.push_back(instance);
+}
+
+void Scene::getTransform(unsigned instance, Utility::Matrix4x4& matrix, Utility::Matrix4x4& invmatrix) const
+{
+    matrix = found[instance].matrix;
+    invmatrix = found[instance].invmatrix;
+}
+
+std::vector<unsigned> Scene::instancesOf(const Object* obj) const
+{
+    std::vector<unsigned> res;
+    auto it = sources.find(obj);
+    if (it != sources.end())
+        for (const auto& range : it->second)
+            for (unsigned i = range.first; i < range.second; i++) res.push_back(i);
+    return res;
+}
+
+bool Scene::update()
+{
+    changedInstances.clear();
+    changedNodes.clear();
+    if (moved.empty()) return false;
+
+    std::vector<unsigned> movedItems;
+    for (auto i : moved)
+    {
+        writeInstance(i);
+        changedInstances.push_back(slots[i]);
+        if (items[i] != NO_ITEM)
+        {
+            itemBounds[items[i]] = found[i].box;
+            movedItems.push_back(items[i]);
+        }
+    }
+    moved.clear();
+    changedNodes = bvh.refit(itemBounds, movedItems);
+    for (auto n : changedNodes) writeNode(n);
+
+    if (!bvh.degraded()) return false;
+    // Refitting made the hierarchy too loose, so sort everything into a new one
+    const double before = bvh.cost();
+    finish();
+    print_info("Rebuilt the instance hierarchy, its cost went from " + to_string(before, 2u) + " down to " + to_string(bvh.cost(), 2u) + ".");
+    return true;
+}
+
+void Scene::finish()
+{
+    // Unbounded instances come first and are always tested
+    std::vector<unsigned> sorted;
+    std::vector<unsigned> bounded;
+    itemBounds.clear();
+    items.assign(found.size(), NO_ITEM);
+    for (unsigned i = 0; i < found.size(); i++)
+    {
+        if (protoUnbounded[found[i].proto]) sorted.push_back(i);
+        else
+        {
+            items[i] = static_cast<unsigned>(bounded.size());
+            bounded.push_back(i);
+            itemBounds.push_back(found[i].box);
+        }
+    }
+    unbounded = static_cast<unsigned>(sorted.size());
+
+    bvh.build(itemBounds);
+    if (bvh.depth > BVH::MAX_DEPTH)
+        print_error("The instance hierarchy is too deep (" + to_string(bvh.depth) + " levels).");
+    for (auto i : bvh.order) sorted.push_back(bounded[i]);
+
+    slots.resize(found.size());
+    for (unsigned i = 0; i < sorted.size(); i++) slots[sorted[i]] = i;
+    instances.resize(3 * found.size());
+    instanceProtos.resize(found.size());
+    for (unsigned i = 0; i < found.size(); i++) writeInstance(i);
+    bvhNodes.resize(2 * bvh.nodes.size());
+    for (unsigned n = 0; n < bvh.nodes.size(); n++) writeNode(n);
+}
+
+void Scene::writeInstance(unsigned instance)
+{
+    const unsigned slot = slots[instance];
+    const auto& m = found[instance].invmatrix.mat;
+    for (unsigned r = 0; r < 3; r++)
+        instances[3 * slot + r] = { static_cast<float>(m[r][0]), static_cast<float>(m[r][1]), static_cast<float>(m[r][2]), static_cast<float>(m[r][3]) };
+    // Top level primitives are instances as well, most of them without a transformation the device can skip
+    instanceProtos[slot] = found[instance].proto | (isIdentity(found[instance].invmatrix) ? INSTANCE_IDENTITY : 0);
+}
+
+void Scene::writeNode(unsigned node)
+{
+    const auto& n = bvh.nodes[node];
+    // Widen the box a bit so rounding to float can't make it smaller
+    const double e = 1e-4 * (1. + std::max(n.box.hi.len(), n.box.lo.len()));
+    // Leaves reference the instances directly, so the unbounded ones have to be skipped
+    const unsigned first = n.count > 0 ? n.first + unbounded : n.first;
+    bvhNodes[2 * node] = { static_cast<float>(n.box.lo.x() - e), static_cast<float>(n.box.lo.y() - e), static_cast<float>(n.box.lo.z() - e), as_float(first) };
+    bvhNodes[2 * node + 1] = { static_cast<float>(n.box.hi.x() + e), static_cast<float>(n.box.hi.y() + e), static_cast<float>(n.box.hi.z() + e), as_float(n.count) };
+}
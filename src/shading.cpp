@@ -0,0 +1,119 @@
+#include <algorithm>
+
+#include <shading.hpp>
+#include <bvh.hpp>
+
+using namespace Raytracing;
+
+void Shading::build(const Interpreter& inp, const Scene& scene)
+{
+    materials.assign(inp.materials.size(), MaterialRecord());
+    for (const auto& i : inp.materials)
+    {
+        if (i.second->mat_id >= materials.size()) materials.resize(i.second->mat_id + 1, MaterialRecord());
+        materials[i.second->mat_id] = {
+            static_cast<float>(i.second->ambref),
+            static_cast<float>(i.second->diffref),
+            static_cast<float>(i.second->specref),
+            static_cast<float>(i.second->rflec),
+            static_cast<float>(i.second->rfrac),
+            static_cast<float>(i.second->rfracind),
+            static_cast<float>(i.second->shiny),
+            static_cast<float>(i.second->color.x()),
+            static_cast<float>(i.second->color.y()),
+            static_cast<float>(i.second->color.z())
+        };
+    }
+
+    // Lights reaching everything come first and are always visited, the others are sorted into a hierarchy over the spheres they reach
+    std::vector<LightRecord> bounded;
+    std::vector<AABB> reach;
+    lights.clear();
+    for (const auto& i : inp.lightSources)
+    {
+        const LightRecord light = {
+            static_cast<float>(i.second->pos.x()),
+            static_cast<float>(i.second->pos.y()),
+            static_cast<float>(i.second->pos.z()),
+            static_cast<float>(i.second->color.x()),
+            static_cast<float>(i.second->color.y()),
+            static_cast<float>(i.second->color.z()),
+            static_cast<float>(i.second->radius)
+        };
+        if (light.radius <= 0.f)
+        {
+            lights.push_back(light);
+            continue;
+        }
+        bounded.push_back(light);
+        const Utility::Vec3 r(i.second->radius, i.second->radius, i.second->radius);
+        reach.push_back(AABB(i.second->pos - r, i.second->pos + r));
+    }
+    const cl_uint unboundedLights = static_cast<cl_uint>(lights.size());
+    BVH bvh;
+    bvh.build(reach);
+    for (unsigned i : bvh.order) lights.push_back(bounded[i]);
+    lightNodes.clear();
+    for (const BVH::Node& n : bvh.nodes)
+    {
+        // Widen the box a bit so rounding to float can't make it smaller, leaves reference lights after the unbounded ones
+        const double e = 1e-4 * (1. + std::max(n.box.hi.len(), n.box.lo.len()));
+        const cl_uint first = n.count > 0 ? n.first + unboundedLights : n.first;
+        lightNodes.push_back({ static_cast<float>(n.box.lo.x() - e), static_cast<float>(n.box.lo.y() - e), static_cast<float>(n.box.lo.z() - e), as_float(first) });
+        lightNodes.push_back({ static_cast<float>(n.box.hi.x() + e), static_cast<float>(n.box.hi.y() + e), static_cast<float>(n.box.hi.z() + e), as_float(n.count) });
+    }
+
+    header.ambient[0] = static_cast<float>(inp.variables.at("ambient_r"));
+    header.ambient[1] = static_cast<float>(inp.variables.at("ambient_g"));
+    header.ambient[2] = static_cast<float>(inp.variables.at("ambient_b"));
+    header.ambientIntensity[0] = static_cast<float>(inp.variables.at("ambient_int_r"));
+    header.ambientIntensity[1] = static_cast<float>(inp.variables.at("ambient_int_g"));
+    header.ambientIntensity[2] = static_cast<float>(inp.variables.at("ambient_int_b"));
+    header.instances = scene.instanceCount();
+    header.lights = static_cast<cl_uint>(lights.size());
+    header.unbounded = scene.unbounded;
+    // Every light is in the tree it is sampled with, including the ones in the hierarchy above
+    std::vector<AABB> positions;
+    for (const LightRecord& light : lights)
+    {
+        const Utility::Vec3 pos(light.x, light.y, light.z);
+        positions.push_back(AABB(pos, pos));
+    }
+    BVH tree;
+    tree.build(positions);
+    lightOrder.assign(tree.order.begin(), tree.order.end());
+    lightTree.assign(3 * tree.nodes.size(), cl_float4 { 0.f, 0.f, 0.f, 0.f });
+    // Children come after their parent, so going backwards sums the power bottom-up
+    for (size_t i = tree.nodes.size(); i-- > 0;)
+    {
+        const BVH::Node& n = tree.nodes[i];
+        float power = 0.f;
+        if (n.count > 0)
+            for (unsigned j = n.first; j < n.first + n.count; j++) power += Shading::power(lights[tree.order[j]]);
+        else power = lightTree[3 * n.first + 2].s[0] + lightTree[3 * (n.first + 1) + 2].s[0];
+        lightTree[3 * i] = { static_cast<float>(n.box.lo.x()), static_cast<float>(n.box.lo.y()), static_cast<float>(n.box.lo.z()), as_float(n.first) };
+        lightTree[3 * i + 1] = { static_cast<float>(n.box.hi.x()), static_cast<float>(n.box.hi.y()), static_cast<float>(n.box.hi.z()), as_float(n.count) };
+        lightTree[3 * i + 2] = { power, 0.f, 0.f, 0.f };
+    }
+
+    header.nodes = scene.nodeCount();
+    header.unboundedLights = unboundedLights;
+    header.lightNodes = static_cast<cl_uint>(bvh.nodes.size());
+    header.lightTree = static_cast<cl_uint>(tree.nodes.size());
+}
+
+float Shading::power(const LightRecord& light) noexcept
+{
+    return std::max(std::max(std::max(light.r, light.g), light.b), 0.001f);
+}
+
+size_t Shading::tableBytes() const noexcept
+{
+    return materials.size() * sizeof(MaterialRecord) + lights.size() * sizeof(LightRecord)
+        + (lightNodes.size() + lightTree.size()) * sizeof(cl_float4) + lightOrder.size() * sizeof(cl_uint);
+}
+
+bool Shading::fitsConstant(const Device_Info& info) const noexcept
+{
+    return tableBytes() + sizeof(SceneHeader) <= 1024ull * info.max_constant_buffer;
+}
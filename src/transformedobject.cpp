@@ -3,10 +3,10 @@
 
 namespace Raytracing {
 
-Utility::Matrix4x4 TransformedObject::getMatrix()
+Utility::Matrix4x4 TransformedObject::opMatrix(TransformOps op, const Utility::Vec3& scale)
 {
     Utility::Matrix4x4 res;
-    switch(this->op)
+    switch(op)
     {
     case TransformOps::Scale:
         res.mat[0][0] = scale.x();
@@ -37,16 +37,13 @@ Utility::Matrix4x4 TransformedObject::getMatrix()
         res.mat[2][3] = scale.z();
         break;
     }
-    if (obj->type() == ObjectType::Transformed)
-        res = std::dynamic_pointer_cast<Raytracing::TransformedObject>(obj)->getMatrix() * res;
-
     return res;
 }
 
-Utility::Matrix4x4 TransformedObject::getInverseMatrix()
+Utility::Matrix4x4 TransformedObject::opInverseMatrix(TransformOps op, const Utility::Vec3& scale)
 {
     Utility::Matrix4x4 res;
-    switch(this->op)
+    switch(op)
     {
     case TransformOps::Scale:
         res.mat[0][0] = 1. / scale.x();
@@ -77,6 +74,21 @@ Utility::Matrix4x4 TransformedObject::getInverseMatrix()
         res.mat[2][3] = -scale.z();
         break;
     }
+    return res;
+}
+
+Utility::Matrix4x4 TransformedObject::getMatrix()
+{
+    Utility::Matrix4x4 res = opMatrix(this->op, this->scale);
+    if (obj->type() == ObjectType::Transformed)
+        res = std::dynamic_pointer_cast<Raytracing::TransformedObject>(obj)->getMatrix() * res;
+
+    return res;
+}
+
+Utility::Matrix4x4 TransformedObject::getInverseMatrix()
+{
+    Utility::Matrix4x4 res = opInverseMatrix(this->op, this->scale);
     if (obj->type() == ObjectType::Transformed)
         res = res * std::dynamic_pointer_cast<Raytracing::TransformedObject>(obj)->getInverseMatrix();
 
@@ -77,4 +77,31 @@ Utility::AutoArray<uint8_t> Utility::openclMemToArray(const Memory<cl_float3>& o
 		result.array[3 * i + 2] = static_cast<uint8_t>(other[i].v4[0] * 255.);
 	}
 	return result;
-}
\ No newline at end of file
+}
+
+Utility::AutoArray<uint8_t> Utility::openclMemToArray(const std::vector<cl_float4>& other)
+{
+	Utility::AutoArray<uint8_t> result(other.size() * 3);
+	for (size_t i = 0; i < other.size(); i++)
+	{
+		// OpenCV pixel format is BGR instead of RGB so we also need to flip this
+		result.array[3 * i + 0] = static_cast<uint8_t>(other[i].s[2] * 255.);
+		result.array[3 * i + 1] = static_cast<uint8_t>(other[i].s[1] * 255.);
+		result.array[3 * i + 2] = static_cast<uint8_t>(other[i].s[0] * 255.);
+	}
+	return result;
+}
+
+std::vector<uint8_t> Utility::colorsToBytes(const std::vector<cl_float4>& colors, size_t count, bool bgr)
+{
+	std::vector<uint8_t> result(3 * count);
+	for (size_t i = 0; i < count; i++)
+	{
+		for (unsigned c = 0; c < 3; c++)
+		{
+			const float v = std::min(1.f, std::max(0.f, colors[i].s[c]));
+			result[3 * i + (bgr ? 2 - c : c)] = static_cast<uint8_t>(v * 255.f);
+		}
+	}
+	return result;
+}
@@ -0,0 +1,117 @@
+#include <iostream>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <bvh.hpp>
+
+using namespace Raytracing;
+
+// Checks that refitting a hierarchy after moving items gives the same bounds as computing all of them again,
+// that only nodes above moved items are reported, and that a hierarchy scrambled by refits asks to be rebuilt.
+
+namespace {
+
+    unsigned failed = 0;
+
+    void check(bool ok, const std::string& what)
+    {
+        if (ok) return;
+        std::cerr << "Failed: " << what << std::endl;
+        failed++;
+    }
+
+    AABB box(std::mt19937& rng, double spread)
+    {
+        std::uniform_real_distribution<double> u(-spread, spread);
+        const Utility::Vec3 c(u(rng), u(rng), u(rng));
+        return AABB(c - Utility::Vec3(1., 1., 1.), c + Utility::Vec3(1., 1., 1.));
+    }
+
+    bool same(const AABB& a, const AABB& b)
+    {
+        for (unsigned i = 0; i < 3; i++)
+            if (a.lo.vals[i] != b.lo.vals[i] || a.hi.vals[i] != b.hi.vals[i]) return false;
+        return true;
+    }
+
+    // Bounds of every node computed from scratch, children always come after their parent
+    std::vector<AABB> recompute(const BVH& bvh, const std::vector<AABB>& bounds)
+    {
+        std::vector<AABB> res(bvh.nodes.size());
+        for (size_t n = bvh.nodes.size(); n-- > 0;)
+        {
+            const BVH::Node& node = bvh.nodes[n];
+            if (node.count > 0)
+                for (unsigned i = node.first; i < node.first + node.count; i++) res[n].grow(bounds[bvh.order[i]]);
+            else
+            {
+                res[n].grow(res[node.first]);
+                res[n].grow(res[node.first + 1]);
+            }
+        }
+        return res;
+    }
+
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<AABB> bounds;
+    for (unsigned i = 0; i < 20000; i++) bounds.push_back(box(rng, 100.));
+    BVH bvh;
+    bvh.build(bounds);
+
+    std::multiset<unsigned> items(bvh.order.begin(), bvh.order.end());
+    check(items.size() == bounds.size() && std::set<unsigned>(items.begin(), items.end()).size() == bounds.size(), "the leaves don't hold every item once");
+    check(bvh.depth <= BVH::MAX_DEPTH, "the hierarchy is deeper than the device can traverse");
+    check(!bvh.degraded(), "a hierarchy that was just built asks to be rebuilt");
+    const std::vector<AABB> built = recompute(bvh, bounds);
+    bool matches = true;
+    for (size_t n = 0; n < bvh.nodes.size(); n++) matches = matches && same(built[n], bvh.nodes[n].box);
+    check(matches, "building gave other bounds than computing them from the items");
+
+    for (unsigned frame = 0; frame < 8; frame++)
+    {
+        // Few items move a bit, as in an animation
+        std::vector<unsigned> moved;
+        for (unsigned k = 0; k < 200; k++)
+        {
+            const unsigned i = rng() % bounds.size();
+            const Utility::Vec3 shift(0.5, -0.25, 0.125);
+            bounds[i] = AABB(bounds[i].lo + shift, bounds[i].hi + shift);
+            moved.push_back(i);
+        }
+        const std::vector<AABB> before = recompute(bvh, bounds);
+        std::vector<AABB> old;
+        for (const BVH::Node& node : bvh.nodes) old.push_back(node.box);
+        const std::vector<unsigned> dirty = bvh.refit(bounds, moved);
+        const std::set<unsigned> reported(dirty.begin(), dirty.end());
+
+        unsigned wrong = 0, missing = 0;
+        for (unsigned n = 0; n < bvh.nodes.size(); n++)
+        {
+            if (!same(before[n], bvh.nodes[n].box)) wrong++;
+            if (!same(old[n], bvh.nodes[n].box) && !reported.count(n)) missing++;
+        }
+        check(wrong == 0, "frame " + std::to_string(frame) + ": " + std::to_string(wrong) + " nodes have other bounds than computed from scratch");
+        check(missing == 0, "frame " + std::to_string(frame) + ": " + std::to_string(missing) + " changed nodes weren't reported");
+        check(dirty.size() < bvh.nodes.size() / 2, "frame " + std::to_string(frame) + ": refitting touched most of the hierarchy");
+    }
+
+    // Scattering all items across the scene leaves the hierarchy useless
+    std::vector<unsigned> all;
+    for (unsigned i = 0; i < bounds.size(); i++)
+    {
+        bounds[i] = box(rng, 100.);
+        all.push_back(i);
+    }
+    bvh.refit(bounds, all);
+    check(bvh.degraded(), "a scrambled hierarchy doesn't ask to be rebuilt");
+    bvh.build(bounds);
+    check(!bvh.degraded(), "rebuilding didn't reset the cost");
+
+    if (failed == 0) std::cout << "Refitting the hierarchy gives the same bounds as computing them again." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
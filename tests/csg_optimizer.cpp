@@ -0,0 +1,120 @@
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <csgoptimizer.hpp>
+#include <baseobject.hpp>
+#include <complexobject.hpp>
+
+using namespace Raytracing;
+
+// Checks that the rewrites of CsgOptimizer keep every point in or out of the tree where it was,
+// and that chains and operands that can't overlap are actually rewritten.
+
+namespace {
+
+    unsigned failed = 0;
+
+    void check(bool ok, const std::string& what)
+    {
+        if (ok) return;
+        std::cerr << "Failed: " << what << std::endl;
+        failed++;
+    }
+
+    std::shared_ptr<Object> sphere(double x, double y, double z, double r)
+    {
+        return std::make_shared<BaseObject>(BaseTypes::Sphere, x, y, z, r, 0u);
+    }
+
+    std::shared_ptr<Object> combine(ComplexOps op, std::shared_ptr<Object> left, std::shared_ptr<Object> right)
+    {
+        return std::make_shared<ComplexObject>(op, left, right);
+    }
+
+    bool inside(const std::shared_ptr<Object>& obj, const Utility::Vec3& p)
+    {
+        if (obj->type() == ObjectType::Base)
+        {
+            auto base = std::dynamic_pointer_cast<BaseObject>(obj);
+            return (p - base->pos).len() < base->rd;
+        }
+        auto cmp = std::dynamic_pointer_cast<ComplexObject>(obj);
+        const bool l = inside(cmp->left, p);
+        const bool r = inside(cmp->right, p);
+        if (cmp->operation == ComplexOps::Union) return l || r;
+        if (cmp->operation == ComplexOps::Intersection) return l && r;
+        return l && !r;
+    }
+
+    std::shared_ptr<Object> generate(std::mt19937& rng, unsigned depth)
+    {
+        std::uniform_real_distribution<double> u(0., 1.);
+        if (depth == 0 || u(rng) < 0.2) return sphere(10. * u(rng) - 5., 10. * u(rng) - 5., 10. * u(rng) - 5., 0.5 + 2.5 * u(rng));
+        return combine(static_cast<ComplexOps>(rng() % 3), generate(rng, depth - 1), generate(rng, depth - 1));
+    }
+
+    void randomTrees()
+    {
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> u(-8., 8.);
+        for (unsigned i = 0; i < 500; i++)
+        {
+            const std::shared_ptr<Object> top = generate(rng, 1 + i % 7);
+            std::vector<Utility::Vec3> points;
+            std::vector<bool> before;
+            for (unsigned k = 0; k < 500; k++)
+            {
+                points.push_back(Utility::Vec3(u(rng), u(rng), u(rng)));
+                before.push_back(inside(top, points.back()));
+            }
+            CsgOptimizer optimizer;
+            const std::shared_ptr<Object> res = optimizer.optimize(top);
+            unsigned moved = 0;
+            for (unsigned k = 0; k < points.size(); k++)
+                if (inside(res, points[k]) != before[k]) moved++;
+            check(moved == 0, "tree " + std::to_string(i) + " classifies " + std::to_string(moved) + " points differently after optimizing");
+            check(optimizer.nodesAfter <= optimizer.nodesBefore, "tree " + std::to_string(i) + " got more complex objects");
+        }
+    }
+
+    void chains()
+    {
+        // A left-leaning chain of 16 unions becomes a balanced tree
+        std::shared_ptr<Object> chain = sphere(0., 0., 0., 1.);
+        for (unsigned i = 1; i < 16; i++) chain = combine(ComplexOps::Union, chain, sphere(3. * i, 0., 0., 1.));
+        CsgOptimizer unions;
+        unions.optimize(chain);
+        check(unions.heightBefore == 15 && unions.heightAfter == 4, "a chain of unions wasn't balanced");
+
+        // A chain of subtractions becomes one subtraction of a balanced union
+        std::shared_ptr<Object> cut = sphere(0., 0., 0., 10.);
+        for (unsigned i = 0; i < 8; i++) cut = combine(ComplexOps::Subtraction, cut, sphere(2. * i - 7., 0., 0., 1.));
+        CsgOptimizer subtractions;
+        subtractions.optimize(cut);
+        check(subtractions.heightAfter == 4, "a chain of subtractions wasn't turned into the subtraction of a balanced union");
+    }
+
+    void pruning()
+    {
+        // The intersection can't contain anything and the subtraction can't remove anything
+        const std::shared_ptr<Object> top = combine(ComplexOps::Union,
+            combine(ComplexOps::Intersection, sphere(0., 0., 0., 1.), sphere(5., 0., 0., 1.)),
+            combine(ComplexOps::Subtraction, sphere(0., 5., 0., 1.), sphere(0., -5., 0., 1.)));
+        CsgOptimizer optimizer;
+        const std::shared_ptr<Object> res = optimizer.optimize(top);
+        check(optimizer.pruned == 2, "disjoint operands weren't pruned");
+        check(optimizer.nodesAfter == 0 && res->type() == ObjectType::Base, "pruning didn't leave the only visible sphere");
+    }
+
+}
+
+int main()
+{
+    randomTrees();
+    chains();
+    pruning();
+    if (failed == 0) std::cout << "The csg optimizer keeps every tree the same." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
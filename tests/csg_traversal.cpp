@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+// Defined in kernel.cpp
+std::string opencl_c_container();
+
+// Checks the stack based CSG traversal of the kernel against a brute force classification.
+// Rays are reduced to one dimension: every primitive is the interval a ray spends inside it, entered at a and left at b.
+// The traversal below follows csg_closest step by step and uses the action table and flags of the kernel source,
+// the expected hit is the first distance at which a point moving along the ray enters or leaves the whole tree.
+
+namespace {
+
+    const int STACK_SIZE = 16;
+    const double T_MIN = 0.00001;
+
+    // Hit on a primitive or tree, sign is the sign of dot(normal, dir): -1 entering, 1 leaving. w is -1 for a miss.
+    struct Hit {
+        double sign;
+        double w;
+    };
+    const Hit MISS = { 0., -1. };
+
+    // Per complex node: left, right (negative values -i - 1 reference primitive i), operation
+    struct Node {
+        int left, right, op;
+    };
+
+    std::map<std::string, int> actions;
+    std::vector<int> table;
+
+    std::string between(const std::string& s, const std::string& from, const std::string& to)
+    {
+        const size_t first = s.find(from);
+        if (first == std::string::npos) return "";
+        const size_t begin = first + from.size();
+        return s.substr(begin, s.find(to, begin) - begin);
+    }
+
+    std::string trim(const std::string& s)
+    {
+        const size_t first = s.find_first_not_of(' ');
+        if (first == std::string::npos) return "";
+        return s.substr(first, s.find_last_not_of(' ') - first + 1);
+    }
+
+    std::vector<std::string> split(const std::string& s, char c)
+    {
+        std::vector<std::string> res(1);
+        for (char x : s)
+        {
+            if (x == c) res.emplace_back();
+            else res.back() += x;
+        }
+        return res;
+    }
+
+    // Reads enum csg_action and csg_table from the kernel, returns false if they can't be found
+    bool readTable()
+    {
+        const std::string code = opencl_c_container();
+        for (const std::string& entry : split(between(code, "enum csg_action {", "}"), ','))
+        {
+            const std::vector<std::string> parts = split(entry, '=');
+            if (parts.size() == 2) actions[trim(parts[0])] = std::stoi(trim(parts[1]));
+        }
+        for (const std::string& entry : split(between(code, "csg_table[27] = {", "}"), ','))
+        {
+            int act = 0;
+            for (const std::string& name : split(entry, '|'))
+            {
+                if (!actions.count(trim(name))) return false;
+                act |= actions[trim(name)];
+            }
+            table.push_back(act);
+        }
+        return actions.size() == 10 && table.size() == 27;
+    }
+
+    bool is(int act, const char* name)
+    {
+        return (act & actions.at(name)) != 0;
+    }
+
+    Hit leaf(const std::vector<std::pair<double, double>>& prims, int ref, double t_min)
+    {
+        const auto& p = prims[-ref - 1];
+        if (p.first > t_min) return { -1., p.first };
+        if (p.second > t_min) return { 1., p.second };
+        return MISS;
+    }
+
+    int state(const Hit& hit)
+    {
+        if (hit.w < 0.) return 2;
+        return hit.sign < 0. ? 0 : 1;
+    }
+
+    // csg_closest on intervals
+    Hit closest(const std::vector<Node>& nodes, const std::vector<std::pair<double, double>>& prims, int root)
+    {
+        int state_stack[STACK_SIZE];
+        double time_stack[STACK_SIZE][2];
+        Hit prim_stack[2 * STACK_SIZE];
+
+        const int FIRST_LEFT = 0;
+        const int LEFT = 1;
+        const int RIGHT = 2;
+
+        int head = -1;
+        int node = root;
+        double t_min = T_MIN;
+        Hit res = MISS;
+
+        while (true)
+        {
+            if (node >= 0)
+            {
+                if (head == STACK_SIZE - 1) return MISS;
+                head++;
+                state_stack[head] = 4 * node + FIRST_LEFT;
+                time_stack[head][0] = time_stack[head][1] = t_min;
+                const int left = nodes[node].left;
+                if (left >= 0)
+                {
+                    node = left;
+                    continue;
+                }
+                res = leaf(prims, left, t_min);
+                node = -1;
+            }
+            if (head < 0) return res;
+
+            const int cur = state_stack[head] / 4;
+            const int step = state_stack[head] % 4;
+            const Node& info = nodes[cur];
+            prim_stack[step == RIGHT ? 2 * head + 1 : 2 * head] = res;
+
+            bool goLeft = false;
+            if (step != FIRST_LEFT)
+            {
+                const Hit l = prim_stack[2 * head];
+                const Hit r = prim_stack[2 * head + 1];
+                const int act = table[9 * info.op + 3 * state(l) + state(r)];
+                if (is(act, "CSG_MISS"))
+                {
+                    res = MISS;
+                    head--;
+                    continue;
+                }
+                if (is(act, "CSG_RET_L") || (is(act, "CSG_RET_L_IF_CLOSER") && l.w <= r.w))
+                {
+                    res = l;
+                    head--;
+                    continue;
+                }
+                if (is(act, "CSG_RET_R") || (is(act, "CSG_RET_R_IF_CLOSER") && r.w < l.w))
+                {
+                    res = is(act, "CSG_FLIP_R") ? Hit{ -r.sign, r.w } : r;
+                    head--;
+                    continue;
+                }
+                if (is(act, "CSG_LOOP_L") || (is(act, "CSG_LOOP_L_IF_CLOSER") && l.w <= r.w))
+                {
+                    time_stack[head][0] = l.w;
+                    goLeft = true;
+                }
+                else if (is(act, "CSG_LOOP_R") || (is(act, "CSG_LOOP_R_IF_CLOSER") && r.w < l.w))
+                    time_stack[head][1] = r.w;
+                else
+                {
+                    res = MISS;
+                    head--;
+                    continue;
+                }
+            }
+
+            const int child = goLeft ? info.left : info.right;
+            t_min = goLeft ? time_stack[head][0] : time_stack[head][1];
+            state_stack[head] = 4 * cur + (goLeft ? LEFT : RIGHT);
+            if (child >= 0) node = child;
+            else res = leaf(prims, child, t_min);
+        }
+    }
+
+    bool inside(const std::vector<Node>& nodes, const std::vector<std::pair<double, double>>& prims, int ref, double t)
+    {
+        if (ref < 0) return prims[-ref - 1].first < t && t < prims[-ref - 1].second;
+        const bool l = inside(nodes, prims, nodes[ref].left, t);
+        const bool r = inside(nodes, prims, nodes[ref].right, t);
+        if (nodes[ref].op == 0) return l || r;
+        if (nodes[ref].op == 1) return l && r;
+        return l && !r;
+    }
+
+    // First change of the classification after T_MIN
+    Hit bruteForce(const std::vector<Node>& nodes, const std::vector<std::pair<double, double>>& prims, int root)
+    {
+        std::vector<double> ends;
+        for (const auto& p : prims)
+        {
+            ends.push_back(p.first);
+            ends.push_back(p.second);
+        }
+        std::sort(ends.begin(), ends.end());
+        const double e = 1e-9;
+        for (double t : ends)
+        {
+            if (t <= T_MIN) continue;
+            const bool before = inside(nodes, prims, root, t - e);
+            const bool after = inside(nodes, prims, root, t + e);
+            if (before != after) return { after ? -1. : 1., t };
+        }
+        return MISS;
+    }
+
+    int generate(std::mt19937& rng, std::vector<Node>& nodes, std::vector<std::pair<double, double>>& prims, unsigned depth, bool complex)
+    {
+        std::uniform_real_distribution<double> u(0., 1.);
+        if (depth == 0 || (!complex && u(rng) < 0.3))
+        {
+            const double a = -2. + 12. * u(rng);
+            prims.push_back({ a, a + 0.1 + 5. * u(rng) });
+            return -static_cast<int>(prims.size());
+        }
+        const int node = static_cast<int>(nodes.size());
+        nodes.push_back({ 0, 0, static_cast<int>(rng() % 3) });
+        const int left = generate(rng, nodes, prims, depth - 1, false);
+        const int right = generate(rng, nodes, prims, depth - 1, false);
+        nodes[node].left = left;
+        nodes[node].right = right;
+        return node;
+    }
+
+}
+
+int main()
+{
+    if (!readTable())
+    {
+        std::cerr << "Can't read the csg action table from the kernel." << std::endl;
+        return 1;
+    }
+
+    std::mt19937 rng(1);
+    unsigned failed = 0;
+    const unsigned trees = 20000;
+    for (unsigned i = 0; i < trees; i++)
+    {
+        std::vector<Node> nodes;
+        std::vector<std::pair<double, double>> prims;
+        const int root = generate(rng, nodes, prims, 1 + i % 6, true);
+        const Hit got = closest(nodes, prims, root);
+        const Hit expected = bruteForce(nodes, prims, root);
+        if (got.w != expected.w || (expected.w >= 0. && got.sign != expected.sign))
+        {
+            if (failed++ < 10)
+                std::cerr << "Tree " << i << ": traversal hit " << got.w << " (" << got.sign << "), brute force " << expected.w
+                    << " (" << expected.sign << ")" << std::endl;
+        }
+    }
+    std::cout << trees - failed << " of " << trees << " random csg trees hit where the brute force classification does." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <options.hpp>
+
+using namespace Raytracing;
+
+// Checks that command lines are read into the options and that broken ones are rejected.
+
+namespace {
+
+    unsigned failed = 0;
+
+    void check(bool ok, const std::string& what)
+    {
+        if (ok) return;
+        std::cerr << "Failed: " << what << std::endl;
+        failed++;
+    }
+
+    Options parse(std::vector<std::string> args)
+    {
+        args.insert(args.begin(), "raytracing");
+        std::vector<char*> argv;
+        for (std::string& arg : args) argv.push_back(&arg[0]);
+        return Options::parse(static_cast<int>(argv.size()), argv.data());
+    }
+
+    bool rejected(const std::vector<std::string>& args)
+    {
+        try
+        {
+            parse(args);
+        }
+        catch (Utility::Exception e)
+        {
+            return e.id == Utility::INVALID_OPTION_EXCEPTION.id;
+        }
+        return false;
+    }
+
+}
+
+int main()
+{
+    const Options defaults = parse({});
+    check(defaults.file == "input.rti" && defaults.samples == 1 && defaults.lightSamples == 0 && defaults.passes == 64,
+        "the defaults changed");
+    check(defaults.minWeight == 0.f && defaults.roulette == 0.f, "rays are cut off by default");
+
+    const Options options = parse({ "scene.rti", "--half", "--sort", "--samples", "4", "--adaptive", "0.05", "--min-weight", "0.002",
+        "--roulette", "0.1", "--light-samples", "2", "--passes", "16", "--format", "y4m", "--fps", "25", "--select", "flops" });
+    check(options.file == "scene.rti" && options.half && options.sort, "the file and flags weren't read");
+    check(options.samples == 4 && options.adaptive == 0.05f && options.minWeight == 0.002f && options.roulette == 0.1f,
+        "the sampling options weren't read");
+    check(options.lightSamples == 2 && options.passes == 16, "the light sampling options weren't read");
+    check(options.format == "y4m" && options.fps == 25 && options.select == "flops", "the output options weren't read");
+
+    check(rejected({ "--unknown" }), "an unknown option was accepted");
+    check(rejected({ "a.rti", "b.rti" }), "a second file was accepted");
+    check(rejected({ "--samples", "0" }), "zero samples were accepted");
+    check(rejected({ "--min-weight", "1" }), "a minimum weight of 1 was accepted");
+    check(rejected({ "--format", "bmp" }), "an unknown format was accepted");
+    check(rejected({ "--select", "fastest" }), "an unknown device selection was accepted");
+
+    if (failed == 0) std::cout << "Command lines are read as expected." << std::endl;
+    return failed == 0 ? 0 : 1;
+}